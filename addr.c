@@ -50,7 +50,7 @@ recip *alloc_recip(int *recippcount) {
 
     recip	*recipp;		/* returned: blank recipient */
     
-    recipp = (recip *) mallocf(sizeof(recip));
+    recipp = (recip *) slab_alloc(SLAB_RECIP);
     
     recipp->next = recipp;		/* head & tail of list */
     recipp->name[0] = 0;
@@ -77,7 +77,7 @@ void copy_recip(recip *r, recip **l) {
 
     recip	*new;			/* copy of recip */
 
-    new = mallocf(sizeof(recip));
+    new = slab_alloc(SLAB_RECIP);
     *new = *r;				/* copy recip from master list */
     if (!*l)				/* first? */
 	new->next = new; 		/* link to self */
@@ -95,15 +95,15 @@ void copy_recip(recip *r, recip **l) {
 
 void free_recips(recip **rlist) {
 
-    recip 	*p, *pp;
+    recip 	*p;
+    long	n;			/* list length */
     
     if (*rlist) {
-	p = (*rlist)->next;		/* find head */
-	(*rlist)->next = NULL;		/* break circular list */
-	while(p) {			/* traverse list freeing */
-	    pp = p; p = p->next;
-	    t_free(pp);
-	}
+	n = 1;				/* count the list */
+	for (p = (*rlist)->next; p != *rlist; p = p->next)
+	    ++n;
+	/* whole list back to the slab at once: head ... tail */
+	slab_freechain(SLAB_RECIP, (*rlist)->next, *rlist, n);
     }
     
     *rlist = NULL;			/* sppml */
@@ -507,7 +507,7 @@ void sresolve(char *inname, recip **r, int depth, mbox *mb, mbox *mlmb, int *rec
     if (local(name)) {				/* address is <something>@mac */
 	/* handle DND address that points to global mailing list */
 	if (globallist(name, &rlist, depth, mb, recipcount)) {
-	    t_free((char *) *r);		/* don't need fragmentary recip */
+	    slab_free(SLAB_RECIP, *r);		/* don't need fragmentary recip */
 	    *r = rlist;				/* since we have this whole big list */
 	    return;
 	}
@@ -64,6 +64,7 @@ void doshutdown();
 int main (int argc, char **argv) {
         
     pthread_t thread;		/* thread var */
+    int		i;
 
     setup_signals();		/* standard setup for synchronous signals */
     
@@ -76,6 +77,7 @@ int main (int argc, char **argv) {
     t_dndinit();		/* and dnd package */
 
     read_config();		/* read configuration file */
+    work_init();		/* start connection worker pool */
     
     /* don't try to start DDP if appletalk disabled */
     if (!m_noappletalk && !ddpinit())	/* start ddp package */
@@ -149,6 +151,34 @@ int main (int argc, char **argv) {
     }
     pthread_detach(&thread);
        
+    /* start up thread to evict box data when over budget */
+    if (pthread_create(&thread, generic_attr,
+                   (pthread_startroutine_t) mbox_evictor, (pthread_addr_t) 0) < 0) {
+	t_perror("mbox_evictor pthread_create failed");
+	exit(1);
+    }
+    pthread_detach(&thread);
+
+    /* start up thread to expire a slice of boxes at a time */
+    if (exp_trickle) {
+	if (pthread_create(&thread, generic_attr,
+		       (pthread_startroutine_t) exptrickle, (pthread_addr_t) 0) < 0) {
+	    t_perror("exptrickle pthread_create failed");
+	    exit(1);
+	}
+	pthread_detach(&thread);
+    }
+
+    /* start up a writer thread for each filesystem */
+    for (i = 0; i < m_filesys_count; ++i) {
+	if (pthread_create(&thread, generic_attr,
+		       (pthread_startroutine_t) mbox_fswriter, (pthread_addr_t) (long) i) < 0) {
+	    t_perror("mbox_fswriter pthread_create failed");
+	    exit(1);
+	}
+	pthread_detach(&thread);
+    }
+
     /* main thread will write changes periodically */
     (void) mbox_writer((any_t) 0);
         
@@ -158,7 +188,7 @@ int main (int argc, char **argv) {
 /* listener --
 
     Set up a socket listening for client connections.  When one arrives,
-    accept it and spawn a thread to deal with it.
+    accept it and hand it to a worker thread.
 */
 
 any_t listener(any_t zot) {
@@ -171,9 +201,7 @@ any_t listener(any_t zot) {
     int			len = sizeof(sin); /* addr length */
     int			on = 1;	/* for setsockopt */
     char		logbuf[2*MAX_STR];
-    boolean_t		worry;	/* user worry threshold exceeded? */
     static t_file	listen_f; /* t_file for listening socket */
-    pthread_t thread;		/* thread var */
 
     setup_signals();                  /* set up signal handlers for new thread */
     setup_syslog();
@@ -251,6 +279,7 @@ any_t listener(any_t zot) {
 	
 	t_fdopen(&user->conn, connfd); 	/* set up t_file for connection */
 	strcpy(user->conn.name, "Client (not logged in)");
+	user->conn.kind = T_KIND_CLIENT; /* (for buffer stats) */
 	user->conn.select = TRUE;	/* t_select should check this fd */
 	
 	pthread_mutex_lock(&global_lock);	
@@ -258,25 +287,15 @@ any_t listener(any_t zot) {
 	u_head = user;
 	if (++u_num > u_hwm)		/* count number of active users */
 	    u_hwm = u_num;  		/* new high water mark? */ 
-	worry = u_num > u_worry;	/* getting close to user limit? */
+	/* getting close to user limit?  shorten idle timeouts (t_setcut
+	   wakes t_reaper if they got shorter) */
+	t_setcut(u_num > u_worry ? 60 * (u_num - u_worry) : 0);
 	pthread_mutex_unlock(&global_lock);
-    
-	if (worry) {			/* lots of users... */
-	    udb *u;			/* ...so recompute all timeouts */
-	    for (u = u_head; u; u = u->next) {
-		if (!u->validating)	/* short timer during signon */
-		    u->conn.timeout = 60 * (u_timeout - (u_num - u_worry));
-	    }
-	    pthread_cond_signal(&timeout_wait); /* and see if some can time out now */
-	}
 	
-	if (pthread_create(&thread, generic_attr,
-		       (pthread_startroutine_t) user_cmd, (pthread_addr_t) user) < 0) {
-	    t_perror("listener: pthread_create"); 
-	    free_user(user);		/* couldn't start thread; clean up & back out */
-	    sleep(5);
-	} else {
-	    pthread_detach(&thread);
+	if (!work_dispatch((pthread_startroutine_t) user_cmd, (pthread_addr_t) user)) {
+	    print(user, BLITZ_BUSY);	/* no worker for it; turn it away */
+	    t_fflush(&user->conn);
+	    free_user(user);		/* clean up & back out */
 	}
 	user = NULL;		/* it's theirs now, we'll get another */
     }
@@ -285,7 +304,7 @@ any_t listener(any_t zot) {
 /* poplistener --
 
     Set up a socket listening for POP client connections.  When one arrives,
-    accept it and spawn a thread to deal with it.
+    accept it and hand it to a worker thread.
 */
 
 int poplistener(any_t zot) {
@@ -298,9 +317,7 @@ int poplistener(any_t zot) {
     int			len = sizeof(sin); /* addr length */
     int			on = 1;	/* for setsockopt */
     char		logbuf[2*MAX_STR];
-    boolean_t		worry;	/* user worry threshold exceeded? */
     static t_file	listen_f; /* t_file for listening socket */
-    pthread_t thread;		/* thread var */
 
     setup_signals();		/* set up signal handlers for new thread */
     setup_syslog();
@@ -373,6 +390,7 @@ int poplistener(any_t zot) {
 	
 	t_fdopen(&user->conn, connfd); 	/* set up t_file for connection */
 	strcpy(user->conn.name, "POP Client (not logged in)");
+	user->conn.kind = T_KIND_CLIENT; /* (for buffer stats) */
 	user->conn.select = TRUE;	/* t_select should check this fd */
 	
 	pthread_mutex_lock(&global_lock);	
@@ -380,28 +398,18 @@ int poplistener(any_t zot) {
 	u_head = user;
 	if (++u_num > u_hwm)		/* count number of active users */
 	    u_hwm = u_num;  		/* new high water mark? */ 
-	worry = u_num > u_worry;	/* getting close to user limit? */
+	/* getting close to user limit?  shorten idle timeouts (t_setcut
+	   wakes t_reaper if they got shorter) */
+	t_setcut(u_num > u_worry ? 60 * (u_num - u_worry) : 0);
 	pthread_mutex_unlock(&global_lock);
-    
-	if (worry) {			/* lots of users... */
-	    udb *u;			/* ...so recompute all timeouts */
-	    for (u = u_head; u; u = u->next) {
-		if (!u->validating)	/* short timer during signon */
-		    u->conn.timeout = 60 * (u_timeout - (u_num - u_worry));
-	    }
-	    pthread_cond_signal(&timeout_wait); /* and see if some can time out now */
-	}
 	
 	user->pop = TRUE;		/* mark as POP session */
 
 
-	if (pthread_create(&thread, generic_attr,
-		       (pthread_startroutine_t) popuser_cmd, (pthread_addr_t) user) < 0) {
-	    t_perror("poplistener: pthread_create"); 
-	    free_user(user);		/* couldn't start thread; clean up & back out */
-	    sleep(5);
-	} else {
-	    pthread_detach(&thread);
+	if (!work_dispatch((pthread_startroutine_t) popuser_cmd, (pthread_addr_t) user)) {
+	    t_fprintf(&user->conn, "%s\r\n", POP_BUSY); /* no worker; turn it away */
+	    t_fflush(&user->conn);
+	    free_user(user);		/* clean up & back out */
 	}
 	user = NULL;		/* it's theirs now, we'll get another */
     }
@@ -410,7 +418,7 @@ int poplistener(any_t zot) {
 /* poppassdlistener --
 
     Set up a socket listening for POP password-changing client connections.  
-    When one arrives, accept it and spawn a thread to deal with it.
+    When one arrives, accept it and hand it to a worker thread.
 */
 
 int poppassdlistener(any_t zot) {
@@ -425,7 +433,6 @@ int poppassdlistener(any_t zot) {
     int			on = 1;	/* for setsockopt */
     char		logbuf[2*MAX_STR];
     static t_file	listen_f; /* t_file for listening socket */
-    pthread_t thread;		/* thread var */
 
     setup_signals();		/* set up signal handlers for new thread */
     setup_syslog();
@@ -502,14 +509,11 @@ int poppassdlistener(any_t zot) {
 	strcpy(conn->name, "POP Password Client");
 	conn->select = TRUE;	/* t_select should check this fd */
 
-	if (pthread_create(&thread, generic_attr,
-		       (pthread_startroutine_t) poppassd, (pthread_addr_t) conn) < 0) {
-	    t_perror("poppassd: pthread_create"); 
+	if (!work_dispatch((pthread_startroutine_t) poppassd, (pthread_addr_t) conn)) {
+	    t_fprintf(conn, "500 Server busy; try again later.\r\n");
+	    t_fflush(conn);
 	    t_closefd(conn->fd);		/* close file & remove from fd table */  
 	    t_free(conn);			/* free connection block */  
-	    sleep(5); 
-	} else {
-	    pthread_detach(&thread);
 	}
 	
 	conn = NULL;		/* it's theirs now, we'll get another */
@@ -521,7 +525,8 @@ int poppassdlistener(any_t zot) {
     doshutdown --
     
     When a SIGTERM is received, the signal handler "shutdownsig" is invoked; its
-    only function is to set the "server_shutdown" flag.  (NOTE:  it is NOT safe for
+    only function is to set the "server_shutdown" flag (and poke the t_epoll
+    thread via a pipe, so connections see the flag immediately.)  (NOTE:  it is NOT safe for
     a signal handler to perform any operation of a condition or mutex!)
     
     When someone (shutdownpoll) notices that the shutdown flag is set, doshutdown is
@@ -531,6 +536,7 @@ int poppassdlistener(any_t zot) {
 void shutdownsig() {
 
     server_shutdown = TRUE;
+    t_selwake();			/* disconnect idle users now (signal-safe) */
 }
 
 any_t shutdownpoll(any_t zot) {
@@ -549,6 +555,7 @@ void doshutdown() {
 
     t_errprint("Shutting down....");
     mbox_dowrite(FALSE);
+    expidx_shutdown();			/* index is complete */
     t_errprint("...shutdown complete; exiting");
     
     exit(0);
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/dir.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #ifdef KERBEROS
@@ -174,6 +175,55 @@ boolean_t mime_catalog(udb *user);
 void putheadline(udb *user, int level, char *buf);
 void foldheadline(udb *user, int level, char *buf);
 
+/* warm_start --
+
+    The DND has validated a user, and their box is attached.  Unless its
+    summaries are already in memory, start reading it in now (see
+    mbox_warm), so the client's first commands (after the rest of the
+    signon exchange) don't have to wait for it.  Unless box data is over
+    its memory budget.
+*/
+
+static void warm_start(udb *user) {
+
+    boolean_t	cached;			/* box already in memory? */
+
+    sem_seize_shared(&user->mb->mbsem);
+    cached = user->mb->fs < 0 || user->mb->foldmax <= INBOX_NUM
+    		|| user->mb->fold[INBOX_NUM].summs != NULL;
+    sem_release_shared(&user->mb->mbsem);
+    if (cached)
+	return;
+
+    if ((m_cachemax == 0 || mbox_cachesize() < m_cachemax) && mbox_warm(user->mb) > 0)
+	STAT_INC(signon_stats.warm_started);
+    else
+	STAT_INC(signon_stats.warm_skipped);
+}
+
+/* first_summ --
+
+    The client has been sent summaries (FSUM, or POP LIST/UIDL); if this is
+    the first time this session, count the time since they connected.
+*/
+
+static void first_summ(udb *user) {
+
+    u_long	ms;
+
+    if (user->summtimed)
+	return;
+    user->summtimed = TRUE;
+    ms = msclock() - user->connms;
+
+    pthread_mutex_lock(&global_lock);
+    ++signon_stats.first_count;
+    signon_stats.first_total += ms;
+    if (ms > signon_stats.first_max)
+	signon_stats.first_max = ms;
+    pthread_mutex_unlock(&global_lock);
+}
+
 /* user_init --
 
     Initialize. Must be called first.
@@ -265,6 +315,9 @@ udb *user_alloc() {
     user->popdeletedcount = 0;
     
     user->krbvalidated = FALSE;	/* (POP) kerberos ticket not received yet */
+    
+    user->connms = msclock();	/* (they've just connected) */
+    user->summtimed = FALSE;
 
     return user;
 }
@@ -291,21 +344,12 @@ any_t user_cmd(any_t user_) {
     /* if not forced shutdown, read next command */
     while(!user->shutdown) {
 
-	/* before each command, adjust timeout based on current
-	   user load */
-	pthread_mutex_lock(&global_lock);
+	/* before each command, set timeout (t_timeout_cut shortens
+	   it when user load is high) */
 	if (user->validating)			/* if signing on */
-	    user->conn.timeout = 1;		/* time out very fast */
-	else {
-	    user->conn.timeout = u_timeout;	/* timeout (minutes) */
-	    if (u_num > u_worry)		/* if beyond threshold */
-		user->conn.timeout -= (u_num - u_worry); /* time out more agressively */
-	}
-	if (user->conn.timeout <= 0)
-	    user->conn.timeout = 1;		/* min value (0=no timeout) */
-	else
-	    user->conn.timeout *= 60;		/* value in seconds */
-	pthread_mutex_unlock(&global_lock);
+	    t_settimeout(&user->conn, 60, FALSE); /* time out very fast */
+	else					/* (min 1 minute; 0=no timeout) */
+	    t_settimeout(&user->conn, (u_timeout > 0 ? u_timeout : 1) * 60, TRUE);
 	
 	if (!user->conn.urgent)
 	    user->comp = t_gets(user->comline, MAX_STR, &user->conn);
@@ -389,21 +433,12 @@ any_t popuser_cmd(any_t user_) {
     /* if not forced shutdown, read next command */
     while(!user->shutdown) {
 
-	/* before each command, adjust timeout based on current
-	   user load */
-	pthread_mutex_lock(&global_lock);
+	/* before each command, set timeout (t_timeout_cut shortens
+	   it when user load is high) */
 	if (user->validating)			/* if signing on */
-	    user->conn.timeout = 1;		/* time out very fast */
-	else {
-	    user->conn.timeout = u_timeout;	/* timeout (minutes) */
-	    if (u_num > u_worry)		/* if beyond threshold */
-		user->conn.timeout -= (u_num - u_worry); /* time out more agressively */
-	}
-	if (user->conn.timeout <= 0)
-	    user->conn.timeout = 1;		/* min value (0=no timeout) */
-	else
-	    user->conn.timeout *= 60;		/* value in seconds */
-	pthread_mutex_unlock(&global_lock);
+	    t_settimeout(&user->conn, 60, FALSE); /* time out very fast */
+	else					/* (min 1 minute; 0=no timeout) */
+	    t_settimeout(&user->conn, (u_timeout > 0 ? u_timeout : 1) * 60, TRUE);
 
 	/* read command (note: no urgent processing in POP) */
 
@@ -484,6 +519,7 @@ any_t popuser_cmd(any_t user_) {
 void free_user(udb *user) {
 
     warning	*w;
+    long	n;			/* number of warnings */
     udb		*u, *prev;
     
     if (user->conn.fd >= 0) { 
@@ -505,12 +541,11 @@ void free_user(udb *user) {
     }
     
     if (user->warn) {			/* pending warnings? */
-	w = user->warn->next;
-	user->warn->next = NULL; 	/* break circular list */
-	for (user->warn = w; user->warn; user->warn = w) {
-	    w = user->warn->next;
-	    t_free(user->warn);		/* free them all */
-	}
+	n = 1;				/* count them */
+	for (w = user->warn->next; w != user->warn; w = w->next)
+	    ++n;
+	slab_freechain(SLAB_WARNING, user->warn->next, user->warn, n);
+	user->warn = NULL;		/* free them all */
     }
     
     free_recips(&user->torecips); 	/* clean up recip lists */
@@ -544,6 +579,7 @@ void free_user(udb *user) {
 	prev->next = user->next;
 
     --u_num;				/* one less active user */
+    t_setcut(u_num > u_worry ? 60 * (u_num - u_worry) : 0); /* adjust timeout policy */
     pthread_mutex_unlock(&global_lock);
     
     t_free(user);			/* finally, free main user record */
@@ -561,31 +597,96 @@ void free_user(udb *user) {
   buf_flush --
 
     Write buffered output (now that it's safe.)  Free the buffer(s).
+    The buffers are handed to writev directly (T_IOVMAX at a time),
+    along with anything already in the connection's t_file buffer.
 */
 
 void buf_flush(mbox *mb) {
 
     bufl 	*p;
+    struct iovec iov[T_IOVMAX];		/* buffers to write */
+    int		n;			/* entries in iov */
     int		i;
+    boolean_t	ok = TRUE;		/* connection still ok? */
 
     if (!mb->user->conn.writing)	/* make sure any leftover input is flushed */
 	t_fflush(&mb->user->conn);
     
-    while(mb->obuf.first) {		/* for each buffer */
-    	p = mb->obuf.first;
-	mb->obuf.first = mb->obuf.first->next;
-    	for (i = 0; i < p->used; i++)	/* write it */
-	    t_putc(&mb->user->conn, p->data[i]);
-	t_free((char *) p);
-    	pthread_mutex_lock(&global_lock);
-   	--malloc_stats.obufs;        /* stats: count allocated obufs */
-    	pthread_mutex_unlock(&global_lock);
-
+    while(mb->obuf.first) {		/* for each group of buffers */
+	n = 0;
+	for (p = mb->obuf.first; p && n < T_IOVMAX; p = p->next) {
+	    iov[n].iov_base = p->data;
+	    iov[n++].iov_len = p->used;
+	}
+	if (ok && t_fwritev(&mb->user->conn, iov, n) < 0)
+	    ok = FALSE;			/* conn lost; just discard the rest */
+	    
+	for (i = 0; i < n; ++i) {	/* free the ones we wrote */
+	    p = mb->obuf.first;
+	    mb->obuf.first = mb->obuf.first->next;
+	    slab_free(SLAB_BUFL, p);
+	    STAT_DEC(malloc_stats.obufs);	/* stats: count allocated obufs */
+	}
     }
     mb->obuf.last = NULL;		/* no buffers now */
     
 }
 
+/* stat_snapshot --
+
+    Copy the server counters for reporting.  Each counter is read
+    atomically; u_num and u_hwm are read together under global_lock
+    (they're maintained together there, along with usermax_wait).
+    Counters only move forward, so the copy is never more than a few
+    increments stale -- but nobody doing real work waits for it.
+*/
+
+void stat_snapshot(stat_snap *s) {
+
+    int		i;
+    
+    pthread_mutex_lock(&global_lock);
+    s->users = u_num;
+    s->users_hwm = u_hwm;
+    pthread_mutex_unlock(&global_lock);
+    
+    s->sent = STAT_GET(m_sent);
+    s->sent_vacation = STAT_GET(m_sent_vacation);
+    s->sent_receipt = STAT_GET(m_sent_receipt);
+    s->sent_bounce = STAT_GET(m_sent_bounce);
+    s->sent_internet = STAT_GET(m_sent_internet);
+    s->sent_blitzsmtp = STAT_GET(m_sent_blitzsmtp);
+    s->recv_smtp = STAT_GET(m_recv_smtp);
+    s->recv_blitz = STAT_GET(m_recv_blitz);
+    s->delivered = STAT_GET(m_delivered);
+    
+    s->mb.summ_r = STAT_GET(mb_stats.summ_r);
+    s->mb.summ_w = STAT_GET(mb_stats.summ_w);
+    s->mb.pref_r = STAT_GET(mb_stats.pref_r);
+    s->mb.pref_w = STAT_GET(mb_stats.pref_w);
+    s->mb.mlist_r = STAT_GET(mb_stats.mlist_r);
+    s->mb.mlist_w = STAT_GET(mb_stats.mlist_w);
+    s->mb.cache_hit = STAT_GET(mb_stats.cache_hit);
+    s->mb.cache_miss = STAT_GET(mb_stats.cache_miss);
+    s->mb.cache_evict = STAT_GET(mb_stats.cache_evict);
+    s->cache_size = mbox_cachesize();
+    
+    for (i = 0; i < STAT_FSMAX; ++i)
+	mbox_fswstats(i, &s->fsw[i]);
+    
+    s->warm_started = STAT_GET(signon_stats.warm_started);
+    s->warm_skipped = STAT_GET(signon_stats.warm_skipped);
+    pthread_mutex_lock(&global_lock);
+    s->first_count = signon_stats.first_count;
+    s->first_total = signon_stats.first_total;
+    s->first_max = signon_stats.first_max;
+    pthread_mutex_unlock(&global_lock);
+    
+    s->copy_sendfile = STAT_GET(copy_stats.sendfile);
+    s->copy_copyrange = STAT_GET(copy_stats.copyrange);
+    s->copy_buffered = STAT_GET(copy_stats.buffered);
+}
+
 /* buf_init --
 
     Set up mb->obuf to buffer some output.  Output will be buffered up until
@@ -599,13 +700,11 @@ void buf_init(mbox *mb) {
 	abortsig();			/* should not already be buffering */
 	
     /* allocate & initialize a buffer */
-    mb->obuf.last = (struct bufl *) mallocf(sizeof(struct bufl));
+    mb->obuf.last = (struct bufl *) slab_alloc(SLAB_BUFL);
     mb->obuf.first = mb->obuf.last;
     mb->obuf.first->next = NULL;
     mb->obuf.first->used = 0;
-    pthread_mutex_lock(&global_lock);
-    ++malloc_stats.obufs;        /* stats: count allocated obufs */
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(malloc_stats.obufs);	/* stats: count allocated obufs */
 }
 
 /* buf_putc --
@@ -619,10 +718,8 @@ void buf_putc(mbox *mb, char c) {
     struct bufl		*new;
     
     if (mb->obuf.last->used == BIG_BUFLEN) { 	/* see if room */
-    	new = (struct bufl *) mallocf(sizeof(struct bufl));
-    	pthread_mutex_lock(&global_lock);
-    	++malloc_stats.obufs;        /* stats: count allocated obufs */
-	pthread_mutex_unlock(&global_lock);
+    	new = (struct bufl *) slab_alloc(SLAB_BUFL);
+    	STAT_INC(malloc_stats.obufs);	/* stats: count allocated obufs */
 	new->used = 0;
 	new->next = NULL;
 	mb->obuf.last->next = new;
@@ -1298,7 +1395,7 @@ void add_warn(udb *user, char *text) {
 
     warning	*warn;			/* new warning */
  					   
-    warn = mallocf(sizeof(warning));
+    warn = slab_alloc(SLAB_WARNING);
     strcpy(warn->text, text);
     if (!user->warn) 			/* first one? */
 	warn->next = warn;
@@ -2158,11 +2255,11 @@ void c_edel(udb *user) {
     /* update the summary info in the folder */
     sem_seize(&user->mb->mbsem);
     fold->foldlen -= summ->totallen - newlen; /* correct folder length */
-    summ->messid = messid;		/* assign new message id */
+    summ_renumber(user->mb, fold, summ, messid); /* assign new message id */
     --summ->enclosures;			/* one less enclosure */
     summ->totallen = newlen;		/* updated length */
     touch_folder(user->mb, fold);	/* update session tag of folder */
-    fold->dirty = TRUE;			/* folder has changed */
+    summ_changed(fold, summ);		/* folder has changed */
     mess_done(&mi);
     sem_release(&user->mb->mbsem);
         
@@ -2891,7 +2988,7 @@ void c_mark(udb *user) {
 	    touch_folder(user->mb, fold); /* modifying folder; flush caches */
             summ->read = read;	      	/* new setting */
 	    summ->receipt = FALSE;	/* either way, clear receipt flag */
-            fold->dirty = TRUE;     	/* folder has changed */
+            summ_changed(fold, summ);	/* folder has changed */
 	}
     }
     sem_release(&user->mb->mbsem);
@@ -3455,7 +3552,7 @@ void do_recip(udb *user, recip **recips) {
 		else
 		    newrecips = prev; 	/* no - but new tail */
 	    }
-	    t_free(temp1);		/* free the bad one */
+	    slab_free(SLAB_RECIP, temp1);	/* free the bad one */
 	}
     } while (more);
     
@@ -3626,6 +3723,7 @@ void do_summ(udb *user, folder *fold) {
     	
     /* ok, now generate the summary lines */
     fold_summary(user->mb, fold, first, last);  
+    first_summ(user);
 }
 
 /*^L c_tdel --
@@ -3791,10 +3889,10 @@ void c_tdel(udb *user) {
     /* update the summary info in the folder */
     sem_seize(&user->mb->mbsem);
     fold->foldlen -= summ->totallen - newlen; /* correct folder length */
-    summ->messid = messid;              /* assign new message id */
+    summ_renumber(user->mb, fold, summ, messid); /* assign new message id */
     summ->totallen = newlen;            /* updated length */
     touch_folder(user->mb, fold);       /* update session tag of folder */
-    fold->dirty = TRUE;                 /* folder has changed */
+    summ_changed(fold, summ);           /* folder has changed */
     mess_done(&mi);
     sem_release(&user->mb->mbsem);
 
@@ -3875,9 +3973,9 @@ void c_text(udb *user) {
 	if (summ = get_summ(user->mb, user->summ.messid, &fold)) { /* (sic) */
 	    if (!summ->read) {		/* was it read? */
 		touch_folder(user->mb, fold); /* modifying folder; flush caches */
-		sem_release(&user->mb->mbsem); /* unlock, in case do_receipt locks */
 		summ->read = TRUE;	/* it is now */
-		fold->dirty = TRUE;	/* folder has changed */
+		summ_changed(fold, summ); /* folder has changed */
+		sem_release(&user->mb->mbsem); /* unlock, in case do_receipt locks */
 		if (summ->receipt)	/* receipt requested? */
 		    do_receipt(user->name, summ, &user->head);
 	    } else
@@ -4230,6 +4328,7 @@ void do_validate3(udb *user, dndresult	*dndres) {
 	user->mb = mb;
 	/* no mbox_done -- leave box attached until signoff */
 	sem_release(&mb->mbsem);
+	warm_start(user);		/* get the rest of it read in */
     }
 
     /* If DND expiration warning is configured, check if their account is
@@ -4511,7 +4610,7 @@ void c_warn(udb *user) {
 	while (warn) { 			/* run through them */
 	    w = warn; warn = warn->next;
 	    print(user, w->text);	/* print it */
-	    t_free(w);			/* and free it */
+	    slab_free(SLAB_WARNING, w);	/* and free it */
 	}
     }
     
@@ -4537,12 +4636,7 @@ mbox *force_disconnect(long uid, int fs, udb *user) {
 	if (mb->user) {			/* is user already signed on? */
 	    mb->user->shutdown = TRUE;	/* don't accept any more commands */
 	    if ((fd = mb->user->conn.fd) >= 0) { /* if connection is open */
-		pthread_mutex_lock(&sel_lock);	/* sync w/ t_select */
-	    	mb->user->conn.want |= SEL_CLOSE; /* ask connection thread to close */
-#ifdef T_SELECT
-		pthread_cond_signal(&mb->user->conn.wait); /* nudge it */
-#endif
-		pthread_mutex_unlock(&sel_lock);
+		t_selclose(&mb->user->conn); /* ask connection thread to close */
 	    }
 
 	    sem_release(&mb->mbsem);
@@ -4703,11 +4797,9 @@ void pop_list_or_uidl(udb *user) {
 	
     inbox = &user->mb->fold[INBOX_NUM];
     
-    sem_seize(&user->mb->mbsem);
-    if (inbox->summs == NULL)		/* get summaries, if not yet present */
-	summ_read(user->mb, inbox);
+    fold_rdlock(user->mb, inbox);	/* (reading only) */
     if (mindex > inbox->count) {		/* index out of range? */
-        sem_release(&user->mb->mbsem);
+        sem_release_shared(&user->mb->mbsem);
 	popprint(user, POP_BADARG);
 	return;
     }
@@ -4719,33 +4811,40 @@ void pop_list_or_uidl(udb *user) {
     	/* t_errprint_s("POP server said: %s", POP_OK); */
     }
     
+    if (mindex > 0) {			/* just one; go right to it */
+	if ((summ = fold_seek(inbox, mindex, &p)) != NULL) {
+	    /* always return a length > 0 to avoid divide-by-zero client bugs */
+	    poplen = summ->totallen > 0 ? summ->totallen : 1; 
+	    t_sprintf(buf, "%s %ld %ld", POP_OK, mindex, list_cmd ? poplen : summ->messid);
+	    buf_putl(user->mb, buf);
+	} else				/* (shouldn't happen) */
+	    buf_putl(user->mb, POP_BADARG);
+	goto loopexit;
+    }
+    
     count = 1;				/* tracks present summ position */
     i = 0;				/* present user->popdeleted position */
     for (p = inbox->summs; p != NULL; p = p->next) {
 	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
 	    summ = (summinfo *) nextsum;
+	    if (SUMM_DEAD(summ))
+		continue;
 	    /* always return a length > 0 to avoid divide-by-zero client bugs */
 	    poplen = summ->totallen > 0 ? summ->totallen : 1; 
 	    if ((i < user->popdeletedcount) && (user->popdeleted[i] == count))
 		i++;				/* marked for deletion?  then skip */
-	    else if (mindex < 0) {		/* printing all? */
+	    else {				/* printing all */
 	    	t_sprintf(buf, "%d %ld", count, list_cmd ? poplen : summ->messid);
 		buf_putl(user->mb, buf);
                 /* t_errprint_s("POP server said: %s", buf); */
 	    }
-	    else if (count == mindex) {		/* just this one on response line? */
-	    	t_sprintf(buf, "%s %d %ld", POP_OK, count, list_cmd ? poplen : summ->messid);
-		buf_putl(user->mb, buf);
-                /* t_errprint_s("POP server said: %s", buf); */
-	    	goto loopexit;			/* did our one scan listing, bail out */
-	    }
 	    
 	    count++;
 	}
     }
     
 loopexit:
-    sem_release(&user->mb->mbsem);
+    sem_release_shared(&user->mb->mbsem);
     
     if (mindex < 0) {			/* need end-of-data for multi-line? */
     	buf_putl(user->mb, POP_ENDOFDATA);
@@ -4754,6 +4853,7 @@ loopexit:
 
     /* send the buffered responses */
     buf_flush(user->mb);
+    first_summ(user);
 }
 
 /* pop_last --
@@ -4927,6 +5027,7 @@ void popdo_validate3(udb *user, dndresult *dndres) {
 	user->mb = mb;
 	/* no mbox_done -- leave box attached until signoff */
 	sem_release(&mb->mbsem);
+	warm_start(user);		/* get the rest of it read in */
     }
 
     popprint1(user, POP_VALIDATED, user->name);
@@ -5082,6 +5183,8 @@ void pop_quit(udb *user) {
 	    for (nextsum = p->data; (nextsum - p->data < p->used) && (i < user->popdeletedcount); 
 			nextsum += summ->len) {
 		summ = (summinfo *) nextsum;
+		if (SUMM_DEAD(summ))
+		    continue;
 		if (user->popdeleted[i] == count) {
 		    /* one of the messages to move */
 		    idstomove[i++] = summ->messid;
@@ -5121,14 +5224,12 @@ void pop_retr_or_top(udb *user) {
 
     folder 	*inbox;			/* In Box folder, for convenience */
     summbuck	*p;			/* current bucket */
-    summinfo	*summ;			/* current summary in bucket */
-    char	*nextsum;		/* to locate next summary */
+    summinfo	*summ;			/* summary of requested message */
     long	mindex;			/* message index */
     long	messid;			/* message id */
     long	lines;			/* number of lines to return, or -1 */
     fileinfo	textmess;    		/* textified version of message */
     t_file	*textf;			/* ditto */
-    int		count;			/* summary index counter */
     long	linecounter;		/* for counting body lines */
     char	buf[MAX_STR];		/* for writing out message a line at a time */
     boolean_t	msgread = FALSE;	/* had this message been read before? */
@@ -5162,23 +5263,13 @@ void pop_retr_or_top(udb *user) {
 	return;
     }
     
-    count = 1;				/* tracks present summ position */
-    for (p = inbox->summs; p != NULL; p = p->next) {
-	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
-	    summ = (summinfo *) nextsum;
-	    if (count == mindex) {
-	        messid = summ->messid;
-		msgread = summ->read;
-	    	goto loopexit;		/* did our one scan listing, bail out */
-	    }
-	    count++;
-	}
+    if ((summ = fold_seek(inbox, mindex, &p)) == NULL) {
+	sem_release(&user->mb->mbsem);	/* did we not find summary? weird... */
+	popprint(user, POP_BADARG);
+	return;
     }
-    sem_release(&user->mb->mbsem);	/* did we not find summary? weird... */
-    popprint(user, POP_BADARG);
-    return;
-    
-loopexit:
+    messid = summ->messid;
+    msgread = summ->read;
     sem_release(&user->mb->mbsem);
     
     /* set current message */
@@ -5257,9 +5348,9 @@ loopexit:
 	    if (summ = get_summ(user->mb, user->summ.messid, &inbox)) { /* (sic) */
 		if (!summ->read) {		/* was it read? */
 		    touch_folder(user->mb, inbox); /* modifying folder; flush caches */
-		    sem_release(&user->mb->mbsem); /* unlock, in case do_receipt locks */
 		    summ->read = TRUE;	/* it is now */
-		    inbox->dirty = TRUE;	/* folder has changed */
+		    summ_changed(inbox, summ); /* folder has changed */
+		    sem_release(&user->mb->mbsem); /* unlock, in case do_receipt locks */
 		    if (summ->receipt)	/* receipt requested? */
 			do_receipt(user->name, summ, &user->head);
 		} else
@@ -5307,14 +5398,10 @@ void pop_stat(udb *user) {
     warning		*w;		/* one warning */
     boolean_t		cleared = FALSE; /* warning cleared? */
  					   
-    sem_seize(&user->mb->mbsem);
-    
     inbox = &user->mb->fold[INBOX_NUM];
-    if (inbox->summs == NULL)  /* get summaries into memory (to count them) */
-	summ_read(user->mb, inbox);
+    fold_rdlock(user->mb, inbox);	/* (reading only; to count them) */
     t_sprintf(buf, "%d %ld", inbox->count, inbox->foldlen);
-    
-    sem_release(&user->mb->mbsem);   
+    sem_release_shared(&user->mb->mbsem);   
     
     popprint1(user, POP_OK_BLANK, buf);
 
@@ -5342,7 +5429,7 @@ void pop_stat(udb *user) {
 	
 	while (warn) { 			/* run through them */
 	    w = warn; warn = warn->next;
-	    t_free(w);			/* and free it */
+	    slab_free(SLAB_WARNING, w);	/* and free it */
 	}
     }
 }
@@ -5592,9 +5679,7 @@ void record_login(u_bit32 addr) {
     if (us == NULL && hole == NULL) {
 	/* allocate bucket; initialize all entries */
 	buck = mallocf(sizeof (login_info_block));
-        pthread_mutex_lock(&global_lock);
-        ++malloc_stats.login_blocks;  /* stats: count allocations */
-        pthread_mutex_unlock(&global_lock);
+        STAT_INC(malloc_stats.login_blocks);	/* stats: count allocations */
 
 	for (i = 0; i < LOGIN_INFO_BLOCKSIZE; ++i) {
 	    buck->entry[i].where = 0;
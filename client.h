@@ -21,6 +21,7 @@
 #define BLITZ_MISSINGARG	"13 Missing argument."
 #define BLITZ_ERROR		"14 Server error."
 #define BLITZ_ERR_BLANK		"14 "
+#define BLITZ_BUSY		"14 Server busy; try again later."
 #define BLITZ_NO_SUPPORT	"15 "
 #define BLITZ_NODND		"17 name server(dnd) not available"
 #define BLITZ_NOTVAL		"21 user not validated yet"
@@ -66,6 +67,7 @@
 #define	POP_OK_SENDPASS		"+OK Please send PASS command."
 #define	POP_VALIDATED		"+OK You are signed on as "
 #define	POP_ERROR		"-ERR Server error"
+#define	POP_BUSY		"-ERR Server busy; try again later."
 #define POP_BADARG		"-ERR Bad argument."
 #define POP_MISSINGARG		"-ERR Missing argument."
 #define POP_NOTVAL		"-ERR User not validated yet."
@@ -99,6 +101,35 @@ long	u_timeout;		/* idle connection timeout (minutes) */
 long	u_worry;		/* threshold for faster idle timeout */
 pthread_cond_t usermax_wait;	/* wait here for u_num to go down */
 
+/* signon warm-up (see warm_start) */
+struct {
+	long		warm_started;	/* warm-ups started */
+	long		warm_skipped;	/* box not cached, but too busy */
+	long		first_count;	/* sessions that got summaries */
+	u_long		first_total;	/* total connect-to-first-summary (ms) */
+	u_long		first_max;	/* longest (ms) */
+} signon_stats;			/* (first_* protected by global_lock) */
+
+/* The message counters above (and mb_stats, copy_stats) are bumped with
+   STAT_INC, never under a lock; reporting code (cty, the UDP status
+   packet) reads them through stat_snapshot rather than directly. */
+   
+struct stat_snap {
+	long		users, users_hwm;	/* u_num, u_hwm */
+	long		sent, sent_vacation, sent_receipt, sent_bounce;
+	long		sent_internet, sent_blitzsmtp;
+	long		recv_smtp, recv_blitz;
+	long		delivered;
+	mb_stats_t	mb;			/* mailbox i/o counts */
+	long		cache_size;		/* box data cached (bytes) */
+	fsw_stats_t	fsw[STAT_FSMAX];	/* per-filesystem writers */
+	long		warm_started, warm_skipped;	/* signon warm-ups */
+	long		first_count;		/* connect to first summary: */
+	u_long		first_total, first_max;	/* (ms) */
+	long		copy_sendfile, copy_copyrange, copy_buffered;
+};
+typedef struct stat_snap stat_snap;
+
 char 	*u_warning;		/* warning to send at signon */
 
 /*
@@ -164,6 +195,7 @@ void print(udb *user, char *s);
 void print1(udb *user, char *s1, char *s2);
 udb *user_alloc();
 void free_user(udb *user);
+void stat_snapshot(stat_snap *s);
 any_t user_cmd(any_t user_);
 any_t popuser_cmd(any_t user_);
 void newmail_warn(mbox *mb, long messid, int foldnum);
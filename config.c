@@ -63,11 +63,19 @@ void read_config() {
 
     smtp_max = 20;
     smtp_timeout = 20;
+
+    m_workers = -1;		/* default depends on USERMAX & SMTPMAX */
+    m_workqueue = DFT_WORKQUEUE;
+    m_cachemax = 0;		/* no cache budget; evict only idle boxes */
+    exp_workers = DFT_EXPWORKERS;
+    exp_iorate = 0;		/* expire as fast as the disks allow */
+    exp_trickle = FALSE;	/* one pass a day, at EXPTIME */
     
     m_thisserv = -1;
     
     m_binhexencls = FALSE;	/* enclosure binhexing defaults off */
     m_recvbinhex = TRUE;	/* but defaults *on* when receiving */
+    m_sizeaudit = FALSE;	/* trust box accounting unless asked */
     m_smtp_disclaimer = NULL;	/* no disclaimer unless specified */
     
     if ((f = t_fopen(CONFIG_FNAME, O_RDONLY, 0)) == NULL) {
@@ -125,6 +133,13 @@ void read_config() {
 	else if (strcasecmp(cmd, "NORECVBINHEX") == 0) {
 	    m_recvbinhex = FALSE;
 	}
+	else if (strcasecmp(cmd, "SIZEAUDIT") == 0) {
+	    m_sizeaudit = TRUE;
+	}
+	else if (strcasecmp(cmd, "CACHEMAX") == 0) {
+	    p = strtonum(p, &m_cachemax); /* box data budget (kbytes) */
+	    m_cachemax *= 1024;
+	}
 	else if (strcasecmp(cmd, "CLEANOUT_GRACE") == 0) {
 	    p = strtonum(p, &cleanout_grace);	/* grace period for cleanout cmd */
 	}
@@ -186,6 +201,19 @@ void read_config() {
 		exp_time = hh*60*60 + mm*60 + ss;
 	    }
 	}
+	else if (strcasecmp(cmd, "EXPWORKERS") == 0) {
+	    p = strtonum(p, &exp_workers);	/* expiration workers per fs */
+	    if (exp_workers < 1)
+		exp_workers = 1;
+	    else if (exp_workers > EXP_WORKERMAX)
+		exp_workers = EXP_WORKERMAX;
+	}
+	else if (strcasecmp(cmd, "EXPIORATE") == 0) {
+	    p = strtonum(p, &exp_iorate);	/* expiration I/O ops/sec per fs */
+	}
+	else if (strcasecmp(cmd, "EXPTRICKLE") == 0) {
+	    exp_trickle = TRUE;
+	}
 			
 	else if (strcasecmp(cmd, "FS") == 0) { /* filesystem */
 	    if (m_filesys_count < FILESYS_MAX) {
@@ -293,6 +321,22 @@ void read_config() {
 	    p = strtonum(p, &u_worry);	/* threshold for more agressive timeouts */
 	}	
 
+	else if (strcasecmp(cmd, "IOBUFMAX") == 0) {
+	    p = strtonum(p, &t_iobufmax); /* largest t_file buffer (bytes) */
+	}
+
+	else if (strcasecmp(cmd, "IOBUFPOOL") == 0) {
+	    p = strtonum(p, &t_iobufpool); /* free buffers to keep (per size) */
+	}
+
+	else if (strcasecmp(cmd, "WORKERS") == 0) {
+	    p = strtonum(p, &m_workers); /* connection worker threads */
+	}
+
+	else if (strcasecmp(cmd, "WORKQUEUE") == 0) {
+	    p = strtonum(p, &m_workqueue); /* connections waiting for a worker */
+	}
+
 	/* host allowed to transfer users to us */
 	else if (strcasecmp(cmd, "XFEROK") == 0) {
 	    if (m_xferokcnt < HOST_MAX) {
@@ -473,6 +517,13 @@ void read_config() {
 	sleep(30);			/* don't spin too fast */
     }
     
+    /* Each connection occupies a worker for its lifetime, so by default
+       make the pool big enough for all users (& poppassd) + smtp + a few ctys */
+    if (m_workers < 0)
+	m_workers = u_max + smtp_max + 10;
+    if (m_workqueue < 1)
+	m_workqueue = 1;
+	
     if (pubml_fs < 0) {
      	t_errprint("Fatal config error: invalid pubml_fs");
 	exit(1);   	
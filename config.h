@@ -73,12 +73,23 @@ char	*f_stickytab;		/* file of sticky notifications (notifyd) */
 char	*f_smtpfilter;		/* file of incoming SMTP filter rules */
 boolean_t m_binhexencls;	/* send binhex enclosures */
 boolean_t m_recvbinhex;		/* receive binhex enclosures */
+boolean_t m_sizeaudit;		/* audit box accounting during expiration */
 char    *m_smtp_disclaimer;     /* disclaimer on incoming smtp */
 
+long	m_workers;		/* size of connection worker pool */
+long	m_workqueue;		/* max connections waiting for a worker */
+#define DFT_WORKQUEUE	32
+
+long	m_cachemax;		/* memory budget for cached box data (bytes; 0 = none) */
+
 long	cleanout_grace;		/* grace period when cleaning out invalid boxes */
 #define DFT_CLEANOUT_GRACE -1
 
 u_long	exp_time;		/* time of day (seconds) to do expiration */
+long	exp_workers;		/* expiration workers per filesystem */
+#define DFT_EXPWORKERS	4
+long	exp_iorate;		/* expiration I/O budget per filesystem (ops/sec; 0 = none) */
+boolean_t exp_trickle;		/* expire a slice at a time, all day? */
 
 /*    ----      Filesystems      ----    */
 
@@ -92,6 +103,7 @@ int	m_spool_filesys;		/* which fs spool dir is on (or -1) */
 #define MESSTMP_DIR	"/mtmp/"	/* directory for temp messages */
 #define MESSXFER_DIR	"/messxfer/"	/* directory for transferred messages */
 #define BOX_DIR		"/box/"		/* directory for user mailboxes */
+#define EXPIDX_DIR	"/expidx/"	/* directory for the expiration index */
 #define SPOOL_DIR	"/spool/"	/* directory for message queues */
 
 
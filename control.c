@@ -38,7 +38,7 @@ extern int table(int id, int index, void *addr, int nel, unsigned lel);
 #endif
 void make_statpkt(char *statpkt, long users, int cpu[CPUSTATES], int cpu_hz, 
 		  mb_stats_t *mb_stats, struct tbl_diskinfo *disk, 
-		  vm_statistics_data_t *vm);
+		  vm_statistics_data_t *vm, long cache_size, fsw_stats_t *fsw);
 
 /* get_cpu --
 
@@ -232,6 +232,7 @@ any_t ctl_udpsend(any_t zot) {
     int			cpu_hz;
     struct tbl_diskinfo	di[DISKMAX];
     int			s;
+    stat_snap		snap;		/* server counters */
     
     setup_signals();			/* set up signal handlers for new thread */
     setup_syslog();
@@ -255,7 +256,8 @@ any_t ctl_udpsend(any_t zot) {
 #endif
 	    bzero((char *) &vm, sizeof(vm_statistics_data_t));
 	
-	make_statpkt(pkt, u_num, cpu, cpu_hz, &mb_stats, di, &vm);
+	stat_snapshot(&snap);		/* counters, without blocking anyone */
+	make_statpkt(pkt, snap.users, cpu, cpu_hz, &snap.mb, di, &vm, snap.cache_size, snap.fsw);
 		
 	    	
 	sem_seize(&stat_sem);	/* get access to table */
@@ -289,11 +291,11 @@ any_t ctl_udpsend(any_t zot) {
 
 void make_statpkt(char *statpkt, long users, int cpu[CPUSTATES], int cpu_hz, 
 		  mb_stats_t *mb_stats, struct tbl_diskinfo *disk, 
-		  vm_statistics_data_t *vm) {
+		  vm_statistics_data_t *vm, long cache_size, fsw_stats_t *fsw) {
 
     int		i;
     
-    statpkt = putnetlong(statpkt, STATPKT_VERS);	/* generate version 1 packet */
+    statpkt = putnetlong(statpkt, STATPKT_VERS);	/* generate version 3 packet */
     
     statpkt = putnetlong(statpkt, users);
     
@@ -338,4 +340,21 @@ void make_statpkt(char *statpkt, long users, int cpu[CPUSTATES], int cpu_hz,
 	bcopy(disk[i].di_name, statpkt, 8);
 	statpkt += 8;
     }
+    
+    /* box cache (new in version 2; appended so old readers still work) */
+    statpkt = putnetlong(statpkt, mb_stats->cache_hit);
+    statpkt = putnetlong(statpkt, mb_stats->cache_miss);
+    statpkt = putnetlong(statpkt, mb_stats->cache_evict);
+    statpkt = putnetlong(statpkt, cache_size / 1024);
+    statpkt = putnetlong(statpkt, m_cachemax / 1024);
+    
+    /* per-filesystem writers (new in version 3) */
+    statpkt = putnetlong(statpkt, m_filesys_count);
+    for (i = 0; i < STAT_FSMAX; ++i) {
+	statpkt = putnetlong(statpkt, fsw[i].backlog);
+	statpkt = putnetlong(statpkt, fsw[i].backlog_hwm);
+	statpkt = putnetlong(statpkt, fsw[i].flushed);
+	statpkt = putnetlong(statpkt, fsw[i].lat_total);
+	statpkt = putnetlong(statpkt, fsw[i].lat_max);
+    }
 }
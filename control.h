@@ -48,9 +48,21 @@ struct mb_stats_t {
 	bit32		summ_r, summ_w;		/* summary reads & writes */
 	bit32		pref_r, pref_w;		/* pref reads & writes */
 	bit32		mlist_r, mlist_w;	/* mailing list reads + writes */
+	bit32		cache_hit, cache_miss;	/* box attaches with data cached or not */
+	bit32		cache_evict;		/* boxes whose data was evicted */
 };
 typedef struct mb_stats_t mb_stats_t;
 
+/* per-filesystem writer stats (see mbox_fswriter) */
+#define STAT_FSMAX	16		/* (== FILESYS_MAX) */
+struct fsw_stats_t {
+	bit32		backlog, backlog_hwm;	/* boxes waiting to be written (& peak) */
+	bit32		flushed;		/* boxes written */
+	bit32		lat_total;		/* total time writing them (ms) */
+	bit32		lat_max;		/* longest in latest pass (ms) */
+};
+typedef struct fsw_stats_t fsw_stats_t;
+
 /* vm info, 32-bit version */
 struct vm_stats {
         bit32    pagesize;               /* page size in bytes */
@@ -125,11 +137,24 @@ struct statpkt {		/* all fields in network byte order */
 	    bit32     di_bps;         	/* drive transfer rate (bytes per second) */
 	    char      di_name[8];     	/* drive name */
 	} disk[DISKMAX];
+	struct {				/* (version 2) */
+		bit32		hit, miss;		/* box cache hits & misses */
+		bit32		evict;			/* evictions */
+		bit32		size_kb;		/* box data cached (kbytes) */
+		bit32		max_kb;			/* CACHEMAX (kbytes; 0 = none) */
+	} cache_stat;
+	bit32		fs_count;			/* (version 3) filesystems */
+	struct {
+		bit32		backlog, backlog_hwm;	/* boxes waiting to be written */
+		bit32		flushed;		/* boxes written */
+		bit32		lat_total;		/* total time writing (ms) */
+		bit32		lat_max;		/* longest in latest pass (ms) */
+	} fs_stat[STAT_FSMAX];
 };
 typedef struct statpkt statpkt;
 
-#define STATPKT_VERS	1
-#define STATPKT_LEN (4*(1+1+CPUSTATES+1+6+13) + DISKMAX*(8+4*5))
+#define STATPKT_VERS	3
+#define STATPKT_LEN (4*(1+1+CPUSTATES+1+6+13) + DISKMAX*(8+4*5) + 4*5 + 4*(1+STAT_FSMAX*5))
 
 struct statreq {		/* status registration request */
 	bit32		cmd;	/* command (== STAT_REG) */
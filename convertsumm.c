@@ -0,0 +1,196 @@
+/*
+
+    Convert summary files.  Rewrite every old-style text summary file on
+    every configured filesystem in the binary format.  (The server
+    converts files as it reads them, so this is optional; it just gets
+    the whole job done at once, while the server is down.)
+
+    Copyright (c) 1994 by the Trustees of Dartmouth College;
+    see the file 'Copyright' in the distribution for conditions of use.
+
+*/
+#include "port.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/dir.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <signal.h>
+#include <syslog.h>
+#include "t_io.h"
+#include "mbox.h"
+#include "t_err.h"
+#include "misc.h"
+#include "config.h"
+#include "mess.h"
+
+int	finished = 0;
+pthread_cond_t finish_wait;
+long	converted = 0;		/* files converted */
+long	failed = 0;		/* and not */
+
+any_t convertfs(any_t _fs);
+void convertbox(long uid, long fs);
+
+void doshutdown() {}
+
+int main (int argc, char **argv) {
+
+    int		i;
+    pthread_t	thread;
+    int			sock;	/* blitzmail server port socket */
+    struct sockaddr_in	sin;	/* its addr */
+    struct servent	*sp;	/* services entry */
+    int			on = 1;	/* for setsockopt */
+
+    misc_init();				/* set up global locks */
+    pthread_cond_init(&finish_wait, pthread_condattr_default);
+
+    t_ioinit();
+    t_errinit("convertsumm", LOG_LOCAL1);	/* initialize error package */
+
+    read_config();		/* read configuration file */
+
+    /* verify that server isn't running -- try to bind to its address */
+
+     if ((sp = getservbyname(BLITZ_SERV, "tcp")) == NULL) {
+	fprintf(stderr, "unknown service: %s", BLITZ_SERV);
+	exit(1);
+    }
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	perror("socket: ");
+	exit(1);
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) < 0)
+	perror("setsockopt (SO_REUSEADDR)");
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = sp->s_port;	/* blitz server port */
+
+    if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+	if (pthread_errno() == EADDRINUSE) {
+	    fprintf(stderr, "\n###  BlitzMail server is running!  ###\n");
+	    fprintf(stderr, " (Must kill it before running %s.)\n\n" , argv[0]);
+	} else
+	    perror("bind");
+	exit(1);
+    }
+
+    /* leave socket open to keep server from starting up while we're running */
+
+    pthread_mutex_lock(&syslog_lock);
+    fprintf(stderr, "**\n** Filesystems configured:\n**\n");
+    for (i = 0; i < m_filesys_count; ++i) {
+	fprintf(stderr, "    %s\n", m_filesys[i]);
+	if (pthread_create(&thread, generic_attr,
+			(pthread_startroutine_t) convertfs, (pthread_addr_t) i) < 0) {
+	    t_perror("pthread_create");
+	    exit(1);
+	}
+	pthread_detach(&thread);
+    }
+    fprintf(stderr, "\nConverting...");
+    pthread_mutex_unlock(&syslog_lock);
+
+    /* wait for all threads to finish */
+    pthread_mutex_lock(&global_lock);
+    while(finished < m_filesys_count)
+	pthread_cond_wait(&finish_wait, &global_lock);
+
+    fprintf(stderr, "\n\n** \n** %ld summary files converted; %ld errors\n", converted, failed);
+    fprintf(stderr, "** %s:  Done.\n**\n", argv[0]);
+
+    close(sock);			/* server can run now */
+
+    exit(failed ? 1 : 0);
+}
+
+/* convert one filesystem's boxes */
+
+any_t convertfs(any_t _fs) {
+
+    long		fs;			/* filesystem to convert */
+    char		fname[MBOX_NAMELEN];	/* name of box dir on that fs */
+    DIR			*dirf;			/* open directory file */
+    struct direct 	*dirp;			/* directory entry */
+    long		uid;			/* one box */
+    char		*end;			/* end of uid str */
+
+    fs = (long) _fs;
+
+    t_sprintf(fname, "%s%s", m_filesys[fs], BOX_DIR);
+    fname[strlen(fname) - 1] = 0;		/* chop trailing '/' */
+
+    pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
+    dirf = opendir(fname);
+    pthread_mutex_unlock(&dir_lock);
+
+    if (dirf != NULL) {			/* (no boxes yet is ok) */
+	while ((dirp = readdir(dirf)) != NULL) {	/* read entire directory */
+	    /* skip dot-files */
+	    if (dirp->d_name[0] != '.') {
+		end = strtonum(dirp->d_name, &uid);
+		if (*end == 0)	/* ignore non-numeric filenames */
+		    convertbox(uid, fs);
+	    }
+	}
+	closedir(dirf);
+    } else if (pthread_errno() != ENOENT)
+	t_perror1("convertfs: cannot open ", fname);
+
+    pthread_mutex_lock(&global_lock);	/* count threads that have finished */
+    ++finished;
+    pthread_mutex_unlock(&global_lock);
+    pthread_cond_signal(&finish_wait);	/* wake main thread */
+
+    return 0;				/* thread fades away */
+}
+
+/* convert the summary files in one box.  Every file in the box directory
+   that begins with the text summary magic line is a summary file. */
+
+void convertbox(long uid, long fs) {
+
+    char		boxdir[FILENAME_MAX];
+    char		fname[FILENAME_MAX];	/* one file */
+    char		tempname[FILENAME_MAX];	/* scratch file */
+    DIR			*dirf;			/* open directory file */
+    struct direct 	*dirp;			/* directory entry */
+    int			stat;
+
+    t_sprintf(boxdir, "%s%s%ld", m_filesys[fs], BOX_DIR, uid);
+    t_sprintf(tempname, "%s/.summtemp", boxdir);
+
+    pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
+    dirf = opendir(boxdir);
+    pthread_mutex_unlock(&dir_lock);
+
+    if (dirf == NULL) {
+	t_perror1("convertbox: cannot open ", boxdir);
+	return;
+    }
+
+    while ((dirp = readdir(dirf)) != NULL) {	/* read entire directory */
+	if (dirp->d_name[0] == '.')		/* skip dot-files */
+	    continue;
+	t_sprintf(fname, "%s/%s", boxdir, dirp->d_name);
+	stat = summ_convert(fname, tempname);
+	pthread_mutex_lock(&global_lock);
+	if (stat > 0)
+	    ++converted;
+	else if (stat < 0) {
+	    ++failed;
+	    t_errprint_s("convertbox: cannot convert %s", fname);
+	}
+	pthread_mutex_unlock(&global_lock);
+    }
+
+    closedir(dirf);
+}
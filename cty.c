@@ -42,12 +42,15 @@ static void cty_cleanout(ctystate *cty);
 static boolean_t invalid_box(ctystate *cty, long uid, int fs);
 static boolean_t remove_box(ctystate *cty, long uid, int fs);
 boolean_t cty_prompt(ctystate *cty, char *fmt, char *s);
+static void cty_check(ctystate *cty);
 static void cty_count(ctystate *cty);
 static void cty_deport(ctystate *cty);
+static void cty_expstat(ctystate *cty);
 static void cty_forward(ctystate *cty);
 static void cty_help(ctystate *cty);
 static void cty_ledit(ctystate *cty);
 static void cty_list(ctystate *cty);
+static void cty_locks(ctystate *cty);
 static void cty_lrem(ctystate *cty);
 static void cty_mstat(ctystate *cty);
 static boolean_t cty_login(ctystate *cty);
@@ -108,7 +111,8 @@ void cty_init() {
 /* ctylisten --
 
     Set up a socket listening for cty connections.  When one arrives,
-    accept it and spawn a thread to deal with it.
+    accept it and spawn a thread to deal with it.  Cty sessions don't go
+    through the worker pool, so the console stays usable when it's full.
 */
 
 any_t ctylisten (any_t zot) {
@@ -183,12 +187,12 @@ any_t ctylisten (any_t zot) {
 	strcpy(cty->conn.name, "CTY (logging in)");
 	
 	if (pthread_create(&thread, generic_attr,
-			(pthread_startroutine_t) cty_serv, (pthread_addr_t) cty) < 0) {
+		(pthread_startroutine_t) cty_serv, (pthread_addr_t) cty) < 0) {
 	    t_perror("ctylisten: pthread_create");
 	    t_closefd(cty->conn.fd);		/* thread create failed; clean up */	
 	    t_free(cty);			/* free cty record */
 	    sleep(5);
-	} else 
+	} else
 	    pthread_detach(&thread);
 	
 	cty = NULL;			/* it's their state now */
@@ -245,6 +249,8 @@ static any_t cty_serv(any_t cty_) {
 	
 	if (strncasecmp(cty->comline, "BYE", 3) == 0)
 	    cty_quit(cty);
+	else if (strncasecmp(cty->comline, "CHECK", 5) == 0)
+	    cty_check(cty);	    
 	else if (strncasecmp(cty->comline, "CLEANOUT", 8) == 0)
 	    cty_cleanout(cty);	    
 	else if (strncasecmp(cty->comline, "COUNT", 5) == 0)
@@ -253,6 +259,8 @@ static any_t cty_serv(any_t cty_) {
 	    cty_deport(cty);
 	else if (strncasecmp(cty->comline, "DIE", 3) == 0)
 	    abortsig();	    
+	else if (strncasecmp(cty->comline, "EXPSTAT", 7) == 0)
+	    cty_expstat(cty);
 	else if (strncasecmp(cty->comline, "HELP", 4) == 0)
 	    cty_help(cty);	    
 	else if (strncasecmp(cty->comline, "FORWARD", 7) == 0)
@@ -263,6 +271,8 @@ static any_t cty_serv(any_t cty_) {
 	    cty_ledit(cty);
 	else if (strncasecmp(cty->comline, "LIST", 4) == 0)
 	    cty_list(cty);
+	else if (strncasecmp(cty->comline, "LOCKS", 5) == 0)
+	    cty_locks(cty);
 	else if (strncasecmp(cty->comline, "LREM", 4) == 0)
 	    cty_lrem(cty);
         else if (strncasecmp(cty->comline, "MSTAT", 5) == 0)
@@ -279,8 +289,10 @@ static any_t cty_serv(any_t cty_) {
 	    cty_updatelists(cty);
 	else if (strncasecmp(cty->comline, "USER", 4) == 0)
 	    cty_user(cty);
-	else if (strncasecmp(cty->comline, "STOP", 4) == 0)
+	else if (strncasecmp(cty->comline, "STOP", 4) == 0) {
 	    server_shutdown = TRUE;
+	    t_selwake();		/* wake all connections */
+	}
 	else if (strncasecmp(cty->comline, "XFER", 4) == 0)
 	    cty_xfer(cty);
 	else if (strlen(cty->comline) > 0)
@@ -516,6 +528,7 @@ static boolean_t remove_box(ctystate *cty, long uid, int fs) {
     strcpy(boxname, mb->boxname);	/* remember its name */
     strcpy(mb->boxname, "");		/* zero it - must recreate if user comes back */
     mb->checked = FALSE;  
+    mb->indexed = FALSE;
 
     ok = do_rm(boxname);		/* remove box (still locked, to prevent race) */
 
@@ -538,16 +551,69 @@ static boolean_t remove_box(ctystate *cty, long uid, int fs) {
 
 static void cty_count(ctystate *cty) {
 
+    long	busy, busy_hwm;		/* worker pool stats */
+    long	qlen, q_hwm, full;
+    long	dispatched;
+    u_long	wait_total, wait_max;
+    stat_snap	snap;			/* server counters */
+    int		i;
+    
+    stat_snapshot(&snap);
+    
     t_fprintf(&cty->conn, "Up since %s on %s\r\n", up_time, up_date);
-    t_fprintf(&cty->conn, "%ld users now (peak = %ld)\r\n", u_num, u_hwm);
-    t_fprintf(&cty->conn, "%ld messages sent, including:\r\n", m_sent);
+    t_fprintf(&cty->conn, "%ld users now (peak = %ld)\r\n", snap.users, snap.users_hwm);
+    t_fprintf(&cty->conn, "%ld messages sent, including:\r\n", snap.sent);
     t_fprintf(&cty->conn, "    %ld outgoing blitz; %ld outgoing SMTP\r\n",
-    				m_sent_blitzsmtp, m_sent_internet);
+    				snap.sent_blitzsmtp, snap.sent_internet);
     t_fprintf(&cty->conn, "    %ld receipts; %ld vacations; %ld bounces\r\n",
-    				 m_sent_receipt, m_sent_vacation, m_sent_bounce);
+    				 snap.sent_receipt, snap.sent_vacation, snap.sent_bounce);
     t_fprintf(&cty->conn, "%ld incoming blitz; %ld incoming SMTP\r\n",
-    			       m_recv_blitz, m_recv_smtp);
-    t_fprintf(&cty->conn, "%ld local recipients\r\n", m_delivered);
+    			       snap.recv_blitz, snap.recv_smtp);
+    t_fprintf(&cty->conn, "%ld local recipients\r\n", snap.delivered);
+    t_fprintf(&cty->conn, "Message bytes copied: %ld sendfile; %ld copy_file_range; %ld buffered\r\n",
+    			       snap.copy_sendfile, snap.copy_copyrange, snap.copy_buffered);
+    if (m_cachemax > 0)
+	t_fprintf(&cty->conn, "Box data cached: %ld KB (limit %ld KB)\r\n",
+    			       snap.cache_size / 1024, m_cachemax / 1024);
+    else
+	t_fprintf(&cty->conn, "Box data cached: %ld KB (no limit)\r\n", snap.cache_size / 1024);
+    t_fprintf(&cty->conn, "Box cache: %ld hits; %ld misses; %ld evictions\r\n",
+    			       (long) snap.mb.cache_hit, (long) snap.mb.cache_miss,
+			       (long) snap.mb.cache_evict);
+    t_fprintf(&cty->conn, "%ld signon warm-ups (%ld skipped)\r\n",
+    			       snap.warm_started, snap.warm_skipped);
+    if (snap.first_count > 0)
+	t_fprintf(&cty->conn, "Connect to first summary: average %ld ms (max = %ld ms)\r\n",
+			       (long) (snap.first_total / snap.first_count), (long) snap.first_max);
+    for (i = 0; i < m_filesys_count; ++i) {
+	t_fprintf(&cty->conn, "Writer %s: %ld boxes waiting (peak = %ld); %ld written",
+			       m_filesys[i], (long) snap.fsw[i].backlog,
+			       (long) snap.fsw[i].backlog_hwm, (long) snap.fsw[i].flushed);
+	if (snap.fsw[i].flushed > 0)
+	    t_fprintf(&cty->conn, "; average %ld ms (last pass max = %ld ms)",
+			       (long) ((u_bit32) snap.fsw[i].lat_total / snap.fsw[i].flushed),
+			       (long) snap.fsw[i].lat_max);
+	t_fprintf(&cty->conn, "\r\n");
+    }
+
+    /* worker pool stats; copy so we don't print holding the lock */
+    pthread_mutex_lock(&work_pool.lock);
+    busy = work_pool.busy; busy_hwm = work_pool.busy_hwm;
+    qlen = work_pool.qlen; q_hwm = work_pool.q_hwm; full = work_pool.full;
+    dispatched = work_pool.dispatched;
+    wait_total = work_pool.wait_total; wait_max = work_pool.wait_max;
+    pthread_mutex_unlock(&work_pool.lock);
+    
+    if (work_pool.workers > 0)
+	t_fprintf(&cty->conn, "%ld of %ld workers busy (peak = %ld); %ld%% utilization\r\n", 
+    			busy, work_pool.workers, busy_hwm, busy * 100 / work_pool.workers);
+    else
+	t_fprintf(&cty->conn, "No worker pool (thread per connection)\r\n");
+    t_fprintf(&cty->conn, "%ld connections waiting for a worker (peak = %ld; %ld refused, queue full)\r\n",
+    			qlen, q_hwm, full);
+    if (dispatched > 0)
+	t_fprintf(&cty->conn, "%ld dispatched; average wait %ld ms (max = %ld ms)\r\n",
+    			dispatched, (long) (wait_total / dispatched), (long) wait_max);
 
 }
 /* cty_forward --
@@ -613,7 +679,9 @@ static void cty_help(ctystate *cty) {
     t_fprintf(&cty->conn, "------ Looking Around -----\r\n");
     t_fprintf(&cty->conn, "BYE          -- End control session, server keeps running.\r\n");
     t_fprintf(&cty->conn, "COUNT        -- Show current statistics.\r\n");
+    t_fprintf(&cty->conn, "EXPSTAT      -- Show expiration progress.\r\n");
     t_fprintf(&cty->conn, "HELP         -- This is it.\r\n");
+    t_fprintf(&cty->conn, "LOCKS        -- Show lock wait & hold times.\r\n");
     t_fprintf(&cty->conn, "QUIT         -- Same as BYE.\r\n");
     t_fprintf(&cty->conn, "UID <uid>    -- Show DND & mailbox info by UID.\r\n");
     t_fprintf(&cty->conn, "USER <name>  -- Lookup name; show DND & mailbox info.\r\n");
@@ -627,6 +695,7 @@ static void cty_help(ctystate *cty) {
     t_fprintf(&cty->conn, "DEPORT <user>,<blitzserv>,<domain>	-- Copy user's mail to an outside site.\r\n");   
     t_fprintf(&cty->conn, "DIE          -- Kill server, causing a core dump.\r\n");
     t_fprintf(&cty->conn, "STOP         -- Shut down server cleanly.\r\n");
+    t_fprintf(&cty->conn, "CHECK <uid>  -- Check mailbox summaries against messages.\r\n");
     t_fprintf(&cty->conn, "CLEANOUT     -- Remove boxes belonging to devalidated accounts.\r\n");
     t_fprintf(&cty->conn, "FORWARD <uid>  -- Enter new forwarding addr.\r\n");    
     t_fprintf(&cty->conn, "REFRESH <uid> -- Refresh mailbox info (after reloading messages).\r\n");
@@ -881,8 +950,13 @@ static boolean_t cty_login(ctystate *cty) {
 
 static void cty_mstat(ctystate *cty) {
 
+    static char *kindname[T_KINDS] = { "Other", "File", "Client", "SMTP" };
+    int		i;
+    struct t_bufstat stats;		/* copy of t_bufstats[i] */
+    struct slab_cache *sc;		/* current slab cache */
+    
     t_fprintf(&cty->conn, "Malloc counters:\r\n");
-    t_fprintf(&cty->conn, "Total (net) mallocs: %ld\r\n", malloc_stats.total);
+    t_fprintf(&cty->conn, "Total (net) mallocs: %ld\r\n", malloc_total());
     t_fprintf(&cty->conn, "Mbox's: %ld\r\n", malloc_stats.mbox);
     t_fprintf(&cty->conn, "Summary buckets: %ld\r\n", malloc_stats.summbuck);
     t_fprintf(&cty->conn, "Obufs: %ld\r\n", malloc_stats.obufs);
@@ -891,6 +965,91 @@ static void cty_mstat(ctystate *cty) {
     t_fprintf(&cty->conn, "Pref entries: %ld\r\n", malloc_stats.prefentry); 
     t_fprintf(&cty->conn, "Mailing list tables: %ld\r\n", malloc_stats.mltab);
     t_fprintf(&cty->conn, "Mailing list entries: %ld\r\n", malloc_stats.mlentry);
+    t_fprintf(&cty->conn, "Messid index bytes: %ld\r\n", malloc_stats.messidx);
+    
+    t_fprintf(&cty->conn, "I/O buffers (pool hits/mallocs; syscalls/saved):\r\n");
+    for (i = 0; i < T_KINDS; ++i) {
+	pthread_mutex_lock(&t_buflock);
+	stats = t_bufstats[i];		/* copy, so we don't print holding lock */
+	pthread_mutex_unlock(&t_buflock);
+	t_fprintf(&cty->conn, "  %s: %ld/%ld; %ld/%ld\r\n", kindname[i],
+			stats.hits, stats.misses, stats.syscalls, stats.saved);
+    }
+    
+    t_fprintf(&cty->conn, "Slab caches (in use/depot/magazines, bytes; allocs/mallocs):\r\n");
+    for (i = 0; i < SLAB_COUNT; ++i) {
+	sc = &slab_caches[i];
+	t_fprintf(&cty->conn, "  %s: %ld/%ld/%ld, %ld; %ld/%ld\r\n", sc->name,
+			sc->inuse, sc->depotcnt, sc->blocks - sc->inuse - sc->depotcnt,
+			sc->blocks * (long) sc->size, sc->allocs, sc->mallocs);
+    }
+}
+
+/* cty_expstat --
+
+    Show how far along the expiration check is on each filesystem, and
+    (from the rate so far) about how long it has to go.
+*/
+
+static void cty_expstat(ctystate *cty) {
+
+    int		fs;
+    long	done, todo, ops;	/* boxes checked; to check; I/O ops */
+    int		workers;		/* still running */
+    u_long	elapsed;		/* ms so far */
+    double	secs;
+    boolean_t	any = FALSE;
+
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	if (!exp_progress(fs, &done, &todo, &ops, &workers, &elapsed))
+	    continue;
+	if (!any)
+	    t_fprintf(&cty->conn, "Expiration check in progress:\r\n");
+	any = TRUE;
+	secs = elapsed / 1000.0;
+	t_fprintf(&cty->conn, "  %s: %ld of %ld boxes, %d workers, %ld I/O ops (%ld/sec); %ld min elapsed",
+		m_filesys[fs], done, todo, workers, ops,
+		secs > 0 ? (long) (ops / secs) : 0L, (long) (secs / 60));
+	if (done > 0 && done < todo)
+	    t_fprintf(&cty->conn, ", about %ld min to go", 
+	    	(long) (secs * (todo - done) / done / 60 + 0.5));
+	t_fprintf(&cty->conn, ".\r\n");
+    }
+    if (!any)
+	t_fprintf(&cty->conn, "No expiration check in progress.\r\n");
+}
+
+/* cty_locks --
+
+    Print semaphore wait & hold time histograms, for each class of
+    semaphore and mode it's been seized in.
+*/
+
+static void cty_locks(ctystate *cty) {
+
+    static char	*modename[2] = { "exclusive", "shared" };
+    int		i, mode, b;
+    semclass	c;			/* copy of sem_class[i] */
+    u_long	n;			/* times seized */
+
+    t_fprintf(&cty->conn, "Lock times (ms): <1 <2 <4 <8 <16 <32 <64 <128 <256 <512 <1K <2K <4K more\r\n");
+    for (i = 0; i < sem_classcount; ++i) {
+	c = sem_class[i];		/* (counts may be a little stale) */
+	for (mode = SEM_X; mode <= SEM_S; ++mode) {
+	    for (n = 0, b = 0; b < SEM_HISTMAX; ++b)
+		n += c.wait[mode][b];
+	    if (n == 0)
+		continue;		/* never seized this way */
+	    t_fprintf(&cty->conn, "%s %s (%ld):\r\n", c.name, modename[mode], (long) n);
+	    t_fprintf(&cty->conn, "  wait:");
+	    for (b = 0; b < SEM_HISTMAX; ++b)
+		t_fprintf(&cty->conn, " %ld", (long) c.wait[mode][b]);
+	    t_fprintf(&cty->conn, "\r\n  hold:");
+	    for (b = 0; b < SEM_HISTMAX; ++b)
+		t_fprintf(&cty->conn, " %ld", (long) c.hold[mode][b]);
+	    t_fprintf(&cty->conn, "\r\n");
+	}
+    }
 }
 
 /* cty_quit --
@@ -904,6 +1063,47 @@ static void cty_quit(ctystate *cty) {
     
     cty->done = TRUE;
 }
+/* cty_check --
+
+    Run the full summary/message consistency check (summ_check) on a box
+    now, rather than trusting its manifest.
+*/
+
+static void cty_check(ctystate *cty) {	
+
+    long	uid;			/* user to check */
+    char	name[MAX_STR];		/* user in #<uid> form */
+    int		fs;
+    mbox	*mb;
+    char	*p;
+ 
+    p = cty->comline + strlen("CHECK");
+    if (*p++ != ' ' || !*p) {
+	 t_fprintf(&cty->conn, "Error: no uid given.\r\n");
+	 return;
+    }
+    if (*p == '#')			/* allow optional # */
+	++p;
+
+    p = strtonum(p, &uid);		/* user to check */
+    if (uid <= 0)  {			/* nonnumeric, or plain bad */
+	t_fprintf(&cty->conn, "Invalid uid.\r\n");
+	return;
+    }
+    
+    /* must check DND to see where they are now */
+    t_sprintf(name, "#%ld", uid);
+    if (!cty_whichfs(cty, name, &fs, NULL))
+	return;
+
+    mb = mbox_find(uid, fs, FALSE);	/* locate box */
+    sem_seize(&mb->mbsem);
+    summ_check(mb);			/* the full treatment */
+    t_fprintf(&cty->conn, "Ok; %ld messages, %ld bytes.\r\n", mb->messcount, mb->boxlen);
+    sem_release(&mb->mbsem);
+    mbox_done(&mb);
+
+}
 /* cty_refresh --
 
     Refresh mailbox (e.g., after reloading message file).  Disconnect any active user session.
@@ -921,6 +1121,7 @@ static void cty_refresh(ctystate *cty) {
     char	*p;
     boolean_t	inuse = FALSE;
     boolean_t	writeerr = FALSE;
+    boolean_t	alone;			/* nobody else has box attached? */
     int		foldnum;		/* current folder */
     int		hash;
   
@@ -950,6 +1151,7 @@ static void cty_refresh(ctystate *cty) {
     hash = MBOX_HASH(mb->uid);
     sem_seize(&mbox_sem[hash]);		/* don't let anyone else attach the box */
     sem_seize(&mb->mbsem);		/* (must seize box _after_ list) */
+    alone = mbox_claim(mb);		/* (lookups don't need the list sem) */
 
     if (mb->prefs && mb->prefs->dirty) /* write out preferences */
 	pref_write(mb);
@@ -969,28 +1171,32 @@ static void cty_refresh(ctystate *cty) {
     }
     
     if (mb->prefs) {			/* forget prefs */
-	if (mb->attach == 1)		/* if we're only one looking at box */
+	if (alone)			/* if we're only one looking at box */
 	    pref_free(mb);		/* free pref hash table */
 	else
 	    inuse = TRUE;
     }
     if (mb->lists) {			/* forget lists */
-	if (mb->attach == 1)		/* if we're only one looking at box */
+	if (alone)			/* if we're only one looking at box */
 	    ml_free(mb);		/* free list hash table */
 	else
 	    inuse = TRUE;
     }
     
     mb->checked = FALSE;		/* next time, must re-check it */
+    mb->indexed = FALSE;
+    (void) summ_unmanifest(mb);		/* (fully; manifest can't vouch for reloaded messages) */
 
     if (mb->fold && !writeerr) {	/* forget summaries */
-        if (mb->attach == 1) {           /* if we're only one looking at box */
+        if (alone) {			/* if we're only one looking at box */
     	    t_free(mb->fold);			/* re-check to see what folders exist at that time */
     	    mb->fold = NULL; mb->foldmax = -1;	/* sppml */
 	} else {
 	    inuse = TRUE;
 	}
     }
+    if (alone)
+	mbox_unclaim(mb);
     sem_release(&mb->mbsem);		/* unlock the box */
     sem_release(&mbox_sem[hash]);	/* and the list */
     mbox_done(&mb);			/* and release our attachment */
@@ -1482,6 +1688,7 @@ static void local_xfer(ctystate *cty, long uid, int oldfs, char *diskname) {
     } else {				/* copy successful; we are now committed */
 	t_fprintf(&cty->conn, "Changing DND..."); t_fflush(&cty->conn);
 	record_fs(mb);			/* alter dnd entry */
+	summ_expindex(mb);		/* its messages expire here now */
 	t_fprintf(&cty->conn, "Removing old box..."); t_fflush(&cty->conn);	
 	if (!do_rm(oldname)) 
 	    t_fprintf(&cty->conn, "rm failed: %s.\r\n", strerror(pthread_errno()));
@@ -1734,6 +1941,8 @@ static boolean_t xfer_fold(ctystate *cty, t_file *conn, mbox *mb, folder *fold)
     for (p = fold->summs; p != NULL; p = p->next) {
 	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
 	    summ = (summinfo *) nextsum;
+	    if (SUMM_DEAD(summ))
+		continue;
 	    if (!xfer_mess(cty, conn, mb, destfold, summ)) { /* do 1 transfer */
 		ok = FALSE;
 		goto cleanup;			/* transfer error; give up */
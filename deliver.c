@@ -307,7 +307,7 @@ void blitzdeliver(char *sender, recip *rlist1, recip *rlist2, messinfo *mi,
     }
     
     if (sentout)				/* statistics: messages sent to other server(s) */
-	++m_sent_blitzsmtp;
+	STAT_INC(m_sent_blitzsmtp);
 	
     t_free(servrecips);
     
@@ -481,7 +481,7 @@ boolean_t localdeliver_one(char *sender, char *name, long uid, int fs, messinfo
 	    t_errprint_ll("Duplicate summary delivering mess %ld to uid %ld",
 	    		   summ->messid, uid);
 			   
-	++m_delivered;			/* statistics: local deliveries */   
+	STAT_INC(m_delivered);		/* statistics: local deliveries */
 	ok = TRUE;			/* return good status */
 	newmail_warn(mb, summ->messid, INBOX_NUM); /* queue up warning iff user active */
     	
@@ -664,7 +664,7 @@ boolean_t deliver(udb *user, char *sender, recip *tolist, recip *cclist, recip *
     		summ->messid, sender, summ->totallen, summ->enclosures);
     log_it(logbuf);
     t_free(logbuf);
-    ++m_sent;				/* statistics: count messages sent */
+    STAT_INC(m_sent);			/* statistics: count messages sent */
     
     /* handle any bad addresses in to/cc lists */
 	    
@@ -715,7 +715,7 @@ boolean_t deliver(udb *user, char *sender, recip *tolist, recip *cclist, recip *
 	do { 				/* while more bcc's */  
 	    bcccopy = NULL;
 	    for(;;) {			/* combine sequence of "noshow"s */
-		new = mallocf(sizeof(recip));
+		new = slab_alloc(SLAB_RECIP);
 		*new = *onebcc;		/* copy recip from master list */
 		if (!bcccopy)		/* first? */
 		    new->next = new; 	/* link to self */
@@ -755,7 +755,7 @@ boolean_t deliver(udb *user, char *sender, recip *tolist, recip *cclist, recip *
 		
 	    logbuf = mallocf(255 + strlen(sender));
 	    t_sprintf(logbuf, "Delivering bcc %ld from %s", summ->messid, sender);
-	    ++m_sent;
+	    STAT_INC(m_sent);
 	    log_it(logbuf);
 	    t_free(logbuf);
 	
@@ -1200,7 +1200,7 @@ void internet_send(char *sender, recip *rlist1, recip *rlist2, fileinfo *textmes
     if (wait4(pid, &stat, 0, NULL) != pid) 
 	t_perror("internet: wait4");
     else {				/* 2nd pass through recips bouncing/logging */
-	++m_sent_internet;		/* statistics: count internet messages sent */
+	STAT_INC(m_sent_internet);	/* statistics: count internet messages sent */
 	
 	if (stat.w_termsig != 0) {
 	    t_sprintf(logbuf, "Sendmail aborted w/ signal %d", stat.w_termsig);
@@ -1402,7 +1402,7 @@ void binhex_enclosures(char *sender, recip *rlist1, recip *rlist2, fileinfo *hea
 					 r->id);
 			i = 0;		/* can't clone; don't know which server */
 		    }
-		    new = (recip *) mallocf(sizeof(recip));
+		    new = (recip *) slab_alloc(SLAB_RECIP);
 		    *new = *r;		/* copy the recipient */
 		    if (!reciphalf[i])	/* first one? */
 			new->next = new;/* link to self */
@@ -1429,7 +1429,7 @@ void binhex_enclosures(char *sender, recip *rlist1, recip *rlist2, fileinfo *hea
 	    t_sprintf(logbuf,"Create enclosure clone %ld for %s %ld",
 			summ->messid, r->name, r->id);
 	    log_it(logbuf);
-	    new = (recip *) mallocf(sizeof(recip));
+	    new = (recip *) slab_alloc(SLAB_RECIP);
 	    *new = *r;			/* copy the recipient */
 	    new->local = TRUE;		/* but this time use local box */
 	    new->oneshot = TRUE;
@@ -1665,7 +1665,7 @@ void bad_mail(char *send_addr, char *recip_addr, fileinfo *head, fileinfo *text,
     t_fclose(f);    
     
     deliver(NULL, POSTMASTER, rlist, NULL, NULL, &newtext, NULL, &newsumm, FALSE, NULL, FALSE);
-    ++m_sent_bounce;			/* statistics: count bounce messages */
+    STAT_INC(m_sent_bounce);		/* statistics: count bounce messages */
     
     finfoclose(&newtext);
     free_recips(&rlist);
@@ -1879,7 +1879,7 @@ void send_vacation(char *send_addr, recip *send_rlist, recip *r) {
 	finfo.temp = TRUE;		/* unlink file when done */
 	t_fclose(text);
 	deliver(NULL, POSTMASTER, send_rlist, NULL, NULL, &finfo, NULL, &newsumm, FALSE, replyto,FALSE);
-	++m_sent_vacation;		/* statistics: count vacations sent */
+	STAT_INC(m_sent_vacation);	/* statistics: count vacations sent */
 
     }
     
@@ -1981,7 +1981,7 @@ void do_receipt(char *recip_name, summinfo *summ, fileinfo *head) {
     /* don't send receipts to self */
     if (strcasecmp(receiptaddr, replyto) != 0) {
     	deliver(NULL, POSTMASTER, rlist, NULL, NULL, &newtext, NULL, &newsumm, FALSE, replyto, FALSE);
-	++m_sent_receipt;			/* statistics: count receipts sent */
+	STAT_INC(m_sent_receipt);		/* statistics: count receipts sent */
     }
     
     finfoclose(&newtext);
@@ -33,12 +33,69 @@ void do_mkdir(char *s1, char *s2);
 static void mbox_setup_folders(mbox *mb);
 static boolean_t uid_to_boxname(mbox *mb);
 static any_t expirefs(any_t _fs);
+static void mbox_lrutouch(mbox *mb);
+static void mbox_evict();
+static void mbox_trim();
+static boolean_t mbox_overbudget();
+static void expidx_open(int fs);
+static void expidx_flush(int fs);
+static void explog_flush(explogbuf *b);
+static void exp_poolinit(int fs);
+static void exp_trickleinit();
+
+/* Lock-free lookups need atomic attach counts (and memory barriers);
+   use them wherever the statistics counters are atomic (see misc.h). */
+#ifdef STAT_ATOMIC
+#define MBOX_ATOMIC
+#endif
+
+static mbox	*mbox_limbo;		/* boxes freed since last mbox_reap */
+static mbox_table *mbox_tablimbo;	/* ditto for retired tables */
+
+/* Lock-free lookups in progress, by epoch parity (see mbox_reap).  A
+   lookup counts itself under the current epoch; mbox_reap flips the
+   epoch and waits for the old count to drain before freeing anything. */
+static u_long	mbox_epoch;
+static long	mbox_readers[2];
+
+/* The dirty queues:  boxes with something to write (see mbox_dirty),
+   one queue and writer thread per filesystem. */
+struct fs_writer {
+	pthread_mutex_t	lock;		/* protects remaining fields */
+	pthread_cond_t	wait;		/* writer waits here to be kicked */
+	pthread_mutex_t	flushlock;	/* held while the queue is written */
+	mbox		*dirtyq;	/* boxes with something to write */
+	boolean_t	kick;		/* time to write them */
+	long		backlog;	/* boxes on dirtyq */
+	long		backlog_hwm;	/* peak backlog */
+	long		flushed;	/* boxes written */
+	u_long		lat_total;	/* total time writing them (ms) */
+	u_long		lat_max;	/* longest in latest pass (ms) */
+};
+typedef struct fs_writer fs_writer;
+
+static fs_writer mbox_fsw[FILESYS_MAX];
+
+/* queue a box on (fs may be unassigned; or changed, by cty MOVE) */
+#define MBOX_WFS(mb)	((mb)->fs >= 0 && (mb)->fs < m_filesys_count ? (mb)->fs : 0)
+
+/* The LRU list:  boxes with data cached, least recently attached first. */
+static mbox	*mbox_lruhead, *mbox_lrutail;
+static long	mbox_lrucount;		/* boxes on it */
+static boolean_t mbox_evicting;		/* mbox_evict running? */
+static pthread_mutex_t mbox_lrulock;
+static pthread_cond_t mbox_evictwait;	/* wakes mbox_evictor */
+
+#define MB_IDLETIME	(5*60)		/* evict data of boxes unused this long */
+#define MB_LRUGRAIN	10		/* (see mbox_lrutouch) */
+#define MB_PREFENTSIZE	64		/* typical pref entry (for mbox_cachesize) */
+#define MB_MLENTSIZE	64		/* typical mailing list entry (ditto) */
 
 /* mbox_alloc --
     
     Allocate and initialize mailbox structure, enter it into hash table.
     Note that all fields need to be initialized to innocuous values before
-    releasing mbox_sem.
+    releasing mbox_sem (and before a lock-free lookup can see it).
     
     --> mbox_sem seized <--
 
@@ -46,17 +103,19 @@ static any_t expirefs(any_t _fs);
 mbox *mbox_alloc(long uid, int fs) {
     
     mbox 	*mb;			/* returned: mailbox structure */
-    int		hash;
+    mbox	**head;			/* its chain */
     
     mb = (mbox *) mallocf(sizeof(mbox));
-    pthread_mutex_lock(&global_lock);
-    ++malloc_stats.mbox;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(malloc_stats.mbox);
 
 	    
     /* fill in the structure */
     mb->attach = 1;			/* starts out with one thread using it */
     sem_init(&mb->mbsem, "mbsem");
+    messidx_init(&mb->messfold);
+    mb->limbo = NULL;
+    mb->queued = mb->resident = FALSE;
+    mb->lastuse = 0;
     if (uid < 0)			/* negative uid's aren't real */
     	return mb;
 
@@ -69,29 +128,37 @@ mbox *mbox_alloc(long uid, int fs) {
     mb->xfering = FALSE;
     mb->gone = FALSE;
     mb->checked = FALSE;		/* summary check not yet done */
+    mb->indexed = FALSE;
+    mb->manifest = FALSE;
+    mb->mfgen = 0;
     mb->fold = NULL;
     mb->foldmax = 0;
     mb->prefs = NULL;
     mb->lists = NULL;
     mb->boxlen = 0;
+    mb->messcount = 0;
     		    
-    hash = MBOX_HASH(uid);
-    mb->next = mbox_tab[hash];	/* add to table */
+    head = &mbox_tab->chain[uid & (mbox_tab->size - 1)];
+    mb->next = *head;		/* add to table */
     mb->prev = NULL;
     if (mb->next)
 	mb->next->prev = mb;
-    mbox_tab[hash] = mb;
+#ifdef MBOX_ATOMIC
+    __sync_synchronize();		/* contents visible before the link */
+#endif
+    *head = mb;
     
-    ++mbox_count;			/* one more entry in table */
+    STAT_INC(mbox_count);		/* one more entry in table */
     
     return mb;
 }
 
 /*^L mbox_free --
 
-    Unlink mbox from hash table & free it.
+    Unlink mbox from hash table & free it.  (If there may be lock-free
+    readers, the struct itself goes to limbo; mbox_reap frees it later.)
 
-    --> mbox_sem seized <--
+    --> mbox_sem seized, box claimed <--
 
 */
 
@@ -105,7 +172,8 @@ void mbox_free(mbox *mb) {
     if (mb->prev)
 	mb->prev->next = mb->next;
     else
-	mbox_tab[MBOX_HASH(mb->uid)] = mb->next; /* new head */
+	mbox_tab->chain[mb->uid & (mbox_tab->size - 1)] = mb->next; /* new head */
+    STAT_DEC(mbox_count);
     
 
     if (mb->prefs)
@@ -124,19 +192,251 @@ void mbox_free(mbox *mb) {
     }
 
     t_free(mb->fold);
+    messidx_free(&mb->messfold);
     sem_destroy(&mb->mbsem);
+#ifdef MBOX_ATOMIC
+    pthread_mutex_lock(&global_lock);	/* (next & uid must stay intact) */
+    mb->limbo = mbox_limbo;
+    mbox_limbo = mb;
+    pthread_mutex_unlock(&global_lock);
+#else
     t_free(mb);
+    STAT_DEC(malloc_stats.mbox);
+#endif
+}
+
+/* mbox_reap --
+
+    Free the boxes and tables that have been put in limbo.  Everything on
+    the limbo lists is already unlinked, so only a lookup that started
+    before we took the lists can be looking at it.  Flip the epoch, so new
+    lookups count themselves on the other side, and wait for the lookups
+    counted under the old one to finish (they're just a chain walk).
+*/
 
-    pthread_mutex_lock(&global_lock);
-    --malloc_stats.mbox;
+static void mbox_reap() {
+
+#ifdef MBOX_ATOMIC
+    mbox	*oldmb, *mb;
+    mbox_table	*oldtab, *tab;
+    int		old;			/* old epoch parity */
+
+    pthread_mutex_lock(&global_lock);	/* take everything in limbo */
+    oldmb = mbox_limbo;
+    mbox_limbo = NULL;
+    oldtab = mbox_tablimbo;
+    mbox_tablimbo = NULL;
     pthread_mutex_unlock(&global_lock);
 
+    if (oldmb == NULL && oldtab == NULL)
+	return;
+
+    old = mbox_epoch & 1;
+    (void) __sync_add_and_fetch(&mbox_epoch, 1); /* (unlinks are visible first) */
+    while (__sync_add_and_fetch(&mbox_readers[old], 0) != 0)
+	pthread_yield();		/* wait out lookups that may see them */
+
+    while ((mb = oldmb) != NULL) {
+	oldmb = mb->limbo;
+	t_free(mb);
+	STAT_DEC(malloc_stats.mbox);
+    }
+    while ((tab = oldtab) != NULL) {
+	oldtab = tab->limbo;
+	t_free(tab);
+    }
+#endif
+}
+
+/* mbox_grow --
+
+    If the chains have gotten too long, double the table (as often as
+    necessary).  Every chain must be locked while the boxes are relinked.
+    A lock-free lookup in progress may be led astray and miss its box;
+    it then takes the slow path (which waits for us).
+*/
+
+static void mbox_grow() {
+
+    mbox_table	*new;			/* new table */
+    mbox_table	*old;			/* and the one it replaces */
+    long	size;
+    long	i;
+    mbox	*mb, *nextmb;
+    mbox	**head;
+
+    if (mbox_count <= MBOX_LOAD * mbox_tab->size)
+	return;				/* (unlocked peek) */
+
+    for (i = 0; i < MBOX_HASHMAX; ++i)	/* (in order) */
+	sem_seize(&mbox_sem[i]);
+
+    old = mbox_tab;
+    for (size = old->size; mbox_count > MBOX_LOAD * size; size *= 2)
+	;
+    if (size > old->size) {
+	new = (mbox_table *) mallocf(sizeof(mbox_table) + (size - 1) * sizeof(mbox *));
+	new->size = size;
+	new->limbo = NULL;
+	for (i = 0; i < size; ++i)
+	    new->chain[i] = NULL;
+
+	for (i = 0; i < old->size; ++i) {
+	    for (mb = old->chain[i]; mb != NULL; mb = nextmb) {
+		nextmb = mb->next;
+		head = &new->chain[mb->uid & (size - 1)];
+		mb->next = *head;
+		mb->prev = NULL;
+		if (mb->next)
+		    mb->next->prev = mb;
+		*head = mb;
+	    }
+	}
+#ifdef MBOX_ATOMIC
+	__sync_synchronize();		/* new table complete before it's seen */
+#endif
+	mbox_tab = new;
+
+#ifdef MBOX_ATOMIC
+	pthread_mutex_lock(&global_lock);	/* free old one when it's safe */
+	old->limbo = mbox_tablimbo;
+	mbox_tablimbo = old;
+	pthread_mutex_unlock(&global_lock);
+#else
+	t_free(old);			/* (nobody looks without the sems) */
+#endif
+    }
+
+    for (i = MBOX_HASHMAX - 1; i >= 0; --i)
+	sem_release(&mbox_sem[i]);
+}
+
+/* mbox_hold --
+
+    Add an attachment to a box, unless it's being freed (returns FALSE).
+    Without atomic operations, mbox_sem must be held.
+*/
+
+static boolean_t mbox_hold(mbox *mb) {
+
+#ifdef MBOX_ATOMIC
+    int		attach;
+
+    for (;;) {
+	attach = mb->attach;
+	if (attach < 0)
+	    return FALSE;		/* claimed */
+	if (__sync_bool_compare_and_swap(&mb->attach, attach, attach + 1))
+	    return TRUE;
+    }
+#else
+    if (mb->attach < 0)
+	return FALSE;
+    ++mb->attach;
+    return TRUE;
+#endif
+}
+
+/* mbox_attach --
+
+    Add another attachment to a box we already have attached (so it can't
+    be claimed, and this can't fail).
+*/
+
+static void mbox_attach(mbox *mb) {
+
+#ifdef MBOX_ATOMIC
+    (void) mbox_hold(mb);
+#else
+    int		hash;
+
+    hash = MBOX_HASH(mb->uid);
+    sem_seize(&mbox_sem[hash]);
+    (void) mbox_hold(mb);
+    sem_release(&mbox_sem[hash]);
+#endif
+}
+
+/* mbox_claim --
+
+    If we hold the only attachment to a box, claim it, so nobody can
+    attach it until we mbox_unclaim (or free) it.  Returns FALSE if
+    others have it attached.
+
+    --> mbox_sem seized <--
+*/
+
+boolean_t mbox_claim(mbox *mb) {
+
+#ifdef MBOX_ATOMIC
+    return __sync_bool_compare_and_swap(&mb->attach, 1, MBOX_CLAIMED);
+#else
+    if (mb->attach != 1)
+	return FALSE;
+    mb->attach = MBOX_CLAIMED;
+    return TRUE;
+#endif
+}
+
+/* mbox_unclaim --
+
+    Done with a claimed box; back to just our attachment.
+
+    --> mbox_sem seized <--
+*/
+
+void mbox_unclaim(mbox *mb) {
+
+#ifdef MBOX_ATOMIC
+    (void) __sync_bool_compare_and_swap(&mb->attach, MBOX_CLAIMED, 1);
+#else
+    mb->attach = 1;
+#endif
+}
+
+/* mbox_lookup --
+
+    Find a box in the table and attach it, without locking anything.
+    Returns NULL if the box isn't found (or we can't do it this way);
+    the caller should then search again the slow way.  While we walk the
+    chain we're counted in mbox_readers, so nothing we might step on is
+    freed out from under us (see mbox_reap).
+*/
+
+static mbox *mbox_lookup(long uid) {
+
+#ifdef MBOX_ATOMIC
+    mbox_table	*tab;
+    mbox	*mb;
+    int		e;			/* epoch parity we're counted under */
+
+    for (;;) {				/* get counted under the current epoch */
+	e = mbox_epoch & 1;
+	(void) __sync_add_and_fetch(&mbox_readers[e], 1); /* (full barrier) */
+	if ((__sync_add_and_fetch(&mbox_epoch, 0) & 1) == e)
+	    break;
+	(void) __sync_sub_and_fetch(&mbox_readers[e], 1); /* flipped; again */
+    }
+    tab = mbox_tab;			/* (only now) */
+    for (mb = tab->chain[uid & (tab->size - 1)]; mb != NULL; mb = mb->next) {
+	if (mb->uid == uid) {
+	    if (!mbox_hold(mb))
+		mb = NULL;
+	    break;
+	}
+    }
+    (void) __sync_sub_and_fetch(&mbox_readers[e], 1);
+    return mb;
+#else
+    return NULL;
+#endif
 }
 
-/* mbox_find --
+/* mbox_find --
     
     Locate/create mailbox block for given uid.  Increment its attachment count,
-    and return a pointer to it	
+    and return a pointer to it.  If it's already in the table, this usually
+    takes no hash table semaphore (see mbox_lookup).
     
 */
 
@@ -146,20 +446,22 @@ mbox *mbox_find(long uid, int fs, boolean_t no_record) {
     int		hash;
     boolean_t	chosen;			/* new fs choice made? */
 
-    hash = MBOX_HASH(uid);		/* hash on low bits of uid */
-    	
-    sem_seize(&mbox_sem[hash]);		/* search hash table for box */
-    for (mb = mbox_tab[hash]; mb != NULL; mb = mb->next) {
-    	if (mb->uid == uid)
-	    break;
-    }
-    
-    if (mb == NULL)			/* if not in table allocate & add it */
-	mb = mbox_alloc(uid, fs);
-    else
-	++mb->attach;			/* glomming on to existing entry */
+    if ((mb = mbox_lookup(uid)) == NULL) {	/* usually there already */
+	hash = MBOX_HASH(uid);		/* hash on low bits of uid */
+
+	sem_seize(&mbox_sem[hash]);	/* search hash table for box */
+	for (mb = mbox_tab->chain[uid & (mbox_tab->size - 1)]; mb != NULL; mb = mb->next) {
+	    if (mb->uid == uid)
+		break;
+	}
+
+	if (mb == NULL)			/* if not in table allocate & add it */
+	    mb = mbox_alloc(uid, fs);
+	else
+	    (void) mbox_hold(mb);	/* glomming on to existing entry */
 
-    sem_release(&mbox_sem[hash]);	/* allow other mbox_finds to proceed... */
+	sem_release(&mbox_sem[hash]);	/* allow other mbox_finds to proceed... */
+    }
     
     sem_seize(&mb->mbsem);		/* ...while we work on this box */
 
@@ -172,10 +474,17 @@ mbox *mbox_find(long uid, int fs, boolean_t no_record) {
     
     if (!mb->checked) {			/* unless they're known to be valid */
 	mbox_setup_folders(mb);		/* locate & set up folders */
-	summ_check(mb);			/* check out summaries */
+	if (!summ_fastcheck(mb))	/* manifest says they're ok? */
+	    summ_check(mb);		/* no - check out summaries */
     }
 
-    mb->idle = 0;			/* reset idle count to 0 upon attach */
+    if (mb->uid != pubml_uid) {		/* (always resident) */
+	if (mb->resident)
+	    STAT_INC(mb_stats.cache_hit);
+	else
+	    STAT_INC(mb_stats.cache_miss);
+    }
+    mbox_lrutouch(mb);			/* recently used */
 
     sem_release(&mb->mbsem);
 
@@ -186,7 +495,7 @@ mbox *mbox_find(long uid, int fs, boolean_t no_record) {
     
     Release attachment to mailbox.  Each call to mbox_find should eventually
     be matched by an mbox_done.  Note that the attachment count is protected
-    by mbox_sem.  The caller should consider mbox_done to be essentially
+    by mbox_sem (or is changed atomically, if we can).  The caller should consider mbox_done to be essentially
     equivalent to a call to "free" -- after the call, its reference to the
     box is no longer valid.  To emphasize this point, the caller's pointer
     is NULL'd.  
@@ -200,6 +509,12 @@ mbox *mbox_find(long uid, int fs, boolean_t no_record) {
 
 void mbox_done(mbox **mb) {
 
+#ifdef MBOX_ATOMIC
+    if (__sync_sub_and_fetch(&(*mb)->attach, 1) < 0) {
+	t_errprint_l("Negative attach count box %d!", (*mb)->uid);
+	abortsig();
+    }	
+#else
     int		hash;
 
     hash = MBOX_HASH((*mb)->uid);
@@ -212,11 +527,125 @@ void mbox_done(mbox **mb) {
     }	
     
     sem_release(&mbox_sem[hash]);
+#endif
     
-    /* no explicit free here */
+    /* no explicit free here; but if box data is over budget, get some evicted */
+    if (m_cachemax > 0 && mbox_overbudget())
+	pthread_cond_signal(&mbox_evictwait);
 
     *mb = NULL;				/* sppml */
 }
+/* Signon warm-up reads (see mbox_warm). */
+struct warmread {
+	mbox		*mb;		/* box (we hold an attachment) */
+	int		foldnum;	/* folder to read; -1 for prefs & lists */
+	char		fname[FILENAME_MAX];	/* its summary file */
+	char		jname[FILENAME_MAX];	/* and journal */
+};
+static int		mbox_warming;	/* reads outstanding */
+static pthread_mutex_t	mbox_warmlock;	/* protects mbox_warming */
+
+/* mbox_warmread --
+
+    Worker routine for one warm-up read.  The folder's files are read into
+    the buffer cache first, with nothing locked.  Then, if the box can be
+    locked without waiting, the summaries are loaded (quickly, now); if
+    not, the session has it, and will load them itself when it needs them.
+*/
+
+static any_t mbox_warmread(any_t wr_) {
+
+    struct warmread	*wr = (struct warmread *) wr_;
+    mbox		*mb = wr->mb;
+    folder		*fold;
+
+    if (wr->foldnum >= 0)
+	fold_prefetch(wr->fname, wr->jname);	/* the slow part */
+
+    if (sem_tryseize(&mb->mbsem)) {
+	if (mb->gone)
+	    ;
+	else if (wr->foldnum < 0) {
+	    if (!mb->prefs)
+		pref_read(mb);
+	    if (!mb->lists)
+		ml_readhash(mb);
+	} else if (wr->foldnum < mb->foldmax) {
+	    fold = &mb->fold[wr->foldnum];
+	    if (fold->num >= 0 && fold->summs == NULL)
+		summ_read(mb, fold);
+	}
+	sem_release(&mb->mbsem);
+    }
+
+    mbox_done(&mb);
+    t_free(wr);
+    pthread_mutex_lock(&mbox_warmlock);
+    --mbox_warming;
+    pthread_mutex_unlock(&mbox_warmlock);
+    return 0;
+}
+
+/* mbox_warm --
+
+    A user has just signed on:  get their box's folder summaries, prefs and
+    mailing lists into memory before they're asked for (see warm_start).
+    Each folder (up to WARM_FOLDMAX) is handed to the worker pool, so their
+    files are read in parallel.  No more than WARM_READMAX reads are
+    outstanding server-wide; past that, and for any folder the session
+    has locked by the time we get to it, the session reads it itself.
+    Returns the number of reads started.
+
+    --> box attached, not locked <--
+*/
+
+int mbox_warm(mbox *mb) {
+
+    struct warmread	*list[WARM_FOLDMAX + 1]; /* reads to start */
+    struct warmread	*wr;
+    int			n = 0;		/* how many */
+    int			started = 0;
+    int			foldnum;
+    int			i;
+
+    sem_seize_shared(&mb->mbsem);	/* list what isn't in yet */
+    for (foldnum = -1; foldnum < mb->foldmax && n < WARM_FOLDMAX + 1; ++foldnum) {
+	if (foldnum < 0 ? (mb->prefs && mb->lists)
+			: (mb->fold[foldnum].num < 0 || mb->fold[foldnum].summs != NULL))
+	    continue;			/* (hole, or already in) */
+	wr = (struct warmread *) mallocf(sizeof(struct warmread));
+	wr->mb = mb;
+	wr->foldnum = foldnum;
+	if (foldnum >= 0)
+	    fold_names(mb, &mb->fold[foldnum], wr->fname, wr->jname);
+	list[n++] = wr;
+    }
+    sem_release_shared(&mb->mbsem);
+
+    for (i = 0; i < n; ++i) {
+	wr = list[i];
+	pthread_mutex_lock(&mbox_warmlock);
+	if (mbox_warming >= WARM_READMAX) {
+	    pthread_mutex_unlock(&mbox_warmlock);
+	    t_free(wr);
+	    continue;			/* busy; leave it */
+	}
+	++mbox_warming;
+	pthread_mutex_unlock(&mbox_warmlock);
+
+	mbox_attach(mb);		/* one for each read */
+	if (!work_dispatch((pthread_startroutine_t) mbox_warmread, (pthread_addr_t) wr)) {
+	    mbox_done(&wr->mb);		/* pool's full; never mind */
+	    t_free(wr);
+	    pthread_mutex_lock(&mbox_warmlock);
+	    --mbox_warming;
+	    pthread_mutex_unlock(&mbox_warmlock);
+	} else
+	    ++started;
+    }
+    return started;
+}
+
 
 /* mbox_init --
     
@@ -239,6 +668,7 @@ void mbox_init() {
     for (i = 0; i < m_filesys_count; ++i) {
 	do_mkdir(m_filesys[i], MESSTMP_DIR);
 	do_mkdir(m_filesys[i], BOX_DIR);
+	do_mkdir(m_filesys[i], EXPIDX_DIR);
 	do_mkdir(m_filesys[i], MESSXFER_DIR);
 	for (j = 0; j < 100; ++j) {
 	    t_sprintf(subdir, "%s%d/", MESSXFER_DIR, j);
@@ -249,15 +679,37 @@ void mbox_init() {
     }
     	
     /* initialize hash table of active boxes */
+    mbox_tab = (mbox_table *) mallocf(sizeof(mbox_table) + (MBOX_HASHMAX - 1) * sizeof(mbox *));
+    mbox_tab->size = MBOX_HASHMAX;
+    mbox_tab->limbo = NULL;
     for (i = 0; i < MBOX_HASHMAX; i++) {
-	mbox_tab[i] = NULL;
+	mbox_tab->chain[i] = NULL;
 	sem_init(&mbox_sem[i], "mbox_sem");	/* semaphores protecting mbox table */
     }
     mbox_count = 0;
+    pthread_mutex_init(&mbox_warmlock, pthread_mutexattr_default);
+    mbox_limbo = NULL;
+    mbox_tablimbo = NULL;
+    for (i = 0; i < FILESYS_MAX; ++i) {
+	bzero((char *) &mbox_fsw[i], sizeof(fs_writer));
+	pthread_mutex_init(&mbox_fsw[i].lock, pthread_mutexattr_default);
+	pthread_mutex_init(&mbox_fsw[i].flushlock, pthread_mutexattr_default);
+	pthread_cond_init(&mbox_fsw[i].wait, pthread_condattr_default);
+    }
+    mbox_lruhead = mbox_lrutail = NULL;
+    mbox_lrucount = 0;
+    mbox_evicting = FALSE;
+    pthread_mutex_init(&mbox_lrulock, pthread_mutexattr_default);
+    pthread_cond_init(&mbox_evictwait, pthread_condattr_default);
         
     /* set up expiration globals */
     pthread_mutex_init(&exp.lock, pthread_mutexattr_default);
     pthread_cond_init(&exp.wait, pthread_condattr_default);
+    for (i = 0; i < m_filesys_count; ++i) {
+	expidx_open(i);
+	exp_poolinit(i);
+    }
+    exp_trickleinit();
 
 
 }
@@ -508,56 +960,80 @@ void record_fs(mbox *mb) {
     t_free(uidname);
 }
 
-/* mbox_size --
+/* mbox_size --
   
-    Compute total length of all messages in box.  Read message directory,
-    stat each file in turn. 
+    Total length of all messages in box.  This is mb->boxlen, which is
+    computed by summ_check (or taken from the box manifest) and kept
+    current by every deliver, copy and remove (including expiration);
+    no need to look at the message files.
 */
 
 long mbox_size(mbox *mb) {
 
+    long	size;			/* returned: total size */
+
+    sem_seize(&mb->mbsem);
+    size = mb->boxlen;
+    sem_release(&mb->mbsem);
+    
+    return size;
+}
+
+/* mbox_audit --
+
+    Verify the box's accounting against the filesystem:  count the files
+    in the mess directory and compare with mb->messcount.  The directory
+    is read without holding the box lock; if it was modified while we
+    were reading (its mtime changed) the count can't be trusted, so we
+    just give up until next time.  If the count is wrong, log it and
+    run summ_check (which recomputes everything).
+*/
+
+void mbox_audit(mbox *mb) {
+
     char		fname[MBOX_NAMELEN];	/* name of mess dir */
     DIR			*dirf;			/* open directory file */
     struct direct 	*dirp;			/* directory entry */
-    struct stat		*statbuf;		/* stat(2) info */
-    long		size = 0;		/* returned: total size */
-
-    sem_seize(&mb->mbsem);			/* get access to box */
+    struct stat		st;			/* stat(2) info */
+    long		before;			/* mtime before reading */
+    long		count = 0;		/* message files found */
+    long		messid;
+    char		logbuf[MAX_STR];
 
-    statbuf = mallocf(sizeof(struct stat));
-    
-    /* open mess directory */
+    sem_seize(&mb->mbsem);
     strcpy(fname, mb->boxname); strcat(fname, MESS_DIR);
+    sem_release(&mb->mbsem);
     
+    if (stat(fname, &st) < 0) {
+	if (pthread_errno() != ENOENT)
+	    t_perror1("mbox_audit: cannot stat ", fname);
+	return;
+    }
+    before = st.st_mtime;
+
     pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
     dirf = opendir(fname);
     pthread_mutex_unlock(&dir_lock);
 
     if (dirf == NULL) {
-	if (pthread_errno() != ENOENT)	/* if no messages yet, dir may not exist */
-	    t_perror1("mbox_size: cannot open ", fname);
-    } else { 
-    
-	while ((dirp = readdir(dirf)) != NULL) {	/* read entire directory */
-	    
-	    /* skip dot-files */
-	    if (dirp->d_name[0] != '.') {
-		/* construct full pathname of message file */
-		t_sprintf(fname, "%s%s/%s", mb->boxname, MESS_DIR, dirp->d_name);
-		if (stat(fname, statbuf) != 0) /* find out about it */
-		    t_perror1("mbox_size: cannot stat ", fname);
-		else
-		    size += statbuf->st_size;
-	    }
-	}
-	closedir(dirf);
+	t_perror1("mbox_audit: cannot open ", fname);
+	return;
     }
-
-    t_free(statbuf);
-    
-    sem_release(&mb->mbsem);			/* done with box */
-    
-    return size;
+    while ((dirp = readdir(dirf)) != NULL) {	/* read entire directory */
+	if (*strtonum(dirp->d_name, &messid) == 0) /* skip non-numeric names */
+	    ++count;
+    }
+    closedir(dirf);
+
+    sem_seize(&mb->mbsem);
+    if (stat(fname, &st) == 0 && st.st_mtime == before && !mb->gone
+     && mb->checked && count != mb->messcount) {
+	t_sprintf(logbuf, "mbox_audit: uid %ld has %ld messages, not %ld; rechecking",
+			mb->uid, count, mb->messcount);
+	log_it(logbuf);
+	summ_check(mb);
+    }
+    sem_release(&mb->mbsem);
 }
 /* open_vacation --
   
@@ -592,8 +1068,8 @@ boolean_t open_vacation(mbox *mb, fileinfo *finfo) {
 /* mbox_writer --
   
     Thread to write out mailbox changes periodically.  Sleep for
-    a while, then check for modified mailboxes (folders or summaries);
-    write any we find.
+    a while, then have each filesystem's writer (mbox_fswriter) write
+    the modified mailboxes (folders or summaries) on its queue.
     
     Unmodified mbox structures whose attach count is zero may be
     freed, but we generally do NOT do so.
@@ -609,7 +1085,8 @@ boolean_t open_vacation(mbox *mb, fileinfo *finfo) {
     if the box hasn't been used recently, free them up.  
     
     If we're due to expire messages (we haven't done it yet today), fire
-    off a thread to do that.    
+    off a thread to do that.  In trickle mode, start exptrickle on the
+    day's round instead, and kick it every minute to do the next slice.
 */
 
 any_t mbox_writer(any_t zot) {
@@ -619,6 +1096,7 @@ any_t mbox_writer(any_t zot) {
     u_long	lastexp = 0;		/* mactime of day last exp check done */
     t_file	*f;			/* expdate file */
     int		i;
+    boolean_t	newround;		/* start a trickle round? */
     
     /* read file to determine when last expiration was done */
     
@@ -631,6 +1109,7 @@ any_t mbox_writer(any_t zot) {
     for (;;) {
 						 
 	sleep(60);			/* once a minute */
+	newround = FALSE;
 
 	/* if it's time for today's expiration, start the thread to
 	   do that.  If the current time is more than a few days greater
@@ -644,6 +1123,9 @@ any_t mbox_writer(any_t zot) {
 		t_errprint("Automatic expiration check disabled.");
 		t_errprint("CHECK SYSTEM DATE/TIME!");   
 		lastexp = today;		/* don't keep repeating message */
+	    } else if (exp_trickle) {
+		newround = TRUE;		/* spread it over the day */
+		lastexp = today;
 	    } else {
 		pthread_t thread;		/* thread var */
 
@@ -657,6 +1139,9 @@ any_t mbox_writer(any_t zot) {
 	    }
 	}
 
+	if (exp_trickle)
+	    exp_trickle_kick(newround);	/* expire the next slice */
+
 	/* nudge thread to time out idle connections */
 	pthread_cond_signal(&timeout_wait);
 	
@@ -665,154 +1150,1061 @@ any_t mbox_writer(any_t zot) {
 	    pthread_cond_signal(&q_wait[i]);
 	}
 	
-	mbox_dowrite(TRUE);			/* write all dirty boxes */
+	mbox_dowrite(TRUE);			/* kick writers for all dirty boxes */
     }
 }
 
-/* mbox_dowrite --
+/* mbox_dirty --
 
-    Write out all dirty boxes.  Called from above, plus anywhere else where
-    we need to flush changes (e.g., shutdown).
+    Something in the box (a folder or the prefs) needs writing; put it on
+    its filesystem's dirty queue, if it isn't already.  mbox_fsflush clears
+    "queued" before it seizes the box to write it, so (since we have the box) a
+    box that looks queued is sure to have its changes written.
 
+    --> box locked <--
 */
 
-void mbox_dowrite(boolean_t shouldfree) {
+void mbox_dirty(mbox *mb) {
+
+    fs_writer	*w;
+
+    if (mb->queued || mb->uid < 0)
+	return;
+
+    w = &mbox_fsw[MBOX_WFS(mb)];
+    pthread_mutex_lock(&w->lock);
+    if (!mb->queued) {
+	mb->queued = TRUE;
+	mb->dnext = w->dirtyq;
+	w->dirtyq = mb;
+	if (++w->backlog > w->backlog_hwm)
+	    w->backlog_hwm = w->backlog;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* mbox_unwritten --
+
+    Is there still something in the box that mbox_dowrite should write
+    (including its manifest)?
+
+    --> box locked <--
+*/
+
+static boolean_t mbox_unwritten(mbox *mb) {
+
+    int		foldnum;
+
+    if (mb->prefs && mb->prefs->dirty)
+	return TRUE;
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	if (mb->fold[foldnum].num >= 0 && mb->fold[foldnum].dirty)
+	    return TRUE;
+    }
+    return mb->checked && !mb->manifest;
+}
+
+/* mbox_lrutouch --
+
+    Box has just been attached; note the time, and move it to the
+    recently-used end of the LRU list (adding it if its data had been
+    evicted).  To keep the list lock cold, a box already on the list is
+    only moved if it hasn't been for MB_LRUGRAIN seconds; so the list is
+    in order of lastuse, give or take that much.
+
+    --> box locked <--
+*/
+
+static void mbox_lrutouch(mbox *mb) {
+
+    long	now = time(NULL);
+
+    if (mb->uid == pubml_uid)		/* never evicted */
+	return;
+    if (mb->resident && now - mb->lastuse < MB_LRUGRAIN)
+	return;
+
+    pthread_mutex_lock(&mbox_lrulock);
+    mb->lastuse = now;
+    if (mb->resident) {			/* unlink from where it is */
+	if (mb->lrunext)
+	    mb->lrunext->lruprev = mb->lruprev;
+	else
+	    mbox_lrutail = mb->lruprev;
+	if (mb->lruprev)
+	    mb->lruprev->lrunext = mb->lrunext;
+	else
+	    mbox_lruhead = mb->lrunext;
+    }
+    mb->lrunext = NULL;			/* add at tail */
+    mb->lruprev = mbox_lrutail;
+    if (mbox_lrutail)
+	mbox_lrutail->lrunext = mb;
+    else
+	mbox_lruhead = mb;
+    mbox_lrutail = mb;
+    if (!mb->resident)
+	++mbox_lrucount;
+    mb->resident = TRUE;
+    pthread_mutex_unlock(&mbox_lrulock);
+}
+
+/* mbox_cachesize --
+
+    Roughly how much memory cached box data is taking:  summary buckets
+    and messid indexes (counted exactly), pref and mailing list tables
+    (entries at a typical size).
+*/
+
+long mbox_cachesize() {
+
+    return STAT_GET(malloc_stats.summbuck) * (long) sizeof(summbuck)
+	 + STAT_GET(malloc_stats.messidx)
+	 + STAT_GET(malloc_stats.preftab) * (long) sizeof(pref_tab)
+	 + STAT_GET(malloc_stats.prefentry) * MB_PREFENTSIZE
+	 + STAT_GET(malloc_stats.mltab) * (long) sizeof(ml_tab)
+	 + STAT_GET(malloc_stats.mlentry) * MB_MLENTSIZE;
+}
+
+/* mbox_overbudget --
+
+    Is cached box data taking more than the configured CACHEMAX?
+*/
+
+static boolean_t mbox_overbudget() {
+
+    return m_cachemax > 0 && mbox_cachesize() > m_cachemax;
+}
+
+/* mbox_flush --
+
+    Write out whatever in the box needs it (prefs, folders, manifest).
+    If something's left (write error, or the manifest must wait), put
+    the box back on the dirty queue to try again next time.
+
+    --> box locked <--
+*/
+
+static void mbox_flush(mbox *mb) {
 
-    int		hash;			/* which hash table list */
-    mbox	*mb,*nextmb;		/* one box, and the next */
-    mbox	**boxlist;		/* list of boxes to write */
-    int		boxcount;		/* how many */
     int		foldnum;		/* current folder */
-    long	delay;			/* time consumed */
 
-#define MB_IDLEFREE	5		/* free box structs that are unused this long */
+    if (mb->gone)			/* if box is being moved, don't write to it */
+	return;
 
-    /* lock each row of hash table while we traverse it constructing a consistent
-       list of all boxes.  We _don't_ want to lock the individual boxes
-       while mbox_sem is seized because that introduces a bottleneck
-       (one busy box could cause mbox_sem to be tied up).  Note that
-       it's safe to look at the box without locking if attach == 0. */
-        
-    boxcount = 0;			/* none found yet */
-    boxlist = mallocf((mbox_count + 1) * sizeof(mbox *));
-        
-    for (hash = 0; hash < MBOX_HASHMAX; ++hash) {
+    if (mb->prefs && mb->prefs->dirty) /* write out preferences */
+	pref_write(mb);
 
-	delay = time(NULL);
-	sem_seize(&mbox_sem[hash]);	/* lock hash table row */
-	
-	for (mb = mbox_tab[hash]; mb != NULL; mb = nextmb) {
-	
-            nextmb = mb->next;		/* remember link in case of free */
+    /* write out any modified folder summaries */
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	if (mb->fold[foldnum].num < 0)
+	    continue;	    
+	if (mb->fold[foldnum].dirty)
+	    summ_write(mb, &mb->fold[foldnum]);
+    }
+    summ_manifest(mb);			/* if all written, box is consistent */
+    if (mbox_unwritten(mb))
+	mbox_dirty(mb);
+}
 
-	    ++mb->attach;		/* box may not be freed */
-	    
-	    /* if we're only user of box, free structures if requested
-	       (never free public mailing list data, we'll need it soon anyway) */
-	    if (shouldfree && mb->attach == 1 && mb->uid != pubml_uid) {
-		if (++mb->idle >= MB_IDLEFREE) {	/* not recently used; free */
-		    mb->idle = 0;	/* reset for next time */
-		    if (mb->prefs && !mb->prefs->dirty)	
-			pref_free(mb);	/* free pref hash table */
-			
-		    if (mb->lists)	
-			ml_free(mb); 	/* free mailing list hash table */
-			
-		    /* free summaries for each folder */
-		    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
-			if (mb->fold[foldnum].num < 0)
-			    continue;
-			if (!mb->fold[foldnum].dirty) 
-			    summ_free(mb, &mb->fold[foldnum]);
-		    }
-                    if (mb->gone && !mb->xfering) {	/* vanished box; discard */
-                        mbox_free(mb);
-                        mb = NULL;
-                    }
-		}
+/* mbox_evict --
+
+    Free the cached prefs, lists and (clean) summaries of boxes from the
+    head of the LRU list:  those that haven't been attached for
+    MB_IDLETIME, and then, while we're over the memory budget, the least
+    recently used of the rest.  (When over budget, a box with changes
+    pending is written out first rather than waiting for the writer.)
+    A box that's still attached, or still has changes the writers haven't
+    got to yet, goes back on the tail.  A vanished box
+    is freed altogether.
+
+    Only one thread evicts at a time (see mbox_trim), and boxes are only
+    freed here, so it's safe to look at a box once it's off the list.
+*/
+
+static void mbox_evict() {
+
+    mbox	*mb;
+    int		hash;
+    long	now = time(NULL);
+    long	limit;			/* boxes to look at, at most */
+    boolean_t	over;			/* over budget? */
+    boolean_t	claimed;		/* we're its only user? */
+    boolean_t	evicted;		/* did we free its data? */
+    int		foldnum;
+
+    pthread_mutex_lock(&mbox_lrulock);
+    limit = mbox_lrucount;		/* (each one once) */
+    pthread_mutex_unlock(&mbox_lrulock);
+
+    while (limit-- > 0) {
+	over = mbox_overbudget();
+	pthread_mutex_lock(&mbox_lrulock);
+	mb = mbox_lruhead;
+	if (mb == NULL || (now - mb->lastuse < MB_IDLETIME && !over)) {
+	    pthread_mutex_unlock(&mbox_lrulock);
+	    break;			/* rest are more recent */
+	}
+	mbox_lruhead = mb->lrunext;	/* take it off the list */
+	if (mbox_lruhead)
+	    mbox_lruhead->lruprev = NULL;
+	else
+	    mbox_lrutail = NULL;
+	mb->resident = FALSE;
+	--mbox_lrucount;
+	pthread_mutex_unlock(&mbox_lrulock);
+
+	hash = MBOX_HASH(mb->uid);
+	sem_seize(&mbox_sem[hash]);
+	(void) mbox_hold(mb);
+	sem_release(&mbox_sem[hash]);
+
+	if (over && mb->queued) {	/* can't wait for the writer */
+	    sem_seize(&mb->mbsem);
+	    mbox_flush(mb);
+	    sem_release(&mb->mbsem);
+	}
+
+	sem_seize(&mbox_sem[hash]);
+	evicted = FALSE;
+	claimed = mbox_claim(mb);
+	if (claimed) {			/* if we're only user of box */
+	    evicted = TRUE;		/* (unless something's not written yet) */
+	    if (mb->prefs && !mb->prefs->dirty)	
+		pref_free(mb);		/* free pref hash table */
+	    else if (mb->prefs)
+		evicted = FALSE;
+		
+	    if (mb->lists)	
+		ml_free(mb); 		/* free mailing list hash table */
+		
+	    /* free summaries for each folder */
+	    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+		if (mb->fold[foldnum].num < 0)
+		    continue;
+		if (!mb->fold[foldnum].dirty) 
+		    summ_free(mb, &mb->fold[foldnum]);
+		else
+		    evicted = FALSE;
+	    }
+	    STAT_INC(mb_stats.cache_evict);
+	    if (mb->gone && !mb->xfering && !mb->queued) {	/* vanished box; discard */
+		mbox_free(mb);
+		mb = NULL;
 	    }
-	    if (mb) 
-	        boxlist[boxcount++] = mb;	/* construct list of all boxes */
 	}
-	sem_release(&mbox_sem[hash]);	
-	delay = time(NULL) - delay;
-	if (delay >= 5) {
-	    char logbuf[128];
-	    t_sprintf(logbuf, "mbox_dowrite: mbox_sem[%d] locked for %ld seconds.", hash, delay);
-	    log_it(logbuf);
+	if (mb && claimed)
+	    mbox_unclaim(mb);		/* others may attach again */
+	sem_release(&mbox_sem[hash]);
+
+	if (mb) {
+	    if (!evicted || mb->gone) {	/* in use or dirty; try again later */
+		sem_seize(&mb->mbsem);
+		mbox_lrutouch(mb);
+		sem_release(&mb->mbsem);
+	    }
+	    mbox_done(&mb);		/* release attachment */
 	}
+    }
+}
+
+/* mbox_trim --
+
+    Run mbox_evict, unless some other thread already is.
+*/
+
+static void mbox_trim() {
 
+    pthread_mutex_lock(&mbox_lrulock);
+    if (mbox_evicting) {
+	pthread_mutex_unlock(&mbox_lrulock);
+	return;
     }
-    /* list of boxes has been constructed.  note that we locked 
-       only one row of the hash table at a time, and don't have
-       it locked at all while we write dirty ones out
-       (so we don't hold things up) */    
+    mbox_evicting = TRUE;
+    pthread_mutex_unlock(&mbox_lrulock);
+
+    mbox_evict();
+
+    pthread_mutex_lock(&mbox_lrulock);
+    mbox_evicting = FALSE;
+    pthread_mutex_unlock(&mbox_lrulock);
+}
+
+/* mbox_evictor --
+
+    Thread to evict box data promptly when the cache goes over budget
+    (rather than waiting for the writer's next pass); mbox_done wakes it.
+*/
+
+pthread_addr_t mbox_evictor(pthread_addr_t zot) {
+
+    setup_signals();
     
-    while(--boxcount >= 0) {		/* for each box located above */
-	mb = boxlist[boxcount];
+    for (;;) {
+	pthread_mutex_lock(&mbox_lrulock);
+	while (!mbox_overbudget())
+	    pthread_cond_wait(&mbox_evictwait, &mbox_lrulock);
+	pthread_mutex_unlock(&mbox_lrulock);
+
+	mbox_trim();
+	sleep(1);			/* (don't spin if nothing's evictable) */
+    }
+}
+
+
+/* mbox_fsflush --
+
+    Write out the boxes on one filesystem's dirty queue, keeping track of
+    how long it takes.  flushlock keeps the writer and a shutdown flush
+    from both doing it at once.
+*/
+
+static void mbox_fsflush(int fs) {
+
+    fs_writer	*w = &mbox_fsw[fs];
+    int		hash;			/* which hash table list */
+    mbox	*mb,*nextmb;		/* one box, and the next */
+    mbox	*queue;			/* boxes to write */
+    u_long	start, elapsed;		/* time to write one */
+    u_long	passmax = 0;		/* longest this pass */
+
+    pthread_mutex_lock(&w->flushlock);
+    
+    pthread_mutex_lock(&w->lock);	/* take the whole queue */
+    queue = w->dirtyq;
+    w->dirtyq = NULL;
+    w->backlog = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    for (mb = queue; mb != NULL; mb = nextmb) {
+	nextmb = mb->dnext;
+
+	/* attach it (it can't have been freed:  it's queued) */
+	hash = MBOX_HASH(mb->uid);
+	sem_seize(&mbox_sem[hash]);
+	(void) mbox_hold(mb);
+	sem_release(&mbox_sem[hash]);
+
+	pthread_mutex_lock(&w->lock);
+	mb->queued = FALSE;		/* changes from here on queue it again */
+	pthread_mutex_unlock(&w->lock);
 	
 	sem_seize(&mb->mbsem);
-	if (!mb->gone) {		/* if box is being moved, don't write to it */
-	    if (mb->prefs && mb->prefs->dirty) /* write out preferences */
-		    pref_write(mb);
-    
-	    /* write out any modified folder summaries */
-	    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
-		if (mb->fold[foldnum].num < 0)
-		    continue;	    
-		if (mb->fold[foldnum].dirty)
-		    summ_write(mb, &mb->fold[foldnum]);
-	    }
-	}
+	start = msclock();
+	mbox_flush(mb);
+	elapsed = msclock() - start;
 	sem_release(&mb->mbsem);
 	
 	mbox_done(&mb);		/* release attachment */
+	
+	if (elapsed > passmax)
+	    passmax = elapsed;
+	pthread_mutex_lock(&w->lock);
+	++w->flushed;
+	w->lat_total += elapsed;
+	pthread_mutex_unlock(&w->lock);
     }	
     
-    t_free(boxlist);	        
+    if (queue) {
+	pthread_mutex_lock(&w->lock);
+	w->lat_max = passmax;
+	pthread_mutex_unlock(&w->lock);
+    }
+
+    expidx_flush(fs);			/* and new expiration index entries */
+
+    pthread_mutex_unlock(&w->flushlock);
 }
 
-/* expire --
-  
-    Thread to do expiration check.
-    
-    For each filesystem, read the box directory to locate all mailboxes.
-    For each box, scan all folders for any messages whose expiration
-    date has arrived.  Record the uid & summary of the doomed message in
-    the f_explog file and delete the message.
-    
-    When done, the date we _began_ the check is written to the f_expdate
-    file.  (So we know not to bother to check again for another day.)
+/* mbox_fswriter --
+
+    Writer thread for one filesystem:  each time mbox_dowrite kicks us,
+    write out the filesystem's dirty boxes.
 */
 
-any_t expire(any_t zot) {
+pthread_addr_t mbox_fswriter(pthread_addr_t _fs) {
 
-    t_file		*expdate;		/* recorded expiration date */
-    int			fs;			/* current filesystem */
-    char		logbuf[MAX_STR];
-    pthread_t		thread;
+    int		fs;			/* our filesystem */
+    fs_writer	*w;
+
+    fs = (int) (long) _fs;		/* pick up our arg */
+    w = &mbox_fsw[fs];
     
     setup_signals();
 
+    for (;;) {
+	pthread_mutex_lock(&w->lock);
+	while (!w->kick)
+	    pthread_cond_wait(&w->wait, &w->lock);
+	w->kick = FALSE;
+	pthread_mutex_unlock(&w->lock);
+
+	mbox_fsflush(fs);
+    }
+}
+
+/* mbox_fswstats --
+
+    Copy one filesystem's writer stats (for the status packet & cty).
+*/
+
+void mbox_fswstats(int fs, fsw_stats_t *s) {
+
+    fs_writer	*w = &mbox_fsw[fs];
+
+    if (fs >= m_filesys_count) {	/* not in use */
+	bzero((char *) s, sizeof(*s));
+	return;
+    }
+    pthread_mutex_lock(&w->lock);
+    s->backlog = w->backlog;
+    s->backlog_hwm = w->backlog_hwm;
+    s->flushed = w->flushed;
+    s->lat_total = w->lat_total;
+    s->lat_max = w->lat_max;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* mbox_dowrite --
+
+    Write out all dirty boxes (those on the dirty queues).  Called from
+    above, plus anywhere else where we need to flush changes (e.g.,
+    shutdown).  Any box that's entirely on disk gets a manifest (see
+    summ_manifest), so it needn't be fully checked next time it's
+    attached.
+
+    The writer thread (shouldfree) just kicks each filesystem's writer,
+    so one slow disk doesn't hold up the rest; it also evicts idle boxes.
+    Otherwise, the queues are written before we return.
+*/
+
+void mbox_dowrite(boolean_t shouldfree) {
+
+    int		fs;
+
+    if (shouldfree) {			/* (only the writer thread does this) */
+	mbox_reap();			/* free what's in limbo */
+	mbox_grow();			/* keep the chains short */
+    }
+
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	if (shouldfree) {
+	    pthread_mutex_lock(&mbox_fsw[fs].lock);
+	    mbox_fsw[fs].kick = TRUE;
+	    pthread_cond_signal(&mbox_fsw[fs].wait);
+	    pthread_mutex_unlock(&mbox_fsw[fs].lock);
+	} else
+	    mbox_fsflush(fs);		/* do it ourselves, now */
+    }
+
+    if (shouldfree)
+	mbox_trim();			/* free data of idle boxes */
+}
+
+/* The expiration index:  for each filesystem, a file per day in EXPIDX_DIR
+   (named by day number; see EXP_DAYSECS) listing the uid, folder & messid
+   of each summary due to expire that day.  New entries are buffered here
+   and appended by the filesystem's writer; expire then visits just the
+   boxes (and folders) listed for the days that have come due.  Entries go
+   stale when messages are deleted or moved; that costs a wasted look at
+   the box, nothing more.  The EXPIDX_CLEAN file says the buffered entries
+   made it to disk at shutdown; without it, the next pass sweeps every box
+   to rebuild the index. */
+
+#define EXPIDX_CLEAN	".clean"	/* index is complete (clean shutdown) */
+#define EXPIDX_MINPEND	256		/* initial size of pending list */
+
+typedef struct expent {
+	u_long		day;		/* day it expires */
+	long		uid;		/* box */
+	int		foldnum;	/* folder */
+	long		messid;		/* message */
+} expent;
+
+static struct exp_index {
+	pthread_mutex_t	lock;		/* protects pending list */
+	pthread_mutex_t	filelock;	/* held while day files change; protects rebuild */
+	expent		*pend;		/* entries not yet on disk */
+	long		npend;		/* how many */
+	long		maxpend;	/* room for */
+	boolean_t	rebuild;	/* index incomplete; next pass must sweep */
+} expidx[FILESYS_MAX];
+
+/* expidx_open --
+
+    Set up a filesystem's expiration index at startup.  If the last
+    shutdown left it clean, remove the marker (until the next clean
+    shutdown); otherwise arrange for the next pass to rebuild it.
+*/
+
+static void expidx_open(int fs) {
+
+    char	fname[FILENAME_MAX];
+
+    pthread_mutex_init(&expidx[fs].lock, pthread_mutexattr_default);
+    pthread_mutex_init(&expidx[fs].filelock, pthread_mutexattr_default);
+    expidx[fs].pend = NULL;
+    expidx[fs].npend = expidx[fs].maxpend = 0;
+
+    t_sprintf(fname, "%s%s%s", m_filesys[fs], EXPIDX_DIR, EXPIDX_CLEAN);
+    expidx[fs].rebuild = unlink(fname) < 0;
+}
+
+/* expidx_add --
+
+    Note that a summary is due to expire (it's been added to a folder,
+    or its expiration date changed).
+
+    --> box locked <--
+*/
+
+void expidx_add(mbox *mb, int foldnum, summinfo *summ) {
+
+    struct exp_index	*x;
+    expent		*e;
+
+    if (mb->fs < 0 || mb->fs >= m_filesys_count || summ->expire == 0)
+	return;
+    x = &expidx[mb->fs];
+
+    pthread_mutex_lock(&x->lock);
+    if (x->npend == x->maxpend) {	/* need more room? */
+	x->maxpend = x->maxpend ? 2 * x->maxpend : EXPIDX_MINPEND;
+	if (x->pend)
+	    x->pend = (expent *) reallocf(x->pend, x->maxpend * sizeof(expent));
+	else
+	    x->pend = (expent *) mallocf(x->maxpend * sizeof(expent));
+    }
+    e = &x->pend[x->npend++];
+    e->day = summ->expire / EXP_DAYSECS;
+    e->uid = mb->uid;
+    e->foldnum = foldnum;
+    e->messid = summ->messid;
+    pthread_mutex_unlock(&x->lock);
+}
+
+/* expent_daycmp, expent_uidcmp --
+
+    qsort comparisons:  by day (to group entries by file), and by uid and
+    folder (to group a day's entries by box).
+*/
+
+static int expent_daycmp(const void *a, const void *b) {
+
+    u_long	da = ((expent *) a)->day, db = ((expent *) b)->day;
+
+    return da < db ? -1 : da > db;
+}
+
+static int expent_uidcmp(const void *a, const void *b) {
+
+    expent	*ea = (expent *) a, *eb = (expent *) b;
+
+    if (ea->uid != eb->uid)
+	return ea->uid < eb->uid ? -1 : 1;
+    return ea->foldnum - eb->foldnum;
+}
+
+/* expidx_flush --
+
+    Append a filesystem's pending index entries to their day files.  If
+    a file can't be written, the index is no longer complete; have the
+    next pass rebuild it.
+*/
+
+static void expidx_flush(int fs) {
+
+    struct exp_index	*x = &expidx[fs];
+    expent		*pend;		/* entries to write */
+    long		npend;		/* how many */
+    long		i, j;
+    char		fname[FILENAME_MAX];
+    t_file		*f;		/* one day file */
+
+    pthread_mutex_lock(&x->filelock);
+
+    pthread_mutex_lock(&x->lock);	/* take the whole list */
+    pend = x->pend;
+    npend = x->npend;
+    x->pend = NULL;
+    x->npend = x->maxpend = 0;
+    pthread_mutex_unlock(&x->lock);
+
+    if (npend > 0) {
+	qsort((char *) pend, npend, sizeof(expent), expent_daycmp);
+	for (i = 0; i < npend; i = j) {
+	    t_sprintf(fname, "%s%s%lu", m_filesys[fs], EXPIDX_DIR, pend[i].day);
+	    if ((f = t_fopen(fname, O_APPEND | O_CREAT | O_WRONLY, FILE_ACC)) == NULL) {
+		t_perror1("expidx_flush: cannot open ", fname);
+		x->rebuild = TRUE;
+	    }
+	    for (j = i; j < npend && pend[j].day == pend[i].day; ++j) {
+		if (f)
+		    t_fprintf(f, "%ld %d %ld\n", pend[j].uid, pend[j].foldnum, pend[j].messid);
+	    }
+	    if (f)
+		t_fclose(f);
+	}
+    }
+    if (pend)
+	t_free(pend);
+
+    pthread_mutex_unlock(&x->filelock);
+}
+
+/* expidx_shutdown --
+
+    Server is exiting, and mbox_dowrite has flushed every filesystem's
+    index; mark them complete.
+*/
+
+void expidx_shutdown() {
+
+    int		fs;
+    char	fname[FILENAME_MAX];
+    t_file	*f;
+
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	pthread_mutex_lock(&expidx[fs].filelock);
+	if (!expidx[fs].rebuild) {
+	    t_sprintf(fname, "%s%s%s", m_filesys[fs], EXPIDX_DIR, EXPIDX_CLEAN);
+	    if ((f = t_fopen(fname, O_TRUNC | O_CREAT | O_WRONLY, FILE_ACC)) == NULL)
+		t_perror1("expidx_shutdown: cannot create ", fname);
+	    else
+		t_fclose(f);
+	}
+	pthread_mutex_unlock(&expidx[fs].filelock);
+    }
+}
+
+/* expidx_due --
+
+    Collect a filesystem's index entries for every day up to "today",
+    sorted by uid & folder.  Returns the count (and the list via "list";
+    caller frees it).
+
+    Each day file is first renamed to "<day>.<stamp>", so entries added
+    from here on (including those expire1 puts back) start a new file.
+    The renamed files are removed by expidx_done once the pass is over;
+    any left by a pass that didn't finish are picked up again here.
+*/
+
+static long expidx_due(int fs, u_long today, expent **list) {
+
+    char		dname[FILENAME_MAX];	/* index directory */
+    char		fname[FILENAME_MAX];	/* one day file */
+    char		newname[FILENAME_MAX];	/* its work name */
+    char		buf[MAX_STR];		/* one entry */
+    DIR			*dir;
+    struct direct	*dirp;
+    char		*p;
+    long		day;
+    long		n = 0, max = 0;		/* entries so far; room */
+    expent		e;
+    expent		*ents = NULL;
+    t_file		*f;
+    u_long		stamp = mactime();
+
+    t_sprintf(dname, "%s%s", m_filesys[fs], EXPIDX_DIR);
+    pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
+    dir = opendir(dname);
+    pthread_mutex_unlock(&dir_lock);
+    if (dir == NULL) {
+	t_perror1("expire: cannot open ", dname);
+	*list = NULL;
+	return 0;
+    }
+
+    while ((dirp = readdir(dir)) != NULL) {
+	if (dirp->d_name[0] == '.')
+	    continue;
+	p = strtonum(dirp->d_name, &day);
+	if ((*p != 0 && *p != '.') || (u_long) day > today / EXP_DAYSECS)
+	    continue;			/* not a day file, or not due */
+
+	t_sprintf(fname, "%s%s", dname, dirp->d_name);
+	if (*p == 0) {			/* claim it */
+	    t_sprintf(newname, "%s%ld.%lu", dname, day, stamp);
+	    pthread_mutex_lock(&expidx[fs].filelock);
+	    if (rename(fname, newname) < 0) {
+		t_perror1("expire: cannot rename ", fname);
+		pthread_mutex_unlock(&expidx[fs].filelock);
+		continue;
+	    }
+	    pthread_mutex_unlock(&expidx[fs].filelock);
+	    strcpy(fname, newname);
+	}
+
+	if ((f = t_fopen(fname, O_RDONLY, 0)) == NULL) {
+	    t_perror1("expire: cannot open ", fname);
+	    continue;
+	}
+	while (t_gets(buf, sizeof(buf), f)) {
+	    p = strtonum(buf, &e.uid);
+	    if (*p++ != ' ')
+		continue;
+	    p = strtonum(p, &day);
+	    e.foldnum = day;
+	    if (*p++ != ' ' || e.foldnum < 0 || e.foldnum >= FOLD_MAX)
+		continue;		/* (partial line) */
+	    (void) strtonum(p, &e.messid);
+	    e.day = 0;
+	    if (n == max) {
+		max = max ? 2 * max : EXPIDX_MINPEND;
+		if (ents)
+		    ents = (expent *) reallocf(ents, max * sizeof(expent));
+		else
+		    ents = (expent *) mallocf(max * sizeof(expent));
+	    }
+	    ents[n++] = e;
+	}
+	t_fclose(f);
+    }
+    closedir(dir);
+
+    if (n > 0)
+	qsort((char *) ents, n, sizeof(expent), expent_uidcmp);
+    *list = ents;
+    return n;
+}
+
+/* expidx_done --
+
+    The pass is over; remove the day files expidx_due claimed.
+*/
+
+static void expidx_done(int fs, u_long today) {
+
+    char		dname[FILENAME_MAX];	/* index directory */
+    char		fname[FILENAME_MAX];	/* one day file */
+    DIR			*dir;
+    struct direct	*dirp;
+    char		*p;
+    long		day;
+
+    t_sprintf(dname, "%s%s", m_filesys[fs], EXPIDX_DIR);
+    pthread_mutex_lock(&dir_lock);
+    dir = opendir(dname);
+    pthread_mutex_unlock(&dir_lock);
+    if (dir == NULL)
+	return;
+
+    while ((dirp = readdir(dir)) != NULL) {
+	p = strtonum(dirp->d_name, &day);
+	if (dirp->d_name[0] != '.' && *p == '.' && (u_long) day <= today / EXP_DAYSECS) {
+	    t_sprintf(fname, "%s%s", dname, dirp->d_name);
+	    if (unlink(fname) < 0)
+		t_perror1("expire: cannot remove ", fname);
+	}
+    }
+    closedir(dir);
+}
+
+/* The expiration worker pools:  each filesystem's expirefs hands its list
+   of boxes to a pool of workers (see expworker).  Each worker starts with
+   an equal share of the list; one that runs out takes half of what's left
+   of the biggest remaining share.  Together they're held to exp_iorate
+   I/O ops per second. */
+
+typedef struct expbox {
+	long		uid;		/* box to check */
+	long		first;		/* its due entries (folders to check) */
+	long		count;		/* how many (0 = check all folders) */
+} expbox;
+
+static struct exp_pool {
+	pthread_mutex_t	lock;		/* protects remaining fields */
+	pthread_cond_t	wait;		/* expirefs waits here for workers */
+	boolean_t	active;		/* pass in progress? */
+	expbox		*work;		/* boxes to check */
+	long		nwork;		/* how many */
+	long		maxwork;	/* room for */
+	expent		*due;		/* index entries come due */
+	u_long		reidx;		/* (see expire1) */
+	long		next[EXP_WORKERMAX];	/* next box in each share */
+	long		end[EXP_WORKERMAX];	/* end of each share */
+	int		workers;	/* workers started */
+	int		running;	/* and not finished */
+	long		done;		/* boxes checked */
+	long		ops;		/* I/O ops done */
+	u_long		start;		/* msclock when started */
+	long		bops;		/* I/O ops since bstart */
+	u_long		bstart;		/* start of budget period */
+} exp_pool[FILESYS_MAX];
+
+/* Boxes a trickle round didn't get to, carried into the next one. */
+typedef struct expleft {
+	expbox		*work;		/* boxes (first indexes due) */
+	long		nwork;
+	expent		*due;		/* their index entries */
+	long		ndue;
+} expleft;
+
+static expbox *exp_growwork(expbox *work, long *max);
+static void exp_leftmerge(expleft *left, expbox **work, long *nwork, expent **due, long *ndue);
+static void exp_leftfree(expleft *left);
+
+/* exp_poolinit --
+
+    Set up a filesystem's (idle) worker pool.
+*/
+
+static void exp_poolinit(int fs) {
+
+    bzero((char *) &exp_pool[fs], sizeof(exp_pool[fs]));
+    pthread_mutex_init(&exp_pool[fs].lock, pthread_mutexattr_default);
+    pthread_cond_init(&exp_pool[fs].wait, pthread_condattr_default);
+}
+
+/* exp_take --
+
+    Pick the next box for worker "me" to check; -1 if they're all taken.
+*/
+
+static long exp_take(struct exp_pool *pool, int me) {
+
+    long	b = -1;			/* box to do */
+    long	left, most = 0;		/* boxes left in a share; most seen */
+    int		i, victim = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->next[me] >= pool->end[me]) {	/* ours are gone; steal */
+	for (i = 0; i < pool->workers; ++i) {
+	    if ((left = pool->end[i] - pool->next[i]) > most) {
+		most = left;
+		victim = i;
+	    }
+	}
+	if (victim >= 0) {		/* take back half */
+	    pool->next[me] = pool->next[victim] + most / 2;
+	    pool->end[me] = pool->end[victim];
+	    pool->end[victim] = pool->next[me];
+	}
+    }
+    if (pool->next[me] < pool->end[me])
+	b = pool->next[me]++;
+    pthread_mutex_unlock(&pool->lock);
+
+    return b;
+}
+
+/* exp_throttle --
+
+    A worker has done "ops" more I/O ops (and checked a box, if "checked").
+    Count them, and if the pool is ahead of its I/O budget, sleep until
+    it's back within it.
+*/
+
+static void exp_throttle(struct exp_pool *pool, long ops, boolean_t checked) {
+
+    long	ahead = 0;		/* seconds ahead of budget */
+
+    pthread_mutex_lock(&pool->lock);
+    pool->ops += ops;
+    pool->bops += ops;
+    if (checked)
+	++pool->done;
+    if (exp_iorate > 0)
+	ahead = pool->bops / exp_iorate - (long) ((msclock() - pool->bstart) / 1000);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (ahead > 0)
+	sleep(ahead);
+}
+
+/* explog_put --
+
+    Add a line to a worker's log buffer.  When the buffer is full, append
+    it to the log file:  the shared file is locked once a buffer, rather
+    than once a line, and each worker's lines stay together.
+*/
+
+void explog_put(explogbuf *b, char *line) {
+
+    long	len = strlen(line);
+
+    if (b->file == NULL)
+	return;
+    if (b->len + len > b->max) {
+	explog_flush(b);
+	if (len > b->max) {		/* (first time) */
+	    b->max = len > EXPLOG_BUFLEN ? len : EXPLOG_BUFLEN;
+	    if (b->buf)
+		t_free(b->buf);
+	    b->buf = mallocf(b->max);
+	}
+    }
+    bcopy(line, b->buf + b->len, len);
+    b->len += len;
+}
+
+/* explog_flush --
+
+    Append what's in a worker's log buffer to its file.
+*/
+
+static void explog_flush(explogbuf *b) {
+
+    if (b->len > 0) {
+	pthread_mutex_lock(&exp.lock);
+	(void) t_fwrite(b->file, b->buf, b->len);
+	pthread_mutex_unlock(&exp.lock);
+	b->len = 0;
+    }
+}
+
+/* exp_checkbox --
+
+    Check box "b" of a filesystem's work list, then count the I/O it took
+    against the pool's budget.  If expire1 passed it up because its owner
+    is signed on (trickle), put it back at the end of the list.
+*/
+
+static void exp_checkbox(struct exp_pool *pool, expwork *w, long b) {
+
+    expbox	box;			/* (copy; list may move) */
+    long	ops = w->ops;		/* I/O before this box */
+    long	i;
+    char	folds[FOLD_MAX];	/* folders to check in it */
+    boolean_t	checked;
+
+    box = pool->work[b];
+    if (box.count > 0) {		/* just the folders with something due */
+	bzero(folds, sizeof(folds));
+	for (i = box.first; i < box.first + box.count; ++i)
+	    folds[pool->due[i].foldnum] = TRUE;
+	checked = expire1(box.uid, w, folds, pool->reidx);
+    } else
+	checked = expire1(box.uid, w, NULL, pool->reidx);
+
+    if (!checked) {			/* (only with a single worker) */
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nwork == pool->maxwork)
+	    pool->work = exp_growwork(pool->work, &pool->maxwork);
+	pool->work[pool->nwork++] = box;
+	pool->end[0] = pool->nwork;
+	pthread_mutex_unlock(&pool->lock);
+    }
+    exp_throttle(pool, w->ops - ops, checked);
+}
+
+/* exp_workstart, exp_workdone --
+
+    Set up a worker's state for a filesystem; when it's through, write out
+    its logs and add its count to the total.
+*/
+
+static void exp_workstart(expwork *w, int fs) {
+
+    bzero((char *) w, sizeof(*w));
+    w->fs = fs;
+    w->today = exp.today;
+    w->explog.file = exp.explog;
+    w->stolog.file = exp.stolog;
+}
+
+static void exp_workdone(expwork *w) {
+
+    explog_flush(&w->explog);
+    explog_flush(&w->stolog);
+    if (w->explog.buf)
+	t_free(w->explog.buf);
+    if (w->stolog.buf)
+	t_free(w->stolog.buf);
+
+    pthread_mutex_lock(&exp.lock);
+    exp.total += w->total;
+    pthread_mutex_unlock(&exp.lock);
+}
+
+/* expworker --
+
+    One of a filesystem's expiration workers:  check boxes from the pool
+    until there are none left, then write out our logs and add our counts
+    to the totals.
+*/
+
+static any_t expworker(any_t _arg) {
+
+    int			fs;		/* our filesystem */
+    int			me;		/* which worker we are */
+    struct exp_pool	*pool;
+    expwork		w;		/* our state */
+    long		b;		/* box being checked */
+    long		arg = (long) _arg;
+
+    fs = arg / EXP_WORKERMAX;		/* pick up our arg */
+    me = arg % EXP_WORKERMAX;
+    pool = &exp_pool[fs];
+
+    setup_signals();
+
+    exp_workstart(&w, fs);
+    while ((b = exp_take(pool, me)) >= 0)
+	exp_checkbox(pool, &w, b);
+    exp_workdone(&w);
+
+    pthread_mutex_lock(&pool->lock);
+    --pool->running;			/* this worker is done */
+    pthread_cond_signal(&pool->wait);	/* wake up expirefs */
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* exp_progress --
+
+    How far along is a filesystem's expiration pass?  Returns FALSE if
+    there's none in progress.
+*/
+
+boolean_t exp_progress(int fs, long *done, long *todo, long *ops, int *workers, u_long *elapsed) {
+
+    struct exp_pool	*pool = &exp_pool[fs];
+    boolean_t		active;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((active = pool->active)) {
+	*done = pool->done;
+	*todo = pool->nwork;
+	*ops = pool->ops;
+	*workers = pool->running;
+	*elapsed = msclock() - pool->start;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return active;
+}
+
+/* exp_begin --
+
+    Start an expiration check (a single pass, or a day's trickle round):
+    note the date and open the log files.  Returns FALSE if a check is
+    already in progress, or the log can't be opened.
+*/
+
+static boolean_t exp_begin() {
+
     pthread_mutex_lock(&exp.lock);
     if (exp.expiring) {
 	t_errprint("Expiration check already in progress; not starting another.");
 	pthread_mutex_unlock(&exp.lock);
-	return 0;
+	return FALSE;
     }
     log_it("Beginning expiration check");
     t_errprint("Beginning expiration check");
     
-    exp.expiring = TRUE;
     exp.threads = 0;
     exp.total = 0;
+    exp.boxes = 0;
     exp.stolog = exp.explog = NULL;
     exp.today = add_days(0);
     
     /* get log file */
     if ((exp.explog = t_fopen(f_explog, O_APPEND | O_CREAT | O_WRONLY, FILE_ACC)) == NULL) {
 	t_perror1("Expire: cannot open ", f_explog);
-	goto done;
+	pthread_mutex_unlock(&exp.lock);
+	return FALSE;
     }
     
     /* optional file to record everyone's storage usage */
@@ -821,90 +2213,276 @@ any_t expire(any_t zot) {
 	    t_perror1("Expire: cannot open ", f_stolog);
     }
 
+    exp.expiring = TRUE;
+    pthread_mutex_unlock(&exp.lock);
+    return TRUE;
+}
 
-    for (fs = 0; fs < m_filesys_count; ++fs) { /* start thread for each filesystem */
-	if (pthread_create(&thread, generic_attr,
-			(pthread_startroutine_t) expirefs, (pthread_addr_t) fs) < 0) {
-	    t_perror("expire: pthread_create");
-	} else {
-	    pthread_detach(&thread);
-	    ++exp.threads;			/* count active threads */
-	}
-    }
-    
-    while (exp.threads > 0) {		/* wait for everyone to finish */
-    	pthread_cond_wait(&exp.wait, &exp.lock);
-    }
+/* exp_end --
+
+    Every filesystem has been checked.  Close the logs, and write the date
+    we _began_ the check to the f_expdate file.
+*/
+
+static void exp_end() {
+
+    t_file		*expdate;		/* recorded expiration date */
+    char		logbuf[MAX_STR];
+
+    pthread_mutex_lock(&exp.lock);
 
     t_fclose(exp.explog);
     if (exp.stolog)
 	t_fclose(exp.stolog);
+    exp.stolog = exp.explog = NULL;
     
-    if ((expdate = t_fopen(f_expdate, O_TRUNC | O_CREAT | O_WRONLY, FILE_ACC)) == NULL) {
+    if ((expdate = t_fopen(f_expdate, O_TRUNC | O_CREAT | O_WRONLY, FILE_ACC)) == NULL)
 	t_perror1("Expire: cannot open ", f_expdate);
-	goto done;
+    else {
+	t_fprintf(expdate, "%lu\n", exp.today);	/* record exp date */
+	t_fclose(expdate);
     }
-    
-    t_fprintf(expdate, "%lu\n", exp.today);	/* record exp date */
-    t_fclose(expdate);
     	
-    t_sprintf(logbuf, "Expiration completed; %ld expired messages removed.", exp.total);
+    t_sprintf(logbuf, "Expiration completed; %ld expired messages removed from %ld boxes checked.",
+    	      exp.total, exp.boxes);
     log_it(logbuf);
     t_errprint(logbuf);
     	
-done:
     exp.expiring = FALSE;
     pthread_mutex_unlock(&exp.lock);
-    return 0;
 }
 
-/* expirefs --
+/* expire --
   
-    Thread to do expiration check on one filesystem.
+    Thread to do expiration check.
+    
+    For each filesystem, check the mailboxes the expiration index says
+    have messages whose expiration date has arrived (see expirefs).
+    Record the uid & summary of the doomed message in the f_explog file
+    and delete the message.
     
-    For this filesystem, read the box directory to locate all mailboxes.
-    For each box, scan all folders for any messages whose expiration
-    date has arrived.  Record the uid & summary of the doomed message in
-    the f_explog file and delete the message.
+    When done, the date we _began_ the check is written to the f_expdate
+    file.  (So we know not to bother to check again for another day.)
 */
 
-static any_t expirefs(any_t _fs) {
+any_t expire(any_t zot) {
 
-    int			fs;			/* our filesystem */
+    int			fs;			/* current filesystem */
+    pthread_t		thread;
+    
+    setup_signals();
+
+    if (!exp_begin())
+	return 0;
+
+    pthread_mutex_lock(&exp.lock);
+    for (fs = 0; fs < m_filesys_count; ++fs) { /* start thread for each filesystem */
+	if (pthread_create(&thread, generic_attr,
+			(pthread_startroutine_t) expirefs, (pthread_addr_t) (long) fs) < 0) {
+	    t_perror("expire: pthread_create");
+	} else {
+	    pthread_detach(&thread);
+	    ++exp.threads;			/* count active threads */
+	}
+    }
+    
+    while (exp.threads > 0) {		/* wait for everyone to finish */
+    	pthread_cond_wait(&exp.wait, &exp.lock);
+    }
+    pthread_mutex_unlock(&exp.lock);
+
+    exp_end();
+    return 0;
+}
+
+/* exp_poolfill --
+
+    Make the list of boxes to check on a filesystem, and give it to the
+    filesystem's pool, divided among "workers" workers.
+
+    Normally, only the boxes (and folders) that the expiration index lists
+    for the days that have come due are checked.  If the index has to be
+    rebuilt, or a storage report (which wants every box) was asked for,
+    read the box directory and check every box instead.  Returns FALSE if
+    that can't be done (the index entries are left for next time).
+
+    Boxes left over from an unfinished round ("left", if any) go at the
+    front of the list; we free them.
+*/
+
+static boolean_t exp_poolfill(int fs, int workers, expleft *left) {
+
+    struct exp_pool	*pool = &exp_pool[fs];
     char		fname[MBOX_NAMELEN];	/* name of box dir on that fs */
     DIR			*boxdir;		/* open directory file */
     struct direct 	*dirp;			/* directory entry */
     long		uid;			/* one box */
     char		*end;			/* end of uid str */
+    expent		*due;			/* index entries come due */
+    long		ndue;			/* how many */
+    expbox		*work = NULL;		/* boxes to check */
+    long		nwork = 0, maxwork = 0;	/* how many; room for */
+    long		i, j;
+    boolean_t		rebuild;		/* index incomplete? */
+    u_long		reidx;			/* (see expire1) */
+
+    pthread_mutex_lock(&expidx[fs].filelock);
+    rebuild = expidx[fs].rebuild;
+    expidx[fs].rebuild = FALSE;		/* (the sweep puts everything back) */
+    pthread_mutex_unlock(&expidx[fs].filelock);
+
+    ndue = expidx_due(fs, exp.today, &due);
+
+    if (rebuild || exp.stolog) {
+	/* open box directory */
+	t_sprintf(fname, "%s%s", m_filesys[fs], BOX_DIR);
+	pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
+	boxdir = opendir(fname);
+	pthread_mutex_unlock(&dir_lock);
+    
+	if (boxdir == NULL) {
+	    t_perror1("expire: cannot open ", fname);
+	    if (rebuild) {		/* still to be done */
+		pthread_mutex_lock(&expidx[fs].filelock);
+		expidx[fs].rebuild = TRUE;
+		pthread_mutex_unlock(&expidx[fs].filelock);
+	    }
+	    if (due) t_free(due);
+	    exp_leftfree(left);
+	    return FALSE;
+	} 
 
-    fs = (int) _fs;				/* pick up our arg */
-    
-    setup_signals();
+	while ((dirp = readdir(boxdir)) != NULL) {	/* read entire directory */
+	
+	    /* skip dot-files */
+	    if (dirp->d_name[0] != '.') {
+		end = strtonum(dirp->d_name, &uid);
+		if (*end == 0) {	/* ignore non-numeric filenames */
+		    if (nwork == maxwork)
+			work = exp_growwork(work, &maxwork);
+		    work[nwork].uid = uid;
+		    work[nwork].first = work[nwork].count = 0;
+		    ++nwork;
+		}
+	    }
+	}
+	closedir(boxdir);
+	reidx = rebuild ? EXPIDX_ALL : exp.today / EXP_DAYSECS;
+	exp_leftfree(left);		/* (they're on the list anyway) */
+    } else {
+	/* each box with entries due; check just the listed folders */
+	for (i = 0; i < ndue; i = j) {
+	    for (j = i; j < ndue && due[j].uid == due[i].uid; ++j)
+		;
+	    if (nwork == maxwork)
+		work = exp_growwork(work, &maxwork);
+	    work[nwork].uid = due[i].uid;
+	    work[nwork].first = i;
+	    work[nwork].count = j - i;
+	    ++nwork;
+	}
+	reidx = exp.today / EXP_DAYSECS;
+	if (left && left->nwork > 0) {
+	    exp_leftmerge(left, &work, &nwork, &due, &ndue);
+	    maxwork = nwork;
+	}
+	exp_leftfree(left);
+    }
 
-    /* open box directory */
+    /* divide the boxes among the workers */
+    if (workers > nwork)
+	workers = nwork;
+    pthread_mutex_lock(&pool->lock);
+    pool->work = work;
+    pool->nwork = nwork;
+    pool->maxwork = maxwork;
+    pool->due = due;
+    pool->reidx = reidx;
+    for (i = 0; i < EXP_WORKERMAX; ++i)
+	pool->next[i] = pool->end[i] = 0;
+    for (i = 0; i < workers; ++i) {
+	pool->next[i] = nwork * i / workers;
+	pool->end[i] = nwork * (i + 1) / workers;
+    }
+    pool->workers = pool->running = workers;
+    pool->done = pool->ops = pool->bops = 0;
+    pool->start = pool->bstart = msclock();
+    pool->active = TRUE;
+    pthread_mutex_unlock(&pool->lock);
 
-    t_sprintf(fname, "%s%s", m_filesys[fs], BOX_DIR);
-    pthread_mutex_lock(&dir_lock);	/* in case opendir isn't thread-safe */
-    boxdir = opendir(fname);
-    pthread_mutex_unlock(&dir_lock);
+    return TRUE;
+}
+
+/* exp_pooldone --
+
+    All the boxes on a filesystem's list have been checked (or the rest
+    taken by exp_leftover); remove the index entries that listed them, and
+    free the list.
+*/
+
+static void exp_pooldone(int fs) {
+
+    struct exp_pool	*pool = &exp_pool[fs];
+    long		nwork;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->active = FALSE;
+    nwork = pool->done;			/* (all of them, unless abandoned) */
+    if (pool->work)
+	t_free(pool->work);
+    if (pool->due)
+	t_free(pool->due);
+    pool->work = NULL;
+    pool->due = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    expidx_done(fs, exp.today);		/* entries are all taken care of */
+
+    pthread_mutex_lock(&exp.lock);
+    exp.boxes += nwork;
+    pthread_mutex_unlock(&exp.lock);
+}
+
+/* expirefs --
+  
+    Thread to do expiration check on one filesystem:  list the boxes to
+    check (see exp_poolfill), and divide them among a pool of exp_workers
+    workers (we're one of them); see expworker.
+*/
+
+static any_t expirefs(any_t _fs) {
+
+    int			fs;			/* our filesystem */
+    struct exp_pool	*pool;			/* its workers */
+    int			i;
+    pthread_t		thread;
+
+    fs = (int) (long) _fs;			/* pick up our arg */
+    pool = &exp_pool[fs];
     
-    if (boxdir == NULL) {
-	t_perror1("expire: cannot open ", fname);
-	goto done;
-    } 
+    setup_signals();
 
-    while ((dirp = readdir(boxdir)) != NULL) {	/* read entire directory */
-	
-	/* skip dot-files */
-	if (dirp->d_name[0] != '.') {
-	    end = strtonum(dirp->d_name, &uid);
-	    if (*end == 0)	/* ignore non-numeric filenames */
-		expire1(uid, fs, exp.today);	
+    if (exp_poolfill(fs, exp_workers, NULL)) {
+	for (i = 1; i < pool->workers; ++i) {	/* start the others */
+	    if (pthread_create(&thread, generic_attr,
+			    (pthread_startroutine_t) expworker, (pthread_addr_t) (long) (fs * EXP_WORKERMAX + i)) < 0) {
+		t_perror("expirefs: pthread_create");
+		pthread_mutex_lock(&pool->lock);
+		--pool->running;	/* (its share will be stolen) */
+		pthread_mutex_unlock(&pool->lock);
+	    } else
+		pthread_detach(&thread);
 	}
-    }
+	if (pool->workers > 0)
+	    (void) expworker((any_t) (long) (fs * EXP_WORKERMAX));	/* and be one ourselves */
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running > 0)	/* wait for everyone to finish */
+	    pthread_cond_wait(&pool->wait, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
 
-done:
-    if (boxdir) closedir(boxdir);
+	exp_pooldone(fs);
+    }
 
     pthread_mutex_lock(&exp.lock);
     --exp.threads;			/* this thread is done */
@@ -913,3 +2491,368 @@ done:
 
     return 0;
 }
+
+/* exp_growwork --
+
+    Make room for more boxes in expirefs's work list.
+*/
+
+static expbox *exp_growwork(expbox *work, long *max) {
+
+    *max = *max ? 2 * *max : EXPIDX_MINPEND;
+    if (work)
+	return (expbox *) reallocf(work, *max * sizeof(expbox));
+    return (expbox *) mallocf(*max * sizeof(expbox));
+}
+
+/* exp_leftover --
+
+    A new round is starting before this filesystem's last one is done:
+    take the boxes nobody has got to yet (and their index entries) off the
+    pool's list, to be carried into the new round.  If the old round was
+    rebuilding the index, the new one must sweep again instead.
+*/
+
+static void exp_leftover(int fs, expleft *left) {
+
+    struct exp_pool	*pool = &exp_pool[fs];
+    long		i, b;
+    boolean_t		rebuild = FALSE;	/* sweep was cut short? */
+
+    left->work = NULL;
+    left->due = NULL;
+    left->nwork = left->ndue = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->active) {
+	for (i = 0; i < pool->workers; ++i) {	/* count what's left */
+	    for (b = pool->next[i]; b < pool->end[i]; ++b) {
+		++left->nwork;
+		left->ndue += pool->work[b].count;
+	    }
+	}
+	if (left->nwork > 0 && pool->reidx == EXPIDX_ALL) {
+	    rebuild = TRUE;
+	    left->nwork = left->ndue = 0;
+	}
+	if (left->nwork > 0)
+	    left->work = (expbox *) mallocf(left->nwork * sizeof(expbox));
+	if (left->ndue > 0)
+	    left->due = (expent *) mallocf(left->ndue * sizeof(expent));
+	left->nwork = left->ndue = 0;
+	for (i = 0; i < pool->workers; ++i) {
+	    for (b = pool->next[i]; b < pool->end[i] && left->work; ++b) {
+		left->work[left->nwork] = pool->work[b];
+		left->work[left->nwork].first = left->ndue;
+		if (pool->work[b].count > 0)
+		    bcopy((char *) &pool->due[pool->work[b].first],
+			  (char *) &left->due[left->ndue],
+			  pool->work[b].count * sizeof(expent));
+		left->ndue += pool->work[b].count;
+		++left->nwork;
+	    }
+	    pool->next[i] = pool->end[i];	/* they're ours now */
+	}
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (rebuild) {
+	pthread_mutex_lock(&expidx[fs].filelock);
+	expidx[fs].rebuild = TRUE;
+	pthread_mutex_unlock(&expidx[fs].filelock);
+    }
+}
+
+/* exp_leftmerge --
+
+    Put the boxes carried over from the last round ahead of a new work
+    list (and their index entries ahead of its due list).
+*/
+
+static void exp_leftmerge(expleft *left, expbox **work, long *nwork, expent **due, long *ndue) {
+
+    expbox	*w;
+    expent	*d = NULL;
+    long	i;
+
+    w = (expbox *) mallocf((left->nwork + *nwork) * sizeof(expbox));
+    bcopy((char *) left->work, (char *) w, left->nwork * sizeof(expbox));
+    for (i = 0; i < *nwork; ++i) {
+	w[left->nwork + i] = (*work)[i];
+	w[left->nwork + i].first += left->ndue;
+    }
+
+    if (left->ndue + *ndue > 0) {
+	d = (expent *) mallocf((left->ndue + *ndue) * sizeof(expent));
+	if (left->ndue > 0)
+	    bcopy((char *) left->due, (char *) d, left->ndue * sizeof(expent));
+	if (*ndue > 0)
+	    bcopy((char *) *due, (char *) &d[left->ndue], *ndue * sizeof(expent));
+    }
+
+    if (*work)
+	t_free(*work);
+    if (*due)
+	t_free(*due);
+    *work = w;
+    *nwork += left->nwork;
+    *due = d;
+    *ndue += left->ndue;
+}
+
+/* exp_leftfree --
+
+    Done with (or not using) the boxes carried over from the last round.
+*/
+
+static void exp_leftfree(expleft *left) {
+
+    if (left == NULL)
+	return;
+    if (left->work)
+	t_free(left->work);
+    if (left->due)
+	t_free(left->due);
+    left->work = NULL;
+    left->due = NULL;
+    left->nwork = left->ndue = 0;
+}
+
+/*      ----      Trickle expiration      ----    */
+
+/* In trickle mode (EXPTRICKLE), rather than checking every filesystem in
+   one burst at exp_time, the boxes to check are listed then (a "round"
+   begins) and exptrickle checks a slice of them each minute.  A slice is
+   the share of what's left that's come due since the last slice (so the
+   schedule doesn't depend on how long the throttle held a slice up), and
+   more when the server is quiet (see exp_idle).  A box whose owner is
+   signed on is put back at the end of the list rather than disconnecting
+   them; only once the round's deadline has come are they kicked off.
+   Boxes a round didn't get to are carried into the next one. */
+
+static struct {
+    pthread_mutex_t	lock;		/* protects kick & newround */
+    pthread_cond_t	wait;		/* exptrickle waits here */
+    boolean_t		kick;		/* time for a slice */
+    boolean_t		newround;	/* and to begin a round */
+    boolean_t		active;		/* round in progress (exptrickle only) */
+    u_long		deadline;	/* mactime round must be done by */
+    u_long		last;		/* mactime of the last slice */
+    expwork		w[FILESYS_MAX];	/* each filesystem's state */
+} exp_tr;
+
+/* exp_trickleinit --
+
+    One-time initialization of trickle expiration.
+*/
+
+static void exp_trickleinit() {
+
+    pthread_mutex_init(&exp_tr.lock, pthread_mutexattr_default);
+    pthread_cond_init(&exp_tr.wait, pthread_condattr_default);
+    exp_tr.kick = exp_tr.newround = exp_tr.active = FALSE;
+}
+
+/* exp_trickle_kick --
+
+    Called by mbox_writer each minute:  have exptrickle do a slice (and
+    begin a new round first, if "newround").
+*/
+
+void exp_trickle_kick(boolean_t newround) {
+
+    pthread_mutex_lock(&exp_tr.lock);
+    exp_tr.kick = TRUE;
+    if (newround)
+	exp_tr.newround = TRUE;
+    pthread_cond_signal(&exp_tr.wait);
+    pthread_mutex_unlock(&exp_tr.lock);
+}
+
+/* exp_idle --
+
+    How quiet is the server (0-100%)?  Judged by the number of users
+    signed on (against u_worry) and the number of messages waiting to be
+    delivered (against EXP_QBUSY), whichever is busier.
+*/
+
+static int exp_idle() {
+
+    long	busy = 0;		/* percent */
+    long	qbusy;
+
+    if (u_worry > 0)
+	busy = 100 * u_num / u_worry;
+    qbusy = 100 * STAT_GET(q_pending) / EXP_QBUSY;
+    if (qbusy > busy)
+	busy = qbusy;
+
+    return busy >= 100 ? 0 : 100 - busy;
+}
+
+/* exp_trickle_begin --
+
+    Begin the day's round:  list each filesystem's boxes to check (see
+    exp_poolfill), starting with any the last round left ("left", one
+    per filesystem, or NULL).  They must all be done a day from now, less
+    a margin.
+*/
+
+static void exp_trickle_begin(expleft *left) {
+
+    int		fs;
+
+    if (!exp_begin()) {
+	for (fs = 0; left && fs < m_filesys_count; ++fs)
+	    exp_leftfree(&left[fs]);
+	return;
+    }
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	exp_workstart(&exp_tr.w[fs], fs);
+	/* (if it fails, fs stays inactive) */
+	(void) exp_poolfill(fs, 1, left ? &left[fs] : NULL);
+    }
+    exp_tr.last = mactime();
+    exp_tr.deadline = exp_tr.last + EXP_DAYSECS - EXP_TRICKLESLACK;
+    exp_tr.active = TRUE;
+}
+
+/* exp_trickle_fsdone --
+
+    A filesystem's part of the round is over.
+*/
+
+static void exp_trickle_fsdone(int fs) {
+
+    struct exp_pool	*pool = &exp_pool[fs];
+
+    exp_workdone(&exp_tr.w[fs]);
+    pthread_mutex_lock(&pool->lock);
+    pool->running = 0;
+    pthread_mutex_unlock(&pool->lock);
+    exp_pooldone(fs);
+}
+
+/* exp_trickle_fold --
+
+    A new round is due and the last one isn't done:  end it, keeping the
+    boxes it didn't get to for the new round (see exp_leftover).
+*/
+
+static void exp_trickle_fold(expleft *left) {
+
+    int		fs;
+    long	n = 0;			/* boxes carried */
+
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	exp_leftover(fs, &left[fs]);
+	n += left[fs].nwork;
+	if (exp_pool[fs].active)
+	    exp_trickle_fsdone(fs);
+    }
+    t_errprint_l("Trickle expiration fell behind; %ld boxes carried into the next round.", n);
+    exp_tr.active = FALSE;
+    exp_end();
+}
+
+/* exp_trickle_step --
+
+    Check the next slice of each filesystem's boxes.  When every
+    filesystem is done, so is the round.
+*/
+
+static void exp_trickle_step() {
+
+    int			fs;
+    struct exp_pool	*pool;
+    u_long		now = mactime();
+    double		share;			/* of what's left, due now */
+    int			idle;			/* how quiet we are (%) */
+    long		left;			/* boxes left on a filesystem */
+    long		slice;			/* boxes to do this time */
+    long		n, b;
+    boolean_t		more = FALSE;		/* anything left anywhere? */
+
+    /* time since the last slice, against time left then */
+    if (now >= exp_tr.deadline || exp_tr.deadline <= exp_tr.last)
+	share = 1.0;
+    else if (now <= exp_tr.last)
+	share = 0.0;
+    else
+	share = (double) (now - exp_tr.last) / (exp_tr.deadline - exp_tr.last);
+    exp_tr.last = now;
+    idle = exp_idle();
+
+    for (fs = 0; fs < m_filesys_count; ++fs) {
+	pool = &exp_pool[fs];
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->active) {		/* done already (or never started) */
+	    pthread_mutex_unlock(&pool->lock);
+	    continue;
+	}
+	left = pool->end[0] - pool->next[0];
+	pool->bops = 0;			/* I/O budget is per minute */
+	pool->bstart = msclock();
+	pthread_mutex_unlock(&pool->lock);
+
+	slice = (long) (share * left + 0.999);	/* just keeping up */
+	if (share < 1.0)
+	    slice += slice * (EXP_TRICKLEMAX - 1) * idle / 100;
+	/* signed-on users' boxes wait for a later slice, until the deadline */
+	exp_tr.w[fs].spare = share < 1.0;
+	for (n = 0; n < slice && (b = exp_take(pool, 0)) >= 0; ++n)
+	    exp_checkbox(pool, &exp_tr.w[fs], b);
+
+	explog_flush(&exp_tr.w[fs].explog);	/* keep the logs current */
+	explog_flush(&exp_tr.w[fs].stolog);
+
+	pthread_mutex_lock(&pool->lock);
+	left = pool->end[0] - pool->next[0];	/* (including any passed up) */
+	pthread_mutex_unlock(&pool->lock);
+	if (left > 0)
+	    more = TRUE;
+	else				/* this filesystem's done */
+	    exp_trickle_fsdone(fs);
+    }
+
+    if (!more) {
+	exp_tr.active = FALSE;
+	exp_end();
+    }
+}
+
+/* exptrickle --
+
+    Thread to do trickle expiration:  each time mbox_writer kicks us,
+    check a slice of the day's boxes.  If a new round is due before the
+    last one is done (we've fallen behind somehow), what's left of that
+    one is folded into the new one, rather than done all at once.
+*/
+
+pthread_addr_t exptrickle(pthread_addr_t zot) {
+
+    boolean_t	newround;
+    expleft	left[FILESYS_MAX];	/* carried from an unfinished round */
+
+    setup_signals();
+
+    for (;;) {
+	pthread_mutex_lock(&exp_tr.lock);
+	while (!exp_tr.kick)
+	    pthread_cond_wait(&exp_tr.wait, &exp_tr.lock);
+	exp_tr.kick = FALSE;
+	newround = exp_tr.newround;
+	exp_tr.newround = FALSE;
+	pthread_mutex_unlock(&exp_tr.lock);
+
+	if (newround) {
+	    if (exp_tr.active) {
+		exp_trickle_fold(left);
+		exp_trickle_begin(left);
+	    } else
+		exp_trickle_begin(NULL);
+	}
+	if (exp_tr.active)
+	    exp_trickle_step();
+    }
+}
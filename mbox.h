@@ -221,17 +221,155 @@ struct summinfo {
 
 typedef struct summinfo summinfo;
 
+/* A deleted summary is left in its bucket as a tombstone (with its messid
+   set to SUMM_DEADID) until the bucket is compacted; anything walking a
+   bucket must skip them.  The bucket's "count" includes only live ones. */
+#define SUMM_DEADID	-1
+#define SUMM_DEAD(s)	((s)->messid == SUMM_DEADID)
+
 #define SUMMBUCK_LEN	2000		/* at least large enough for max-size entry */
 
 struct summbuck {			/* one bucket of summary data */
 	struct summbuck *next;		/* link */
+	long		slot;		/* slot in folder's positional index */
 	int		count;		/* number of entries in bucket */
 	int		used;		/* bytes used */
+	int		dead;		/* of which, by tombstones */
 	char		data[SUMMBUCK_LEN];
 };
 typedef struct summbuck summbuck;
 
-#define SUMM_MAGIC	"BlitzSumm v1"	/* file identifier */
+#define SUMM_MAGIC	"BlitzSumm v1"	/* file identifier (old text format) */
+
+/* Binary summary files: a header, then one fixed-size record per summary,
+   then a heap of the NUL-terminated strings the records point to (by
+   offset from the start of the heap).  Numbers are 32 bits, network byte
+   order.  The file is read with a single mmap; nothing is parsed.  Old
+   text files are converted the first time they're read. */
+   
+#define SUMM_BMAGIC	"BlitzSumm v2"	/* file identifier */
+#define SUMM_MAGICLEN	12		/* (both magic strings) */
+#define SUMM_BVERS	2		/* binary format version */
+
+#define SUMM_HDRLEN	32		/* header: magic + ... */
+#define SH_VERS		12		/* format version */
+#define SH_COUNT	16		/* number of records */
+#define SH_RECLEN	20		/* record size (may grow) */
+#define SH_HEAPLEN	24		/* string heap size */
+#define SH_GEN		28		/* generation (see journal, below) */
+
+#define SUMM_RECLEN	56		/* record: */
+#define SR_MESSID	0
+#define SR_TYPE		4
+#define SR_TOTALLEN	8
+#define SR_ENCLOSURES	12
+#define SR_EXPIRE	16
+#define SR_FLAGS	20		/* SRF_ bits */
+#define SR_SENDER	24		/* heap offsets of strings */
+#define SR_RECIPNAME	28
+#define SR_TOPIC	32
+#define SR_DATE		36		/* date[9] */
+#define SR_TIME		45		/* time[9] */
+
+#define SRF_READ	1		/* message read */
+#define SRF_RECEIPT	2		/* receipt requested */
+
+/* Summary journal.  Rather than rewriting the whole summary file every
+   time a folder changes, the changes are appended to a journal file (the
+   summary file's name with SUMM_JPREFIX in front) as small records, which
+   summ_read replays on top of the summary file.  Once the journal grows
+   past 1/SUMM_JRATIO of the summary file (or SUMM_JMIN, if that's more)
+   the summary file is rewritten and the journal discarded.  The journal
+   header records the generation of the summary file it applies to, so a
+   journal left behind by a crash just after a rewrite is ignored.  */
+
+#define SUMM_JMAGIC	"BlitzJrnl v1"	/* journal identifier (SUMM_MAGICLEN) */
+#define SUMM_JPREFIX	".J"		/* journal filename prefix */
+#define SUMM_JRATIO	4		/* rewrite when journal > summfile/4 */
+#define SUMM_JMIN	8192		/* (but always allow this much) */
+
+#define SUMM_JHDRLEN	16		/* header: magic + ... */
+#define JH_GEN		12		/* generation of summary file */
+
+#define JR_HDRLEN	8		/* record header: */
+#define JR_TYPE		0		/* JR_ type */
+#define JR_LEN		4		/* length, including header */
+
+#define JR_ADD		1		/* added: summary record + its strings */
+#define JR_DEL		2		/* deleted: messid */
+#define JR_UPD		3		/* changed in place: JU_ fields */
+#define JR_RENUM	4		/* new messid: old messid, new messid */
+
+#define JU_MESSID	0		/* JR_UPD fields */
+#define JU_TOTALLEN	4
+#define JU_ENCLOSURES	8
+#define JU_FLAGS	12		/* SRF_ bits */
+#define JU_EXPIRE	16
+#define JU_LEN		20
+
+/* Box manifest.  Once everything in a box has been written out and the
+   summaries are known to agree with the mess directory, mbox_dowrite
+   leaves a manifest recording the mess directory's modification time
+   (the stamp), the message count and the box length.  It's removed
+   before the next summary file write.  So if it's there when the box is
+   next attached and the mess directory hasn't been touched since, the
+   box is consistent and summ_check's reconciliation can be skipped.
+   A crash in the meantime leaves no manifest (or a stale stamp), and
+   the full check is done.  The stamp must have settled (be at least
+   MANIFEST_SETTLE seconds old) before it's recorded, so a change within
+   the same second can't go unnoticed. */
+
+#define MANIFEST_FNAME	"/.manifest"	/* manifest (within mailbox dir) */
+#define MANIFEST_MAGIC	"BlitzMfst v1"	/* identifier (SUMM_MAGICLEN) */
+#define MANIFEST_SETTLE	2		/* stamp must be this old */
+
+#define MF_GEN		12		/* manifest generation */
+#define MF_STAMP	16		/* mess directory mtime (0: none) */
+#define MF_COUNT	20		/* number of messages */
+#define MF_BOXLEN	24		/* total length of messages */
+#define MANIFEST_LEN	28
+
+/* Messid index:  an open-addressed hash table (linear probing) mapping a
+   messid to where its summary lives.  Every folder whose summaries are in
+   memory has one; the mbox has another, mapping messid to folder number
+   only, so a message can be located without reading in every folder.
+   Message ids are handed out sequentially, so the low bits make a fine
+   hash.  If the same messid is added twice (a duplicate summary, which
+   summ_check will clean up) the first one stays in the table and "dups"
+   is bumped so lookups know not to trust a miss. */
+
+struct messent {
+	long		messid;		/* key */
+	int		foldnum;	/* folder it's in (< 0: slot empty) */
+	summbuck	*buck;		/* bucket holding it (folder index only) */
+	summinfo	*summ;		/* and the summary itself */
+};
+typedef struct messent messent;
+
+struct messidx {
+	long		size;		/* slots allocated (0 or power of 2) */
+	long		count;		/* slots in use */
+	long		dups;		/* duplicate keys not in table */
+	messent		*tab;		/* the slots */
+};
+typedef struct messidx messidx;
+
+#define MESSIDX_MINSIZE	64		/* initial table size */
+
+/* Positional index:  a Fenwick (binary indexed) tree over the per-bucket
+   summary counts of a folder, so the bucket holding the n'th summary is
+   found in O(log buckets) (see fold_seek).  Buckets are given slots in
+   the order they're created; a freed bucket's slot is simply left empty.
+   Built the first time it's needed and kept current from then on; if
+   it runs out of slots it's discarded, to be rebuilt (bigger) later. */
+
+struct posidx {
+	long		size;		/* slots allocated (0: not built) */
+	long		used;		/* slots assigned */
+	summbuck	**buck;		/* bucket in each slot (NULL: freed) */
+	long		*tree;		/* counts; tree[1..size] */
+};
+typedef struct posidx posidx;
 
 #define FOLD_NAMELEN	32
 struct folder {
@@ -240,7 +378,17 @@ struct folder {
 	long		count;		/* number of messages in folder */
 	long		foldlen;	/* their total length */
 	boolean_t	dirty;		/* needs to be written out? */
+	boolean_t	compact;	/* rewrite summ file, not just journal? */
+	char		*jbuf;		/* journal records not yet written */
+	long		jlen, jmax;	/* their length; buffer size */
+	long		jsize;		/* length of journal file */
+	long		ssize;		/* and of summary file */
+	u_bit32		jgen;		/* generation of summary file */
 	summbuck	*summs;		/* pointer to summaries */
+	summbuck	*last;		/* last bucket (valid iff summs is) */
+	messidx		idx;		/* messid index (valid iff summs is) */
+	posidx		pos;		/* positional index ('') */
+	struct mbox	*mb;		/* box it's in ('') */
 };
 typedef struct folder folder;
 
@@ -294,6 +442,8 @@ typedef struct enclinfo enclinfo;
 */
 
 #define GROUP_MAX	16		/* max # of groups/user */
+#define WARM_FOLDMAX	8		/* signon warm-up: folders read per box */
+#define WARM_READMAX	16		/* '' reads outstanding, server-wide */
 
 struct udb {
 	struct udb	*next;		/* link in u_head list */
@@ -333,6 +483,8 @@ struct udb {
 	char		comline[MAX_STR]; /* current command line */
 	char		*comp;		/* pointer into it */
 	long		cmdtime;	/* time of last command */	
+	u_long		connms;		/* msclock() at connect */
+	boolean_t	summtimed;	/* first summaries sent yet? */
 	
 	/* POP-specific values */
 #define POP_DELETED_CHUNK	100	/* grow popdeleted array this many items at a time */
@@ -354,7 +506,9 @@ udb 	*u_head;			/* list of active users */
     located through the "mbox" block, which is the central repository
     of information for each active mailbox.  Basically all operations
     on the mbox block or any of the subsidiary data structures require
-    that mbox.mbsem be seized.
+    that mbox.mbsem be seized.  Operations that only read may seize it
+    shared (sem_seize_shared), as long as what they read is already in
+    memory:  loading summaries or prefs changes the box (see fold_rdlock).
 */
 
 struct mbox {
@@ -362,7 +516,7 @@ struct mbox {
         struct mbox	*prev;		/* back link */
 	long		uid;		/* userid */
 	int		attach;		/* attachment count (cannot free if > 0) */
-	int		idle;		/* times mbox_dowrite has found box idle */
+	long		lastuse;	/* when last attached (see mbox_lrutouch) */
 	struct sem	mbsem;		/* protects entire structure */
 	int		fs;		/* which file system box belongs on */
 	char		boxname[MBOX_NAMELEN]; /* box pathname */
@@ -372,21 +526,51 @@ struct mbox {
 	boolean_t	xfering;	/* transfer in progress? */
 	boolean_t	gone;		/* user transferred to other server? */
 	boolean_t	checked;	/* summ_check done yet? */
+	boolean_t	indexed;	/* messfold built yet? */
+	boolean_t	manifest;	/* manifest on disk is current? */
+	u_bit32		mfgen;		/* its generation */
 	udb		*user;		/* user data block, iff currently connected */
 	folder		*fold;		/* all folders */
 	int		foldmax;	/* size of allocated folder array */
 	pref_tab	*prefs;		/* pref hash table */
 	ml_tab		*lists;		/* mailing list hash table */ 
 	long		boxlen;		/* total length of messages */
+	long		messcount;	/* number of messages */
+	messidx		messfold;	/* messid -> folder (valid iff indexed) */
+	struct mbox	*limbo;		/* link on list of freed boxes */
+	boolean_t	queued;		/* on dirty queue? */
+	struct mbox	*dnext;		/* link on dirty queue */
+	boolean_t	resident;	/* on LRU list? */
+	struct mbox	*lrunext, *lruprev; /* links on LRU list */
 };
 
 typedef struct mbox mbox;
 
-/* Hash table for mbox structures (just use low bits of uid for hash) */
+#define MBOX_CLAIMED	(-1000000)	/* attach: being freed (see mbox_claim) */
+
+/* Hash table for mbox structures (just use low bits of uid for hash).
+   The chains are protected by MBOX_HASHMAX semaphores; chain i belongs to
+   mbox_sem[i % MBOX_HASHMAX].  The table doubles (mbox_grow) to keep the
+   chains short; since it's always a power of 2 no smaller than MBOX_HASHMAX,
+   a given uid is always under the same semaphore (MBOX_HASH(uid)).
+
+   Where the compiler gives us atomic operations, mbox_find walks the chain
+   without any semaphore, and attach counts are changed atomically.  So a
+   box (or a retired table) may still be in a reader's hands after it's
+   been unlinked; they're kept in limbo until mbox_reap has seen every
+   lookup that might still be looking at them finish. */
 #define MBOX_HASHMAX	256
 #define MBOX_HASH(x)	(x % MBOX_HASHMAX)
+#define MBOX_LOAD	4		/* grow when average chain is longer */
+
+struct mbox_table {
+	long		size;		/* number of chains */
+	struct mbox_table *limbo;	/* link on list of retired tables */
+	mbox		*chain[1];	/* (really [size]) */
+};
+typedef struct mbox_table mbox_table;
 
-mbox 	*mbox_tab[MBOX_HASHMAX];
+mbox_table *mbox_tab;			/* the table */
 int	mbox_count;			/* number of entries in table now */
 
 /* Semaphore protecting hash table.  To avoid deadlocks, always seize table sem
@@ -401,8 +585,37 @@ mb_stats_t mb_stats;		/* counters; see control.h */
 
 /*      ----      Expiration globals      ----    */
 
+#define EXP_DAYSECS	(24*60*60)	/* expiration index is by day */
+#define EXPIDX_ALL	((u_long) ~0)	/* (expire1: reindex every survivor) */
+#define EXP_WORKERMAX	16		/* max expiration workers per filesystem */
+#define EXPLOG_BUFLEN	65536		/* worker log buffer size */
+#define EXP_TRICKLEMAX	4		/* trickle: quiet-time speedup */
+#define EXP_TRICKLESLACK (60*60)	/* trickle: finish round this early (secs) */
+#define EXP_QBUSY	50		/* trickle: queued messages that mean "busy" */
+
+/* A worker's log buffer:  lines collect here, and are appended to the
+   shared log file a whole buffer at a time (see explog_put). */
+typedef struct explogbuf {
+    t_file		*file;		/* file it goes to (NULL if none) */
+    char		*buf;		/* lines not yet written */
+    long		len;		/* how much is there */
+    long		max;		/* room for */
+} explogbuf;
+
+/* One expiration worker's state (see expworker). */
+typedef struct expwork {
+    int			fs;		/* filesystem being expired */
+    u_long		today;		/* expiration date */
+    explogbuf		explog;		/* expired messages */
+    explogbuf		stolog;		/* storage report */
+    long		total;		/* messages expired */
+    long		ops;		/* I/O done (boxes, folders, messages) */
+    boolean_t		spare;		/* skip boxes whose owner is signed on */
+} expwork;
+
 /* Only 1 expiration check may be in progress at a time. A separate
-   thread is spawned for each fs; they share these globals. */
+   thread (with its pool of workers) is spawned for each fs; they share
+   these globals. */
    
 struct {
     pthread_mutex_t	lock;		/* protects remaining fields */
@@ -411,6 +624,7 @@ struct {
     int			threads;	/* thread count */
     u_long		today;		/* expiration date */
     long		total;		/* total expired */
+    long		boxes;		/* boxes checked */
     t_file		*explog;	/* expiration log file */
     t_file		*stolog;	/* storage log file */
 } exp;
@@ -452,8 +666,16 @@ boolean_t fold_addsum(mbox *mb, folder *fold, summinfo *insumm);
 boolean_t foldnum_valid(mbox *mb, int foldnum);
 boolean_t fold_rename(mbox *mb, int foldnum, char *fname);
 summinfo *get_summ(mbox *mb, long messid, folder **fold);
+summinfo *find_summ(mbox *mb, long messid, folder **fold);
+summinfo *fold_seek(folder *fold, long n, summbuck **bp);
+void fold_rdlock(mbox *mb, folder *fold);
+void fold_names(mbox *mb, folder *fold, char *fname, char *jname);
+void fold_prefetch(char *fname, char *jname);
 mbox *mbox_alloc(long uid, int fs);
 void mbox_done(mbox **mb);
+boolean_t mbox_claim(mbox *mb);
+void mbox_dirty(mbox *mb);
+void mbox_unclaim(mbox *mb);
 int fs_match(char *dnddata);
 mbox *mbox_find(long uid, int fs, boolean_t no_record);
 void mbox_init();
@@ -490,13 +712,21 @@ void pubml_set(char *name, ml_data *contents);
 boolean_t pubml_rem(char *name);
 void pubml_update(fileinfo *head, fileinfo *text);
 void summ_check(mbox *mb);
+boolean_t summ_fastcheck(mbox *mb);
+void summ_manifest(mbox *mb);
+boolean_t summ_unmanifest(mbox *mb);
 void summ_copy(summinfo *to, summinfo *from, boolean_t pack);
 boolean_t summ_copymess(mbox *mb, folder *from, folder *to, long *messid, long newexp);
 void summ_fmt(summinfo *summ, char *buf);
 boolean_t summ_parse(char *buf, summinfo *summ, char *fname, boolean_t pack);
 void summ_read(mbox *mb, folder *fold);
+void summ_renumber(mbox *mb, folder *fold, summinfo *summ, long messid);
+void summ_changed(folder *fold, summinfo *summ);
 void summ_write(mbox *mb, folder *fold);
 void summ_free(mbox *mb, folder *fold);
+void messidx_init(messidx *idx);
+void messidx_free(messidx *idx);
+int summ_convert(char *fname, char *tempname);
 boolean_t summ_deliver(mbox *mb, summinfo *insumm, int foldnum, long len);
 void empty_folder(mbox *mb, folder *fold);
 long fold_autoexp(mbox *mb, int foldnum);
@@ -526,10 +756,23 @@ boolean_t splitaddr(char *addr, char *localpart, char *hostpart);
 int hostmatch(char *hostpart, char **list);
 boolean_t set_expr(mbox *mb, folder *fold, long messid, u_long expdate);
 pthread_addr_t mbox_writer(pthread_addr_t zot);
+pthread_addr_t mbox_evictor(pthread_addr_t zot);
+pthread_addr_t mbox_fswriter(pthread_addr_t _fs);
+void mbox_fswstats(int fs, fsw_stats_t *s);
+long mbox_cachesize();
 long mbox_size(mbox *mb);
+void mbox_audit(mbox *mb);
 void mbox_dowrite(boolean_t shouldfree);
+int mbox_warm(mbox *mb);
 pthread_addr_t expire(pthread_addr_t zot);
-void expire1(long uid, int fs, u_long today);
+pthread_addr_t exptrickle(pthread_addr_t zot);
+void exp_trickle_kick(boolean_t newround);
+boolean_t expire1(long uid, expwork *w, char *folds, u_long reidx);
+void explog_put(explogbuf *b, char *line);
+boolean_t exp_progress(int fs, long *done, long *todo, long *ops, int *workers, u_long *elapsed);
+void expidx_add(mbox *mb, int foldnum, summinfo *summ);
+void expidx_shutdown();
+void summ_expindex(mbox *mb);
 int choose_fs();
 void record_fs(mbox *mb);
 #endif /* _MBOX_H */
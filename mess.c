@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <sys/dir.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "t_io.h"
@@ -38,6 +39,11 @@
 #include "mess.h"
 #include "deliver.h"
 #include "queue.h"
+#ifdef MESS_ZEROCOPY
+#include <sys/sendfile.h>
+
+static boolean_t finfo_zerocopy(t_file *out, t_file *inf, fileinfo *in, long *done);
+#endif
 
 /* clean_encl_list --
 
@@ -78,6 +84,10 @@ void finfoclose(fileinfo *finfo) {
 
     Copy "file" (as described by a "fileinfo" structure) to the end of a
     t_file stream.
+    
+    Where possible (output is a socket or plain file, not in telnet mode)
+    the kernel moves the data directly; otherwise (or if it declines) we
+    read & t_fwrite it.
 */
 
 boolean_t finfocopy(t_file *out, fileinfo *in) {
@@ -94,9 +104,15 @@ boolean_t finfocopy(t_file *out, fileinfo *in) {
 	return FALSE;
     }
     
-    (void) lseek(inf->fd, in->offset, SEEK_SET); /* seek to starting place */
+#ifdef MESS_ZEROCOPY
+    if (!out->telnet)			/* try copying without buffering */
+	ok = finfo_zerocopy(out, inf, in, &totallen);
+#endif
+
+    /* seek to starting place (or wherever zero-copy left off) */
+    (void) lseek(inf->fd, in->offset + totallen, SEEK_SET);
 
-    while(totallen < in->len) {
+    while(ok && totallen < in->len) {
 	len = sizeof(buf);		/* read a buffer full */
 	if (len > in->len - totallen)	/* or until end of file chunk */
 	    len = in->len - totallen;
@@ -123,6 +139,7 @@ boolean_t finfocopy(t_file *out, fileinfo *in) {
 	    }
 	    break;
 	}
+	STAT_ADD(copy_stats.buffered, len);
     }
             
     (void) t_fclose(inf);		/* done with input file */
@@ -130,6 +147,93 @@ boolean_t finfocopy(t_file *out, fileinfo *in) {
     return ok;
 }
 
+#ifdef MESS_ZEROCOPY
+/* finfo_zerocopy --
+
+    Have the kernel copy as much of the file as it's willing to: sendfile if
+    the output is a socket, copy_file_range if it's a regular file.  Any data
+    already buffered in "out" is flushed first; afterwards its buffer is
+    empty (& in writing state), so buffered writes can pick up where we
+    leave off.
+    
+    *done is set to the number of bytes copied.  Returns FALSE on a real
+    error (or urgent data/disconnect); returns TRUE with *done < in->len if
+    the kernel can't do this kind of copy, so the caller should fall back.
+*/
+
+static boolean_t finfo_zerocopy(t_file *out, t_file *inf, fileinfo *in, long *done) {
+
+    struct stat	st;
+    boolean_t	sock;			/* output is a socket? */
+    off_t	off;			/* current input offset */
+    loff_t	inoff;			/* (for copy_file_range) */
+    long	len;			/* length this time */
+    long	n;			/* length actually copied */
+    int		err;
+    
+    *done = 0;
+    
+    if (fstat(out->fd, &st) < 0)
+	return TRUE;			/* don't know; use buffered copy */
+    if (S_ISSOCK(st.st_mode))
+	sock = TRUE;
+    else if (S_ISREG(st.st_mode))
+	sock = FALSE;
+    else
+	return TRUE;			/* pipe or something */
+	
+    if (t_fflush(out) < 0)		/* get out whatever's buffered */
+	goto writerr;
+	
+    off = in->offset;
+    while (*done < in->len) {
+	if (!t_selwait(out, SEL_WRITE))	/* wait for room (resets idle timer) */
+	    return FALSE;		/* urgent data or pending disconnect */
+	    
+	len = in->len - *done;
+	if (sock) {
+	    if (len > ZEROCOPY_CHUNK)
+		len = ZEROCOPY_CHUNK;
+	    n = sendfile(out->fd, inf->fd, &off, len);
+	} else {
+	    inoff = off;
+	    n = copy_file_range(inf->fd, &inoff, out->fd, NULL, len, 0);
+	    if (n > 0)
+		off = inoff;
+	}
+	
+	if (n > 0) {
+	    *done += n;
+	    if (sock)
+		STAT_ADD(copy_stats.sendfile, n);
+	    else
+		STAT_ADD(copy_stats.copyrange, n);
+	    continue;
+	}
+	if (n == 0) {
+	    t_perror1("finfocopy: Unexpected eof on ", in->fname);
+	    return FALSE;
+	}
+	err = pthread_errno();
+	if (err == EINTR || err == EAGAIN)
+	    continue;			/* (t_selwait will wait for room) */
+	if (err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP)
+	    return TRUE;		/* not supported here; finish the slow way */
+	out->t_errno = err;
+	goto writerr;
+    }
+    return TRUE;
+
+writerr:
+    if (out->t_errno) {			/* is it an io error? */
+	/* don't log remote disconnect */
+	if (out->t_errno != EPIPE && out->t_errno != ESPIPE)	
+	    t_perror1("finfocopy: error writing ", out->name);
+    }
+    return FALSE;
+}
+#endif
+
 /* temp_finfo --
 
     Set up a "fileinfo" for a temp file.
@@ -215,6 +319,7 @@ boolean_t mess_deliver(mbox *mb, messinfo *mi, long len, char *err) {
     if (ok) {				/* link() worked? */
 	sem_seize(&mb->mbsem);
 	mb->boxlen += len;		/* yes - update length of total box */
+	++mb->messcount;
 	sem_release(&mb->mbsem);
 	return TRUE;
     }
@@ -481,6 +586,7 @@ boolean_t mess_rem(mbox *mb, long messid, long len) {
 	return FALSE;
     else {
     	mb->boxlen -= len;
+    	--mb->messcount;
     	return TRUE;
     }
 }
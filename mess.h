@@ -79,6 +79,19 @@ int		messid_f;		/* file recording value */
 struct sem	messid_sem;		/* semaphore protecting it */
 #define HEAD_MAXLINE	512		/* max header line we'll deal with */
 
+/* conditionally compile code to have finfocopy use sendfile (to sockets)
+   and copy_file_range (to files), so the data never passes through us */
+#ifdef __linux__
+#define MESS_ZEROCOPY
+#endif
+#define ZEROCOPY_CHUNK	65536		/* max bytes per sendfile call */
+
+struct {				/* finfocopy byte counters (global_lock) */
+	long	sendfile;		/* sent to sockets by sendfile */
+	long	copyrange;		/* copied to files by copy_file_range */
+	long	buffered;		/* copied through t_file buffer */
+} copy_stats;
+
 #define BOUNDS_HDR "X-Part-Bounds"
 #define MAX_BOUNDARY_LEN 70
 
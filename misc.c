@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -26,6 +27,8 @@
 #include "misc.h"
 #include "config.h"
 #include "mess.h"
+#include "client.h"
+#include "queue.h"
 
 static char *month_name[12] = { "Jan", "Feb", "Mar", "Apr", 
 				"May", "Jun", "Jul", "Aug", 
@@ -44,10 +47,13 @@ boolean_t do_cp1(char *oldname, char *newname);
 void misc_init() {
 
     pthread_mutex_init(&global_lock, pthread_mutexattr_default); /* initialize global locks */
+#ifdef MALLOC_LOCK
     pthread_mutex_init(&malloc_lock, pthread_mutexattr_default);
+#endif
     pthread_mutex_init(&clock_lock, pthread_mutexattr_default);
     pthread_mutex_init(&dir_lock, pthread_mutexattr_default);
     pthread_mutex_init(&syslog_lock, pthread_mutexattr_default);
+    slab_init();
     
 #ifdef KERBEROS
     sem_init(&krb_sem, "krb_sem");
@@ -445,6 +451,46 @@ boolean_t parse_expdate(char *p, u_long *out) {
     return TRUE;
     
 }
+/* malloc_slot --
+
+    Return this thread's slot in malloc_stripes.  Threads are assigned
+    slots round-robin the first time they allocate, so concurrent
+    threads mostly bump different cache lines.  Without thread-local
+    storage, everyone shares slot 0 (under global_lock).
+*/
+
+#ifdef STAT_ATOMIC
+static int		malloc_nextslot;	/* next slot to hand out */
+static __thread int	malloc_myslot = -1;	/* this thread's slot */
+
+static struct malloc_stripe *malloc_slot() {
+
+    if (malloc_myslot < 0)
+	malloc_myslot = __sync_fetch_and_add(&malloc_nextslot, 1) % MALLOC_STRIPES;
+	
+    return &malloc_stripes[malloc_myslot];
+}
+#else
+#define malloc_slot()	(&malloc_stripes[0])
+#endif
+
+/* malloc_total --
+
+    Sum the striped net malloc count.  Stripes are read without locking;
+    the result is a snapshot, good enough for statistics.
+*/
+
+long malloc_total() {
+
+    long	total = 0;
+    int		i;
+    
+    for (i = 0; i < MALLOC_STRIPES; ++i)
+	total += malloc_stripes[i].count;
+	
+    return total;
+}
+
 /* t_free --
 	thread-safe free
 */
@@ -452,13 +498,15 @@ boolean_t parse_expdate(char *p, u_long *out) {
 
 void t_free(void *p) {
 
+#ifdef MALLOC_LOCK
     pthread_mutex_lock(&malloc_lock);
+#endif
     free(p);
+#ifdef MALLOC_LOCK
     pthread_mutex_unlock(&malloc_lock);    
+#endif
 
-    pthread_mutex_lock(&global_lock);
-    --malloc_stats.total;
-    pthread_mutex_unlock(&global_lock);
+    STAT_DEC(malloc_slot()->count);
 
 }
 
@@ -471,21 +519,22 @@ void *mallocf(size_t byteSize) {
 
     void 		*result;
     
-    pthread_mutex_lock(&malloc_lock);	/* malloc probably isn't reentrant */
+#ifdef MALLOC_LOCK
+    pthread_mutex_lock(&malloc_lock);	/* malloc isn't reentrant here */
+#endif
     
     result = malloc(byteSize);
     
+#ifdef MALLOC_LOCK
+    pthread_mutex_unlock(&malloc_lock);
+#endif
+
     if (result == NULL) {
-	pthread_mutex_unlock(&malloc_lock);
 	t_perror("malloc failed");
 	abortsig();		
     }
     
-    pthread_mutex_unlock(&malloc_lock);
-    
-    pthread_mutex_lock(&global_lock);
-    ++malloc_stats.total;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(malloc_slot()->count);
 
     return result;
 }
@@ -499,20 +548,246 @@ void *reallocf(void *old, size_t byteSize) {
 
     void 		*result;
 
-    pthread_mutex_lock(&malloc_lock);	/* probably isn't reentrant */
+#ifdef MALLOC_LOCK
+    pthread_mutex_lock(&malloc_lock);	/* realloc isn't reentrant here */
+#endif
     
     result = realloc(old, byteSize);
     
+#ifdef MALLOC_LOCK
+    pthread_mutex_unlock(&malloc_lock);	
+#endif
+
     if (result == NULL) {
-	pthread_mutex_unlock(&malloc_lock);
 	t_perror("realloc failed");
 	abortsig();		
     }
-
-    pthread_mutex_unlock(&malloc_lock);	
     
     return result;
 }
+
+/* slab_init --
+
+    Set up the slab caches.  Called from misc_init.
+*/
+
+static void slab_setup(int c, char *name, size_t size) {
+
+    struct slab_cache	*sc = &slab_caches[c];
+    
+    sc->name = name;
+    sc->size = size;
+    sc->keep = SLAB_KEEPBYTES / size;
+    if (sc->keep < 2*SLAB_MAGSIZE)	/* always room for a couple of magazines */
+	sc->keep = 2*SLAB_MAGSIZE;
+    pthread_mutex_init(&sc->lock, pthread_mutexattr_default);
+    sc->depot = NULL;
+    sc->depotcnt = 0;
+}
+
+void slab_init() {
+
+    slab_setup(SLAB_SUMMBUCK, "Summary buckets", sizeof(summbuck));
+    slab_setup(SLAB_RECIP, "Recipients", sizeof(recip));
+    slab_setup(SLAB_QENT, "Queue entries", sizeof(qent));
+    slab_setup(SLAB_BUFL, "Obufs", sizeof(bufl));
+    slab_setup(SLAB_WARNING, "Warnings", sizeof(warning));
+}
+
+#ifdef SLAB_MAGAZINES
+struct slab_mag {			/* per-thread cache of free objects */
+    int		count;
+    void	*obj[SLAB_MAGSIZE];
+};
+
+static __thread boolean_t	slab_hasmag;	/* this thread uses magazines */
+static __thread struct slab_mag	slab_mags[SLAB_COUNT];
+#endif
+
+static void slab_depot(struct slab_cache *sc, void *head, void *tail, long n);
+
+/* slab_thread --
+
+    Mark the calling thread as long-lived: it may hold objects in per-thread
+    magazines.  Threads that exit must not call this (their magazines would
+    be lost).
+*/
+
+void slab_thread() {
+
+#ifdef SLAB_MAGAZINES
+    slab_hasmag = TRUE;
+#endif
+}
+
+/* slab_idle --
+
+    The calling worker has finished its work item:  give everything in
+    its magazines back to the depots, rather than sit on it while idle.
+*/
+
+void slab_idle() {
+
+#ifdef SLAB_MAGAZINES
+    struct slab_mag	*m;
+    int			c, i;
+
+    if (!slab_hasmag)
+	return;
+    for (c = 0; c < SLAB_COUNT; ++c) {
+	m = &slab_mags[c];
+	if (m->count == 0)
+	    continue;
+	for (i = 0; i < m->count - 1; ++i)	/* chain them */
+	    *(void **) m->obj[i] = m->obj[i+1];
+	slab_depot(&slab_caches[c], m->obj[0], m->obj[m->count - 1], m->count);
+	m->count = 0;
+    }
+#endif
+}
+
+/* slab_new --
+
+    Depot is empty; get a new object from malloc.
+*/
+
+static void *slab_new(struct slab_cache *sc) {
+
+    STAT_INC(sc->mallocs);
+    STAT_INC(sc->blocks);
+    
+    return mallocf(sc->size);
+}
+
+/* slab_depot --
+
+    Return a chain of n free objects (linked through their first word)
+    to the depot.  Anything beyond the cache's keep limit goes back to
+    malloc (outside the lock).  Objects sitting in magazines (everything
+    malloc'd that's neither in use nor in the depot) count too.
+*/
+
+static void slab_depot(struct slab_cache *sc, void *head, void *tail, long n) {
+
+    void	*trim = NULL;		/* objects to really free */
+    void	*p;
+    long	magcnt;			/* objects in magazines (approx.) */
+    
+    pthread_mutex_lock(&sc->lock);
+    *(void **) tail = sc->depot;	/* splice chain onto depot */
+    sc->depot = head;
+    sc->depotcnt += n;
+    magcnt = STAT_GET(sc->blocks) - STAT_GET(sc->inuse) - sc->depotcnt;
+    if (magcnt < 0)			/* (counters are racy) */
+	magcnt = 0;
+    while (sc->depotcnt > 0 && sc->depotcnt + magcnt > sc->keep) { /* too many? */
+	p = sc->depot;
+	sc->depot = *(void **) p;
+	*(void **) p = trim;
+	trim = p;
+	--sc->depotcnt;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    
+    while ((p = trim) != NULL) {
+	trim = *(void **) p;
+	t_free(p);
+	STAT_DEC(sc->blocks);
+    }
+}
+
+/* slab_alloc --
+
+    Allocate an object from slab cache c.  Contents are garbage.
+*/
+
+void *slab_alloc(int c) {
+
+    struct slab_cache	*sc = &slab_caches[c];
+    void		*p;
+#ifdef SLAB_MAGAZINES
+    struct slab_mag	*m;
+#endif
+
+    STAT_INC(sc->allocs);
+    STAT_INC(sc->inuse);
+    
+#ifdef SLAB_MAGAZINES
+    if (slab_hasmag) {
+	m = &slab_mags[c];
+	if (m->count == 0) {		/* empty; refill half from depot */
+	    pthread_mutex_lock(&sc->lock);
+	    while (m->count < SLAB_MAGSIZE/2 && sc->depot) {
+		m->obj[m->count++] = sc->depot;
+		sc->depot = *(void **) sc->depot;
+		--sc->depotcnt;
+	    }
+	    pthread_mutex_unlock(&sc->lock);
+	}
+	if (m->count > 0)
+	    return m->obj[--m->count];
+	return slab_new(sc);		/* depot empty too */
+    }
+#endif
+
+    pthread_mutex_lock(&sc->lock);
+    if ((p = sc->depot) != NULL) {
+	sc->depot = *(void **) p;
+	--sc->depotcnt;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    
+    if (p == NULL)
+	p = slab_new(sc);
+	
+    return p;
+}
+
+/* slab_free --
+
+    Return an object to slab cache c.
+*/
+
+void slab_free(int c, void *p) {
+
+    struct slab_cache	*sc = &slab_caches[c];
+#ifdef SLAB_MAGAZINES
+    struct slab_mag	*m;
+    int			i;
+#endif
+
+    STAT_DEC(sc->inuse);
+    
+#ifdef SLAB_MAGAZINES
+    if (slab_hasmag) {
+	m = &slab_mags[c];
+	if (m->count == SLAB_MAGSIZE) {	/* full; move half to depot */
+	    for (i = SLAB_MAGSIZE/2; i < SLAB_MAGSIZE - 1; ++i)
+		*(void **) m->obj[i] = m->obj[i+1];
+	    slab_depot(sc, m->obj[SLAB_MAGSIZE/2], m->obj[SLAB_MAGSIZE-1], SLAB_MAGSIZE/2);
+	    m->count = SLAB_MAGSIZE/2;
+	}
+	m->obj[m->count++] = p;
+	return;
+    }
+#endif
+
+    slab_depot(sc, p, p, 1);
+}
+
+/* slab_freechain --
+
+    Free a whole list of n objects at once (head...tail, linked through
+    their first word) with a single trip to the depot.
+*/
+
+void slab_freechain(int c, void *head, void *tail, long n) {
+
+    struct slab_cache	*sc = &slab_caches[c];
+
+    STAT_ADD(sc->inuse, -n);
+    slab_depot(sc, head, tail, n);
+}
 /* check_temp_space --
 
     Check to see if temp space has room for message of a given length.
@@ -1169,3 +1444,145 @@ void setup_signals() {
     signal(SIGSEGV, abortsig);	/* .. */
 
 }
+
+/* msclock --
+
+    Return a free-running millisecond clock (for measuring intervals; the
+    value wraps, so only differences are meaningful).
+*/
+
+u_long msclock() {
+
+    struct timeval	tv;
+    
+    gettimeofday(&tv, NULL);
+    return (u_long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* work_thread --
+
+    A pool worker: take the next item off the run queue and run it;
+    repeat forever.
+*/
+
+static any_t work_thread(any_t zot) {
+
+    workent		*w;		/* current work item */
+    pthread_startroutine_t func;	/* routine to run */
+    pthread_addr_t	arg;		/* and its argument */
+    u_long		wait;		/* time it sat in queue */
+    
+    setup_signals();			/* set up signal handlers for new thread */
+    setup_syslog();
+    slab_thread();			/* workers never exit; use magazines */
+
+    for (;;) {
+	pthread_mutex_lock(&work_pool.lock);
+	while (work_pool.head == NULL)	/* wait for something to do */
+	    pthread_cond_wait(&work_pool.work, &work_pool.lock);
+	    
+	w = work_pool.head;		/* unlink from run queue */
+	if ((work_pool.head = w->next) == NULL)
+	    work_pool.tail = NULL;
+	--work_pool.qlen;
+	
+	func = w->func; arg = w->arg;
+	wait = msclock() - w->qtime;
+	w->next = work_pool.free;	/* recycle entry */
+	work_pool.free = w;
+	
+	if (++work_pool.busy > work_pool.busy_hwm)
+	    work_pool.busy_hwm = work_pool.busy;
+	++work_pool.dispatched;
+	work_pool.wait_total += wait;
+	if (wait > work_pool.wait_max)
+	    work_pool.wait_max = wait;
+	pthread_mutex_unlock(&work_pool.lock);
+	
+	(void) (*func)(arg);		/* do the work */
+	slab_idle();			/* don't hoard objects while idle */
+	
+	pthread_mutex_lock(&work_pool.lock);
+	--work_pool.busy;
+	pthread_mutex_unlock(&work_pool.lock);
+    }
+}
+
+/* work_init --
+
+    Start the worker pool (m_workers threads).  Call after read_config.
+*/
+
+void work_init() {
+
+    pthread_t	thread;			/* thread var */
+    int		i;
+    
+    pthread_mutex_init(&work_pool.lock, pthread_mutexattr_default);
+    pthread_cond_init(&work_pool.work, pthread_condattr_default);
+    
+    for (i = 0; i < m_workers; ++i) {
+	if (pthread_create(&thread, generic_attr,
+		(pthread_startroutine_t) work_thread, (pthread_addr_t) 0) < 0) {
+	    t_perror("work_init: pthread_create");
+	    break;			/* make do with what we've got */
+	}
+	pthread_detach(&thread);
+	++work_pool.workers;
+    }
+}
+
+/* work_dispatch --
+
+    Queue a routine to be run by the worker pool.  Never blocks:  if the run
+    queue is already full the work is refused, and the caller should turn
+    the connection away.  If there is no pool (WORKERS 0), just start a new
+    thread.
+    
+    Returns FALSE if the work couldn't be started.
+*/
+
+boolean_t work_dispatch(pthread_startroutine_t func, pthread_addr_t arg) {
+
+    workent	*w;			/* new queue entry */
+    pthread_t	thread;			/* thread var */
+    
+    if (work_pool.workers == 0) {	/* no pool; thread per request */
+	if (pthread_create(&thread, generic_attr, func, arg) < 0) {
+	    t_perror("work_dispatch: pthread_create");
+	    return FALSE;
+	}
+	pthread_detach(&thread);
+	return TRUE;
+    }
+    
+    pthread_mutex_lock(&work_pool.lock);
+    
+    if (work_pool.qlen >= m_workqueue) { /* queue full -- refuse */
+	++work_pool.full;
+	pthread_mutex_unlock(&work_pool.lock);
+	return FALSE;
+    }
+    
+    if ((w = work_pool.free) != NULL)	/* reuse old entry if possible */
+	work_pool.free = w->next;
+    else
+	w = (workent *) mallocf(sizeof(workent));
+	
+    w->func = func;
+    w->arg = arg;
+    w->qtime = msclock();
+    w->next = NULL;
+    if (work_pool.tail)			/* append to run queue */
+	work_pool.tail->next = w;
+    else
+	work_pool.head = w;
+    work_pool.tail = w;
+    if (++work_pool.qlen > work_pool.q_hwm)
+	work_pool.q_hwm = work_pool.qlen;
+	
+    pthread_cond_signal(&work_pool.work); /* wake an idle worker */
+    pthread_mutex_unlock(&work_pool.lock);
+    
+    return TRUE;
+}
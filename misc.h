@@ -53,13 +53,47 @@ typedef struct forkinfo forkinfo;
 extern char server_vers[];
 
 pthread_mutex_t global_lock;	/* lock protecting misc globals */
-pthread_mutex_t malloc_lock;	/* lock protecting malloc */
+#ifdef MALLOC_LOCK
+pthread_mutex_t malloc_lock;	/* lock protecting malloc (if not thread-safe) */
+#endif
 pthread_mutex_t dir_lock;	/* lock protecting readdir etc. */
 pthread_attr_t  generic_attr;   /* thread attributes */
 #define DEFAULT_STACKSIZE 32768
 
+/* Allocation counters.  The C library malloc is thread-safe everywhere
+   we build now, so mallocf & co. no longer serialize on a lock of their
+   own (define MALLOC_LOCK to get it back).  Counters are bumped with
+   STAT_INC/STAT_DEC/STAT_ADD: atomic where the compiler supports it,
+   under global_lock elsewhere.  The net block count is bumped on every
+   allocation, so it is split into per-thread stripes (each on its own
+   cache line) that malloc_total() sums on demand. */
+
+#if defined(__GNUC__) && !defined(__NeXT__)
+#define STAT_ATOMIC
+#define STAT_ADD(x, n)	((void) __sync_fetch_and_add(&(x), (n)))
+#else
+#define STAT_ADD(x, n)	do { pthread_mutex_lock(&global_lock); \
+			     (x) += (n); \
+			     pthread_mutex_unlock(&global_lock); } while (0)
+#endif
+#define STAT_INC(x)	STAT_ADD(x, 1)
+#define STAT_DEC(x)	STAT_ADD(x, -1)
+#ifdef STAT_ATOMIC
+#define STAT_GET(x)	__sync_fetch_and_add(&(x), 0)
+#else
+#define STAT_GET(x)	(x)
+#endif
+
+#define MALLOC_STRIPES	16	/* slots for net malloc count */
+#define MALLOC_LINE	64	/* assumed cache line size */
+
+struct malloc_stripe {
+	long	count;		/* net blocks allocated by threads in this slot */
+	char	pad[MALLOC_LINE - sizeof(long)];
+};
+struct malloc_stripe malloc_stripes[MALLOC_STRIPES];
+
 struct {			/* counters of allocated things */
-	long	total;		/* all blocks currently allocated */
 	long	summbuck;	/* summary buckets */
 	long	mbox;		/* mbox structs */
 	long	obufs;		/* obufs */
@@ -68,8 +102,77 @@ struct {			/* counters of allocated things */
 	long	prefentry;	/* individual pref entry */
 	long	mltab;		/* mailing list hash table */
 	long	mlentry;	/* individual mailing list entry */
+	long	messidx;	/* messid index tables (bytes) */
 } malloc_stats;
 
+/* Slab caches for the small fixed-size objects the server allocates and
+   frees constantly.  Free objects are kept on a per-cache depot list
+   (linked through their first word), so most allocations never reach
+   malloc.  Worker pool threads also keep a small magazine of objects per
+   cache that they can use without taking the depot lock; other threads
+   (which may exit, taking their magazine with them) use the depot
+   directly.  A worker's magazines go back to the depot whenever it goes
+   idle (slab_idle).  Objects cached anywhere -- depot or magazine -- count
+   against "keep"; the depot is trimmed on free to stay within it. */
+
+#define SLAB_SUMMBUCK	0	/* summary buckets */
+#define SLAB_RECIP	1	/* address resolution recipients */
+#define SLAB_QENT	2	/* queue entries */
+#define SLAB_BUFL	3	/* output buffer blocks */
+#define SLAB_WARNING	4	/* client warnings */
+#define SLAB_COUNT	5
+
+#define SLAB_MAGSIZE	16	/* objects per thread magazine */
+#define SLAB_KEEPBYTES	262144	/* max bytes cached by each cache */
+
+#ifdef STAT_ATOMIC		/* have thread-local storage */
+#define SLAB_MAGAZINES
+#endif
+
+struct slab_cache {
+	char		*name;		/* for MSTAT */
+	size_t		size;		/* object size */
+	long		keep;		/* max objects cached (depot + magazines) */
+	pthread_mutex_t	lock;		/* protects depot */
+	void		*depot;		/* free objects */
+	long		depotcnt;	/* number of them */
+	long		blocks;		/* objects currently malloc'd by cache */
+	long		inuse;		/* objects handed out */
+	long		allocs;		/* total slab_alloc calls */
+	long		mallocs;	/* allocs that had to call mallocf */
+};
+struct slab_cache slab_caches[SLAB_COUNT];
+
+/* Worker thread pool.  Rather than creating (and tearing down) a thread
+   for every connection, the listeners hand accepted connections to a set
+   of threads started at boot time.  Work waits on a bounded run queue when
+   all workers are busy. */
+   
+struct workent {			/* run queue entry */
+    struct workent	*next;
+    pthread_startroutine_t func;	/* routine to run */
+    pthread_addr_t	arg;		/* and its argument */
+    u_long		qtime;		/* msclock() when queued */
+};
+typedef struct workent workent;
+
+struct {
+	pthread_mutex_t	lock;		/* protects work_pool */
+	pthread_cond_t	work;		/* idle workers wait here */
+	workent		*head;		/* run queue */
+	workent		*tail;
+	workent		*free;		/* recycled queue entries */
+	long		workers;	/* threads in pool */
+	long		busy;		/* workers currently running something */
+	long		busy_hwm;	/* peak busy */
+	long		qlen;		/* entries on run queue */
+	long		q_hwm;		/* peak qlen */
+	long		dispatched;	/* total work items run */
+	long		full;		/* connections refused, queue full */
+	u_long		wait_total;	/* total time queued (ms) */
+	u_long		wait_max;	/* longest time queued (ms) */
+} work_pool;
+
 #ifdef KERBEROS
 struct sem krb_sem;
 #endif
@@ -92,6 +195,13 @@ void *reallocf(void *old, size_t byteSize);
 void escname(char *in, char *out);
 void unescname(char *in, char *out);
 void t_free(void *p);
+long malloc_total();
+void slab_init();
+void slab_thread();
+void slab_idle();
+void *slab_alloc(int c);
+void slab_free(int c, void *p);
+void slab_freechain(int c, void *head, void *tail, long n);
 boolean_t check_temp_space(long l);
 boolean_t do_rm(char *dirname);
 boolean_t do_cp(char *old, char *new);
@@ -116,4 +226,7 @@ void telnet_strip(char *out, char *in);
 void disassociate();
 char *strwcpy (char *to, char *from);
 void setup_signals();
+u_long msclock();
+void work_init();
+boolean_t work_dispatch(pthread_startroutine_t func, pthread_addr_t arg);
 #endif
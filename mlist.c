@@ -394,9 +394,7 @@ static void ml_hashadd(mbox *mb, char *name) {
     len = strlen(name) + sizeof(ml_name); /* need this much room */
     np = (ml_namep) mallocf(len);
     
-    pthread_mutex_lock(&global_lock);   /* stats: count entries allocated */
-    ++malloc_stats.mlentry;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(malloc_stats.mlentry);	/* stats: count entries allocated */
 
     strcpy(np->name, name);		/* copy the name */
     
@@ -428,9 +426,7 @@ static  boolean_t ml_hashrem(mbox *mb, char *name) {
 	    pp->next = np->next;
 	else mb->lists->hashtab[hash] = np->next;
 	t_free(np);
-    	pthread_mutex_lock(&global_lock);   /* stats: count entries allocated */
-    	--malloc_stats.mlentry;
-   	pthread_mutex_unlock(&global_lock);
+    	STAT_DEC(malloc_stats.mlentry);	/* stats: count entries allocated */
 
 	mb->lists->count--;		/* keep score */
 	return TRUE;
@@ -464,10 +460,8 @@ void ml_free(mbox *mb) {
     t_free(mb->lists);			/* free the table itself */
     mb->lists = NULL;			/* lists not present */
 
-    pthread_mutex_lock(&global_lock);
-    --malloc_stats.mltab;     /* one less table */
-    malloc_stats.mlentry -= freecount; /* n fewer entries */
-    pthread_mutex_unlock(&global_lock);
+    STAT_DEC(malloc_stats.mltab);	/* one less table */
+    STAT_ADD(malloc_stats.mlentry, -freecount); /* n fewer entries */
 }
 
 /* ml_readhash --
@@ -487,10 +481,8 @@ void ml_readhash(mbox *mb) {
     char		name[MAX_STR]; /* list name (w/o escaping) */
     char		dir[FILENAME_MAX]; /* list directory pathname */
  
-    pthread_mutex_lock(&global_lock);
-    ++mb_stats.mlist_r;
-    ++malloc_stats.mltab;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(mb_stats.mlist_r);
+    STAT_INC(malloc_stats.mltab);
     
     /* allocate & initialize hash table */
     mb->lists = mallocf(sizeof(ml_tab));
@@ -62,16 +62,24 @@ void pref_didchange(mbox *mb, char *key, char *value) {
 /* pref_get --
     
     Retrieve preference value.  Caller must provide sufficient storage for
-    a max-sized preference. 
+    a max-sized preference.  The box is only seized shared (unless the
+    prefs have to be read in), so lookups don't wait for each other.
 */
 
 boolean_t pref_get(mbox *mb, char *key, char *value) {
 
     boolean_t 	found;
     
-    sem_seize(&mb->mbsem);  
+    sem_seize_shared(&mb->mbsem);	/* (reading only) */
+    if (!mb->prefs) {			/* need to read them in first */
+	sem_release_shared(&mb->mbsem);
+	sem_seize(&mb->mbsem);
+	if (!mb->prefs)
+	    pref_read(mb);
+	sem_downgrade(&mb->mbsem);
+    }
     found = pref_get_int(mb, key, value);
-    sem_release(&mb->mbsem);
+    sem_release_shared(&mb->mbsem);
     return found;			
     
 }
@@ -111,10 +119,8 @@ void pref_read(mbox *mb) {
     int		i;
     char	*p;
 
-    pthread_mutex_lock(&global_lock);
-    ++mb_stats.pref_r;
-    ++malloc_stats.preftab;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(mb_stats.pref_r);
+    STAT_INC(malloc_stats.preftab);
 
     mb->prefs = mallocf(sizeof(pref_tab));
     for (i = 0; i < PREF_HASHMAX; i++)	/* allocate an empty table */
@@ -224,9 +230,7 @@ void pref_write(mbox *mb) {
     prefp	p;
     t_file	*f;			/* thread-safe io object */
 
-    pthread_mutex_lock(&global_lock);
-    ++mb_stats.pref_w;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(mb_stats.pref_w);
         
     /* name of pref file */
     strcpy(fname, mb->boxname); strcat(fname, PREF_FILE);
@@ -289,10 +293,8 @@ void pref_free(mbox *mb) {
     t_free(mb->prefs);		/* now free the table itself */
     mb->prefs = FALSE;		/* no pref table here */
 
-    pthread_mutex_lock(&global_lock);
-    --malloc_stats.preftab;	/* one less table */
-    malloc_stats.prefentry -= freecount; /* n fewer entries */
-    pthread_mutex_unlock(&global_lock);
+    STAT_DEC(malloc_stats.preftab);	/* one less table */
+    STAT_ADD(malloc_stats.prefentry, -freecount); /* n fewer entries */
     
 }
 
@@ -338,9 +340,7 @@ void pref_hashadd(mbox *mb, char *key, char *value) {
     len = sizeof(pref) + strlen(key) + 1 + strlen(value) + 1;	/* need this much room */
     p = (prefp) mallocf(len);
 
-    pthread_mutex_lock(&global_lock);	/* stats: count entries allocated */
-    ++malloc_stats.prefentry;
-    pthread_mutex_unlock(&global_lock);
+    STAT_INC(malloc_stats.prefentry);	/* stats: count entries allocated */
     
     strcpy(p->name, key);		/* copy the name */
     p->namelen = strlen(p->name);
@@ -350,6 +350,7 @@ void pref_hashadd(mbox *mb, char *key, char *value) {
     mb->prefs->hashtab[hash] = p;
     
     mb->prefs->dirty = TRUE;
+    mbox_dirty(mb);
 }
 
 /* pref_hashfind --
@@ -400,11 +401,10 @@ static boolean_t pref_hashrem(mbox *mb, char *key) {
 	    pp->next = p->next;
 	else mb->prefs->hashtab[hash] = p->next;
 	t_free(p);
-        pthread_mutex_lock(&global_lock);
-        --malloc_stats.prefentry;	/* stats: count allocated entries */
-        pthread_mutex_unlock(&global_lock);
+        STAT_DEC(malloc_stats.prefentry);	/* stats: count allocated entries */
 
 	mb->prefs->dirty = TRUE; /* table has changed */
+	mbox_dirty(mb);
 	return TRUE;
     } else 
 	return FALSE;
@@ -77,6 +77,7 @@ void queue_init () {
     ++q_tail;
     
     next_q_id = 1;			/* increased if queues have messages already */
+    q_pending = 0;
     
     for (i = -1; i < m_servcount; ++i) {
 	pthread_mutex_init(&q_lock[i], pthread_mutexattr_default);
@@ -214,8 +215,9 @@ void queue_startup(int hostnum) {
 	    (void) unlink(fname);
 	    continue;
 	}
-	new = (qent *) mallocf(sizeof(qent));
+	new = (qent *) slab_alloc(SLAB_QENT);
 	new->qid = qlist[i].qid;
+	STAT_INC(q_pending);
 		
 	new->next = NULL;			/* new one is last */
 	if (prev)
@@ -260,7 +262,7 @@ void wake_queuethread(int hostnum, long qid) {
 
     qent	*new;
     
-    new = (qent *) mallocf(sizeof(qent));
+    new = (qent *) slab_alloc(SLAB_QENT);
     new->qid = qid;
     new->next = NULL;
     
@@ -272,6 +274,7 @@ void wake_queuethread(int hostnum, long qid) {
 	q_head[hostnum] = new;
     q_tail[hostnum] = new;
     pthread_mutex_unlock(&q_lock[hostnum]);
+    STAT_INC(q_pending);
     
     pthread_cond_signal(&q_wait[hostnum]);	/* wake owner thread */
 }
@@ -517,7 +520,8 @@ unlink_it:	/* here on missing control/data file */
 	if (q_head[hostnum] == NULL)
 	    q_tail[hostnum] = NULL;
 	pthread_mutex_unlock(&q_lock[hostnum]);
-	t_free(cur);
+	slab_free(SLAB_QENT, cur);
+	STAT_DEC(q_pending);
 	
     }					/* end of queue */
 
@@ -664,8 +668,9 @@ any_t outqueue_read(any_t hostnum_) {
 	    q_head[hostnum] = cur->next;
 	    if (q_head[hostnum] == NULL)
 		q_tail[hostnum] = NULL;
-	    t_free(cur);		/* done with queue entry */
+	    slab_free(SLAB_QENT, cur);	/* done with queue entry */
 	    pthread_mutex_unlock(&q_lock[hostnum]);
+	    STAT_DEC(q_pending);
 	}
     }
 }
@@ -813,7 +818,7 @@ int sendsmtp_one(int hostnum, t_file **conn, qent *cur) {
 	 strcpy(r->name, "");		/* status ok so far */
 	 copy_recip(r, &rlist);		/* copy recipient node into list */
     }
-    t_free(r);				/* free temp */
+    slab_free(SLAB_RECIP, r);		/* free temp */
     if (rlist == NULL) {		/* should be something */
 	t_errprint_l("sendsmtp_one: no recips for messid %ld?", summ.messid);
 	return Q_ABORT;
@@ -908,7 +913,7 @@ int sendsmtp_one(int hostnum, t_file **conn, qent *cur) {
 	free_recips(&retryrecips);
 	return Q_RETRY;			/* message remains in queue */
     } else if (ok) {
-	++m_sent_internet;		/* statistics: count internet messages sent */
+	STAT_INC(m_sent_internet);	/* statistics: count internet messages sent */
 	return Q_OK;			/* message dealt with */
     } else				/* if any errors at all... */
 	return Q_ABORT;			/* ...should reconnect next time */
@@ -1086,7 +1091,8 @@ t_file *serv_connect(char *hostname) {
     t_fdopen(f, sock);			/* associate file w/ socket */
     
     f->select = TRUE;			/* t_select should check this file */
-    f->timeout = smtp_timeout * 60;	/* set timeout interval (seconds) */
+    f->kind = T_KIND_SMTP;		/* (for buffer stats) */
+    t_settimeout(f, smtp_timeout * 60, FALSE); /* set timeout interval (seconds) */
     
     /* record name as debugging aid */
     t_sprintf(f->name, "SMTP to %s", hostname);
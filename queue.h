@@ -30,6 +30,7 @@ qent		**q_tail;
 
 u_bit32		relocate_time;	/* last time users moved */
 long		next_q_id;	/* next unused qid */
+long		q_pending;	/* messages on all queues (STAT_INC/DEC) */
 
 t_file 		*not_f;		/* connection to notification server */
 struct sem	not_sem;	/* lock protecting it */
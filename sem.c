@@ -25,45 +25,250 @@
 #include <netinet/in.h>
 #include "sem.h"
 #include "t_err.h"
+#include "misc.h"
 
 void stackcrawl(void);
 
+/* sem_findclass -- locate (or add) the stats for semaphores named "name" */
+
+static semclass *sem_findclass(char *name) {
+
+    int		i;
+    semclass	*c = NULL;
+
+    pthread_mutex_lock(&global_lock);
+    for (i = 0; i < sem_classcount; ++i) {
+	if (strcmp(sem_class[i].name, name) == 0) {
+	    c = &sem_class[i];
+	    break;
+	}
+    }
+    if (c == NULL && sem_classcount < SEM_CLASSMAX) {
+	c = &sem_class[sem_classcount++];
+	bzero((char *) c, sizeof(semclass));
+	strcpy(c->name, name);
+    }
+    pthread_mutex_unlock(&global_lock);
+
+    return c;
+}
+
+/* sem_hist -- count an interval (ms) in a histogram */
+
+static void sem_hist(u_long hist[SEM_HISTMAX], u_long ms) {
+
+    int		i;
+
+    for (i = 0; ms > 0 && i < SEM_HISTMAX - 1; ms >>= 1)
+	++i;
+    STAT_INC(hist[i]);
+}
+
 /* sem_init -- initialize a newly-allocated semaphore */
 
 void sem_init(sem *s, char *name) {
 
     pthread_mutex_init(&s->lock, pthread_mutexattr_default);
     pthread_cond_init(&s->wait, pthread_condattr_default);
+    pthread_cond_init(&s->rwait, pthread_condattr_default);
     strncpy(s->name, name, SEM_NAMEMAX); 
     s->name[SEM_NAMEMAX-1] = 0;
     s->owner = NO_PTHREAD;		/* initial state == free */
+    s->readers = s->xwaiting = s->rwaiting = 0;
+    s->rturn = 0;
+    s->cls = sem_findclass(s->name);
+}
+
+/* sem_reader -- our slot in the reader table, or -1 */
+
+static int sem_reader(sem *s) {
+
+    int		i;
+
+    for (i = 0; i < s->readers; ++i) {
+	if (pthread_equal(s->reader[i], pthread_self()))
+	    return i;
+    }
+    return -1;
 }
 
+/* sem_seize -- lock semaphore exclusively */
+
 void sem_seize(sem *s) {
 
+    u_long	start = 0;		/* when we started waiting */
+    u_long	now;
+
     pthread_mutex_lock(&s->lock);	
-    if (pthread_equal(s->owner, pthread_self())) {
+    if (pthread_equal(s->owner, pthread_self()) || sem_reader(s) >= 0) {
     	t_errprint_s("sem_seize [%s]: self-deadlock!", s->name);
 	abortsig();
     }	
-    while(!pthread_equal(s->owner, NO_PTHREAD))	/* wait for others to finish */
-	pthread_cond_wait(&s->wait, &s->lock);
+    if (!pthread_equal(s->owner, NO_PTHREAD) || s->readers > 0) {
+	start = msclock();
+	++s->xwaiting;
+	while(!pthread_equal(s->owner, NO_PTHREAD) || s->readers > 0) /* wait for others to finish */
+	    pthread_cond_wait(&s->wait, &s->lock);
+	--s->xwaiting;
+    }
     s->owner = pthread_self();	/* ours now */
+    s->since = now = msclock();
     pthread_mutex_unlock(&s->lock);
+
+    if (s->cls)
+	sem_hist(s->cls->wait[SEM_X], start ? now - start : 0);
 }
 
+/* sem_tryseize --
+
+    Lock semaphore exclusively, but only if that can be done without
+    waiting (and nobody else is waiting for it).  Returns FALSE if not.
+*/
+
+int sem_tryseize(sem *s) {
+
+    int		got;			/* returned: locked it? */
+
+    pthread_mutex_lock(&s->lock);	
+    if (pthread_equal(s->owner, pthread_self()) || sem_reader(s) >= 0) {
+    	t_errprint_s("sem_tryseize [%s]: self-deadlock!", s->name);
+	abortsig();
+    }	
+    got = pthread_equal(s->owner, NO_PTHREAD) && s->readers == 0
+    	  && s->xwaiting == 0 && s->rwaiting == 0;
+    if (got) {
+	s->owner = pthread_self();	/* ours now */
+	s->since = msclock();
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (got && s->cls)
+	sem_hist(s->cls->wait[SEM_X], 0);
+    return got;
+}
+
+/* sem_release -- give up exclusive lock */
+
 void sem_release(sem *s) {
 
+    u_long	held;			/* how long we had it */
+
     pthread_mutex_lock(&s->lock);
     if (!pthread_equal(s->owner, pthread_self())) {
     	t_errprint_s("sem_release [%s]: not our semaphore!", s->name);
 	abortsig();			/* we didn't own it! */
     }
     s->owner = NO_PTHREAD;		/* up for grabs now */
+    held = msclock() - s->since;
+    if (s->rwaiting > 0) {		/* sharers waited for us; their turn */
+	s->rturn = s->rwaiting;		/* (just the ones waiting now) */
+	pthread_cond_broadcast(&s->rwait);
+    } else if (s->xwaiting > 0)
+	pthread_cond_signal(&s->wait);	/* if anyone waiting for it, they can go */
     pthread_mutex_unlock(&s->lock);
-    pthread_cond_signal(&s->wait);	/* if anyone waiting for it, they can go */
+
+    if (s->cls)
+	sem_hist(s->cls->hold[SEM_X], held);
 }
-/* verify that semaphore is seized by current thread */
+
+/* sem_seize_shared --
+
+    Lock semaphore shared:  any number of threads (up to SEM_READMAX) may
+    hold it shared at once, but not while someone has it exclusively.  So
+    that a stream of sharers can't lock out a thread that wants it
+    exclusively, sharers wait if one is waiting -- except that when an
+    exclusive holder releases it, the sharers that were waiting get a turn.
+    The turn is good for as many sharers as were waiting then (rturn), so
+    sharers that keep arriving can't extend it.
+*/
+
+void sem_seize_shared(sem *s) {
+
+    u_long	start = 0;		/* when we started waiting */
+    u_long	now;
+
+    pthread_mutex_lock(&s->lock);	
+    if (pthread_equal(s->owner, pthread_self()) || sem_reader(s) >= 0) {
+    	t_errprint_s("sem_seize_shared [%s]: self-deadlock!", s->name);
+	abortsig();
+    }	
+    if (!pthread_equal(s->owner, NO_PTHREAD) || s->readers == SEM_READMAX
+     || s->xwaiting > 0) {		/* (newcomers don't share a turn) */
+	start = msclock();
+	++s->rwaiting;
+	while(!pthread_equal(s->owner, NO_PTHREAD) || s->readers == SEM_READMAX
+	    || (s->xwaiting > 0 && s->rturn == 0))
+	    pthread_cond_wait(&s->rwait, &s->lock);
+	--s->rwaiting;
+	if (s->rturn > 0)
+	    --s->rturn;			/* one more of the batch is in */
+    }
+    s->reader[s->readers] = pthread_self();
+    s->rsince[s->readers++] = now = msclock();
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->cls)
+	sem_hist(s->cls->wait[SEM_S], start ? now - start : 0);
+}
+
+/* sem_release_shared -- give up shared lock */
+
+void sem_release_shared(sem *s) {
+
+    int		i;
+    u_long	held;			/* how long we had it */
+
+    pthread_mutex_lock(&s->lock);
+    if ((i = sem_reader(s)) < 0) {
+    	t_errprint_s("sem_release_shared [%s]: not our semaphore!", s->name);
+	abortsig();			/* we didn't have it! */
+    }
+    held = msclock() - s->rsince[i];
+    --s->readers;			/* fill hole with last entry */
+    s->reader[i] = s->reader[s->readers];
+    s->rsince[i] = s->rsince[s->readers];
+    if (s->readers == 0 && s->xwaiting > 0)
+	pthread_cond_signal(&s->wait);	/* last one out lets locker in */
+    else if (s->rwaiting > 0)
+	pthread_cond_signal(&s->rwait);	/* (room in reader table) */
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->cls)
+	sem_hist(s->cls->hold[SEM_S], held);
+}
+
+/* sem_downgrade --
+
+    Exchange our exclusive lock for a shared one, without letting anyone
+    else get it exclusively in between (e.g., after loading data that
+    sharers will then read).
+*/
+
+void sem_downgrade(sem *s) {
+
+    u_long	now;
+
+    pthread_mutex_lock(&s->lock);
+    if (!pthread_equal(s->owner, pthread_self())) {
+    	t_errprint_s("sem_downgrade [%s]: not our semaphore!", s->name);
+	abortsig();			/* we didn't own it! */
+    }
+    s->owner = NO_PTHREAD;
+    now = msclock();
+    s->reader[0] = pthread_self();	/* (table's empty) */
+    s->rsince[0] = now;
+    s->readers = 1;
+    if (s->rwaiting > 0) {		/* others may share too */
+	s->rturn = s->rwaiting;
+	pthread_cond_broadcast(&s->rwait);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->cls)
+	sem_hist(s->cls->hold[SEM_X], now - s->since);
+}
+
+/* verify that semaphore is seized (exclusively) by current thread */
 
 void sem_check(sem *s) {
 
@@ -75,10 +280,22 @@ void sem_check(sem *s) {
     pthread_mutex_unlock(&s->lock);
 }
 
+/* verify that current thread has semaphore, either shared or exclusively */
+
+void sem_check_shared(sem *s) {
+
+    pthread_mutex_lock(&s->lock);
+    if (!pthread_equal(s->owner, pthread_self()) && sem_reader(s) < 0) {
+    	t_errprint_s("sem_check_shared [%s]: semaphore not seized!", s->name);
+	abortsig();			/* we don't have it! */
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
 /* clean up semaphore (before freeing) */
 void sem_destroy(sem *s) {
 
-    if (!pthread_equal(s->owner, NO_PTHREAD)) {
+    if (!pthread_equal(s->owner, NO_PTHREAD) || s->readers > 0) {
      	t_errprint_s("sem_destroy [%s]: destroying locked sem!", s->name);
 	abortsig();   
     }
@@ -86,6 +303,7 @@ void sem_destroy(sem *s) {
     /* tell pthread package to clean up */
     pthread_mutex_destroy(&s->lock);
     pthread_cond_destroy(&s->wait);
+    pthread_cond_destroy(&s->rwait);
     
     /* it's now safe for caller to free the sem */
 }
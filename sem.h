@@ -10,18 +10,52 @@
 #define _T_SEM_H
 
 #define SEM_NAMEMAX 32
+#define SEM_READMAX 8			/* most threads sharing a semaphore */
+
+/* Semaphores with the same name are a class; the time taken to seize
+   them and the time they're held are kept as histograms by class and
+   mode (exclusive or shared).  Bucket 0 is < 1 ms, bucket i is
+   [2^(i-1), 2^i) ms, and the last bucket is everything longer. */
+#define SEM_CLASSMAX	16
+#define SEM_HISTMAX	14
+#define SEM_X		0		/* exclusive */
+#define SEM_S		1		/* shared */
+struct semclass {
+    char		name[SEM_NAMEMAX];
+    u_long		wait[2][SEM_HISTMAX];	/* time to seize, by mode */
+    u_long		hold[2][SEM_HISTMAX];	/* time held, by mode */
+};
+typedef struct semclass semclass;
+
+struct semclass	sem_class[SEM_CLASSMAX];
+int		sem_classcount;
+
 struct sem {
     char		name[SEM_NAMEMAX]; /* for error messages only */
     pthread_mutex_t	lock;		/* protects the entire semaphore */
     pthread_cond_t	wait;		/* threads waiting to lock */
+    pthread_cond_t	rwait;		/* threads waiting to share */
     pthread_t		owner;		/* thread that has it now */
+    u_long		since;		/* when they got it (msclock) */
+    int			readers;	/* threads sharing it */
+    pthread_t		reader[SEM_READMAX];	/* (who they are) */
+    u_long		rsince[SEM_READMAX];	/* (and since when) */
+    int			xwaiting;	/* threads waiting to lock */
+    int			rwaiting;	/* threads waiting to share */
+    int			rturn;		/* waiting sharers still to let past xwaiting */
+    semclass		*cls;		/* stats (NULL if table full) */
 };
 typedef struct sem sem;
 
 void sem_seize(sem *s);
+int sem_tryseize(sem *s);
 void sem_release(sem *s);
+void sem_seize_shared(sem *s);
+void sem_release_shared(sem *s);
+void sem_downgrade(sem *s);
 void sem_init(sem *s, char *name);
 void sem_check(sem *s);
+void sem_check_shared(sem *s);
 void sem_destroy(sem *s);
 void abortsig();
 #endif
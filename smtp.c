@@ -95,7 +95,7 @@ void smtp_init() {
 /* smtplisten --
 
     Set up a socket listening for smtp connections.  When one arrives,
-    accept it and spawn a thread to deal with it.
+    accept it and hand it to a worker thread.
 */
 
 any_t smtplisten (any_t zot) {
@@ -108,7 +108,6 @@ any_t smtplisten (any_t zot) {
     int			on = 1;	/* for setsockopt */
     smtpstate		*smtp = NULL; /* connection state */
     static t_file	listen_f; /* t_file for listening socket */
-    pthread_t		thread;	/* thread var */   
     static char	 	logbuf[MAX_STR];
     
     setup_signals();		/* set up signal handlers for new thread */
@@ -182,6 +181,7 @@ any_t smtplisten (any_t zot) {
 	    
 	t_fdopen(&smtp->conn, connfd);		/* set up t_file for the conn */
 	strcpy(smtp->conn.name, "Incoming SMTP"); /* set up name (debugging) */
+	smtp->conn.kind = T_KIND_SMTP;	/* (for buffer stats) */
 	smtp->conn.select = TRUE;	/* t_select should check this fd */
 	
 	pthread_mutex_lock(&global_lock);
@@ -191,18 +191,16 @@ any_t smtplisten (any_t zot) {
 	if (smtp_num >= smtp_max)
 	    t_errprint("All SMTP connections in use...\n");
 	
-	if (pthread_create(&thread, generic_attr, 
-		(pthread_startroutine_t) smtp_serv, (pthread_addr_t) smtp) < 0) {
-	    t_perror("smtplisten: pthread_create");
-	    if (t_closefd(smtp->conn.fd) < 0)	/* couldn't create thread, close conn */
+	if (!work_dispatch((pthread_startroutine_t) smtp_serv, (pthread_addr_t) smtp)) {
+	    t_fprintf(&smtp->conn, "%d %s busy; try again later.\r\n",
+	    		SMTP_SHUTDOWN, m_fullservname);
+	    t_fflush(&smtp->conn);
+	    if (t_closefd(smtp->conn.fd) < 0)	/* no worker for it, close conn */
 		t_perror("smtplisten: close");
 	    t_free(smtp);
 	    pthread_mutex_lock(&global_lock);
-	    --smtp_num;			/* connection failed; decrement count */
+	    --smtp_num;			/* connection refused; decrement count */
 	    pthread_mutex_unlock(&global_lock);
-	    sleep(5);
-	} else {
-	    pthread_detach(&thread);
 	}
 	
 	smtp = NULL;			/* it's their state now */
@@ -235,7 +233,7 @@ any_t smtp_serv(any_t smtp_) {
     smtp->peer = -1;
     
     /* set a timeout to get rid of connections from dead hosts */
-    smtp->conn.timeout = smtp_timeout * 60; /* (seconds) */
+    t_settimeout(&smtp->conn, smtp_timeout * 60, FALSE); /* (seconds) */
     
     if (smtp_debug) {
     	t_sprintf(logbuf, "[%d] starting thread", smtp);
@@ -521,7 +519,7 @@ void smtp_data(smtpstate *smtp) {
 			summ->totallen, summ->enclosures);
     pthread_mutex_unlock(&inet_ntoa_lock);
     log_it(line);
-    ++m_recv_smtp;				/* statistics: count incoming smtp */
+    STAT_INC(m_recv_smtp);			/* statistics: count incoming smtp */
         
     /* log each recipient 
        Note that "nosend" recipients *are* logged, to facilitate tracking
@@ -1267,7 +1265,7 @@ void smtp_xbtz(smtpstate *smtp) {
     t_sprintf(logbuf, "Incoming Blitz %ld from %s; %ld bytes, %ld encls, qid %ld.",
     			 messid, sender, mi.finfo.len, enclcount, qid);
     log_it(logbuf);
-    ++m_recv_blitz;			/* statistics: count incoming blitzmessages */
+    STAT_INC(m_recv_blitz);		/* statistics: count incoming blitzmessages */
     	
     wake_queuethread(m_thisserv, qid); 	/* nudge task that serves queue */
     
@@ -1860,6 +1858,7 @@ void recv_mess(smtpstate *smtp, mbox *mb) {
     ok = fold_addsum(mb, fold, &summ);
     if (ok) {				/* update box length total */
 	mb->boxlen += summ.totallen;
+	++mb->messcount;
     }
     sem_release(&mb->mbsem);
 
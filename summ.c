@@ -5,13 +5,20 @@
     
     $Header: /users/davidg/source/blitzserver/RCS/summ.c,v 3.6 98/10/21 16:10:46 davidg Exp Locker: davidg $
 
-    Message summaries are stored in text files in the user's mailbox directory,
-    one file for each folder.  The format of the files the same as is sent to 
-    the client in response to SUMM or MSUM commands.  
+    Message summaries are stored in files in the user's mailbox directory,
+    one file for each folder.  The files are binary (see SUMM_BMAGIC in
+    mbox.h), so reading one is a single mmap and a copy.  Older servers
+    wrote text files in the same format as is sent to the client in
+    response to SUMM or MSUM commands; those are still read, and are
+    rewritten in binary form.
         
     While the user is connected, summaries are kept in memory in a bucketed
-    linked list.  Changes are made to the in-memory copy, which is periodically
-    written back out (the entire file is rewritten).
+    linked list.  Changes are made to the in-memory copy, and also queued
+    as journal records; periodically the records are appended to the
+    folder's journal file.  Only when the journal gets long relative to the
+    summary file is the entire file rewritten (see SUMM_JMAGIC in mbox.h).  Each in-memory folder
+    also has a hash index from messid to bucket & summary, so messages can
+    be located without walking the buckets.
     
     New messages always appear at the end of the folder.  If a message is
     deleted and then undeleted, the summary will be placed at the end of the
@@ -33,6 +40,10 @@
 #include <sys/dir.h>
 #include <sys/errno.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+#ifndef __NeXT__
+#include <sys/mman.h>
+#endif
 #include "t_io.h"
 #include "mbox.h"
 #include "t_err.h"
@@ -52,7 +63,26 @@ boolean_t fold_delsum(mbox *mb, folder *fold, long messid, summinfo *outsumm);
 void fold_fname(char *fname, mbox *mb, folder *fold);
 void summ_write(mbox *mb, folder *fold);
 int summ_packed_len(summinfo *summ);
-void summ_squeeze(folder *fold, summbuck *p, summinfo *summ);
+void summ_kill(folder *fold, summbuck *p, summinfo *summ);
+void summ_compact(folder *fold, summbuck *p);
+void fold_compact(folder *fold);
+static messent *messidx_find(messidx *idx, long messid);
+static void messidx_add(messidx *idx, long messid, int foldnum, summbuck *buck, summinfo *summ);
+static void messidx_remove(messidx *idx, messent *e);
+static void fold_index(folder *fold);
+static void box_unindex(mbox *mb, folder *fold, long messid);
+static void box_index(mbox *mb);
+static void fold_dirty(folder *fold);
+static void summ_remove(folder *fold, summbuck *p, summinfo *summ);
+static void summ_jadd(folder *fold, summinfo *summ);
+static void summ_jdel(folder *fold, long messid);
+static void summ_jlog(folder *fold, long type, char *body, long len);
+static void fold_jname(char *jname, mbox *mb, folder *fold);
+static void posidx_free(folder *fold);
+static void posidx_build(folder *fold);
+static void posidx_adjust(folder *fold, summbuck *p, long delta);
+static void posidx_newbuck(folder *fold, summbuck *p);
+static void posidx_freebuck(folder *fold, summbuck *p);
 static void fold_list1(mbox *mb, long foldnum, boolean_t last);
 void sort_messlist(summent *sum, int count);
 
@@ -69,6 +99,7 @@ void empty_folder(mbox *mb, folder *fold) {
 
     summinfo	summ;			/* summary info of current message */
     summinfo	*summp;
+    summbuck	*p;			/* bucket it's in */
     
     sem_check(&mb->mbsem);
     
@@ -77,11 +108,10 @@ void empty_folder(mbox *mb, folder *fold) {
 	
     /* delete first message until empty */
     while(fold->count > 0) {
-	if (fold->summs == NULL || fold->summs->used == 0) {
+	if ((summp = fold_seek(fold, 1, &p)) == NULL) { /* first summary in folder */
 	    t_errprint_ll("empty_folder: folder %ld inconsistent uid = %ld", fold->num, mb->uid);
 	    break;			/* don't spin if count bogus or bucket empty */
 	}
-	summp = (summinfo *) fold->summs->data; /* first summary in folder */
 	fold_delsum(mb, fold, summp->messid, &summ);
 	(void) mess_rem(mb, summ.messid, summ.totallen); /* delete message file */
     }
@@ -121,6 +151,7 @@ boolean_t summ_copymess(mbox *mb, folder *from, folder *to, long *messid, long n
 	    (void) fold_addsum(mb, to, &newsumm);
 	    *messid = newsumm.messid;	/* return the new id */
 	    mb->boxlen += newsumm.totallen;	/* update box length */
+	    ++mb->messcount;
 	    ok = TRUE;
 	} else {
 	    t_perror1("summ_copymess: cannot create ", newname); 	
@@ -179,8 +210,8 @@ boolean_t summ_move(mbox *mb, folder *from, folder *to, long messid, long newexp
 
 /* fold_addsum --
 
-    Add new summary to folder.  Search folder to see if summary is already there; 
-    if not, add to end of folder. Add length to fold->foldlen.
+    Add new summary to folder.  Check the folder's index to see if summary is
+    already there; if not, add to end of folder. Add length to fold->foldlen.
         
     --> box locked <--
 */
@@ -189,44 +220,44 @@ boolean_t fold_addsum(mbox *mb, folder *fold, summinfo *insumm) {
 
     summbuck	*p, *q;			/* bucket temps */
     summinfo	*summ;			/* place for summary in bucket */
-    char	*nextsum;		/* to locate next summary */
 
     sem_check(&mb->mbsem);
 
     if (fold->summs == NULL)		/* read summaries in, if necessary */
 	summ_read(mb, fold);
 	
-    /* search for matching messid */   
-    for (q = NULL, p = fold->summs; p != NULL; q = p, p = p->next) {
-	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
-	    summ = (summinfo *) nextsum;
-	    if (summ->messid == insumm->messid) {
-		return FALSE;		/* already there; don't add */
-	    }
-	}
-    }
+    if (messidx_find(&fold->idx, insumm->messid) != NULL)
+	return FALSE;			/* already there; don't add */
     
-    p = q;				/* back up to last bucket */
+    p = fold->last;			/* add to last bucket */
+    if (summ_packed_len(insumm) + p->used > SUMMBUCK_LEN && p->dead > 0)
+	summ_compact(fold, p);		/* make room, if dead ones are taking it */
 
     /* see if room; get new bucket if not */
     if (summ_packed_len(insumm) + p->used > SUMMBUCK_LEN) {
-	q = (summbuck *) mallocf(sizeof(summbuck));
-    	pthread_mutex_lock(&global_lock);
-    	++malloc_stats.summbuck;
-    	pthread_mutex_unlock(&global_lock);
+	q = (summbuck *) slab_alloc(SLAB_SUMMBUCK);
+    	STAT_INC(malloc_stats.summbuck);
 	q->next = NULL;
-	q->count = q->used = 0;    
+	q->count = q->used = q->dead = 0;    
 	p->next = q;
 	p = q;	    
+	fold->last = p;
+	posidx_newbuck(fold, p);
     }
 
     summ = (summinfo *) &p->data[p->used]; /* calculate where next one goes */
     summ_copy(summ, insumm, TRUE);	/* copy summary info, packing */
     p->used += summ->len;		/* update valid length */
     p->count++;				/* one more in this bucket */
+    posidx_adjust(fold, p, 1);
     fold->count++;			/* and in folder as a whole */
     fold->foldlen += summ->totallen;	/* length of all messages in folder */
-    fold->dirty = TRUE;			/* folder has been modified */
+    fold_dirty(fold);			/* folder has been modified */
+    summ_jadd(fold, summ);
+    messidx_add(&fold->idx, summ->messid, fold->num, p, summ);
+    if (mb->indexed)
+	messidx_add(&mb->messfold, summ->messid, fold->num, NULL, NULL);
+    expidx_add(mb, fold->num, summ);	/* note when it's due to expire */
     
     return TRUE;			/* added ok */
 }
@@ -318,41 +349,56 @@ cleanup:
 
 boolean_t fold_delsum(mbox *mb, folder *fold, long messid, summinfo *outsumm) {
 
-    summbuck	*p, *pp;		/* current & previous bucket */
+    summbuck	*p;			/* bucket summary is in */
     summinfo	*summ;			/* summary in bucket */
-    char	*nextsum;		/* to locate next summary */
+    messent	*e;			/* its index entry */
 
     sem_check(&mb->mbsem);
     
     if (fold->summs == NULL)		/* read summaries in, if necessary */
 	summ_read(mb, fold);
 	
-    /* linear search for matching messid */   
-    for (pp = NULL, p = fold->summs; p != NULL; pp = p, p = p->next) {
-	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
-	    summ = (summinfo *) nextsum;
-	    if (summ->messid == messid) {
-		summ_copy(outsumm, summ, FALSE); /* copy the summary */
-		summ_squeeze(fold, p, summ); /* and remove it from the bucket */
-		summ = NULL;		/* sppml */
-		
-		/* delete empty bucket iff it's not the last one */
-		if (p->used == 0 && (pp || p->next)) {
-		    if (pp)	
-			pp->next = p->next;
-		    else fold->summs = p->next;
-		    t_free((char *) p);
-    		    pthread_mutex_lock(&global_lock);
-		    --malloc_stats.summbuck;
-		    pthread_mutex_unlock(&global_lock);
-		}
-		fold->foldlen -= outsumm->totallen; /* update folder length */
-		return TRUE;		/* all set! */
-	    }
-	}				/* (end of one bucket) */
-    }					/* (end of entire list) */
-    
-    return FALSE;			/* not found */
+    if ((e = messidx_find(&fold->idx, messid)) == NULL)
+	return FALSE;			/* not found */
+    p = e->buck;
+    summ = e->summ;
+    
+    summ_copy(outsumm, summ, FALSE);	/* copy the summary */
+    summ_remove(fold, p, summ);		/* and remove it from the folder */
+    box_unindex(mb, fold, messid);
+    return TRUE;			/* all set! */
+}
+
+/* summ_remove --
+
+    Remove a summary from its bucket (adjusting folder length), and free
+    the bucket if it's now empty, unless it's the only one.  Otherwise, the
+    bucket is compacted once more than half of it is dead space.
+
+    --> box locked <--
+*/
+
+static void summ_remove(folder *fold, summbuck *p, summinfo *summ) {
+
+    summbuck	*pp, *q;		/* previous bucket; temp */
+
+    fold->foldlen -= summ->totallen;	/* update folder length */
+    summ_kill(fold, p, summ);		/* remove it from the bucket (& index) */
+
+    /* delete empty bucket iff it's not the only one */
+    if (p->count == 0 && (p != fold->summs || p->next)) {
+	for (pp = NULL, q = fold->summs; q != p; pp = q, q = q->next)
+	    ;				/* find predecessor */
+	if (pp)	
+	    pp->next = p->next;
+	else fold->summs = p->next;
+	if (fold->last == p)
+	    fold->last = pp;
+	posidx_freebuck(fold, p);
+	slab_free(SLAB_SUMMBUCK, p);
+    	STAT_DEC(malloc_stats.summbuck);
+    } else if (2 * p->dead > p->used)	/* mostly tombstones; reclaim space */
+	summ_compact(fold, p);
 }
 /* fold_fname --
     
@@ -378,6 +424,46 @@ void fold_fname(char *fname, mbox *mb, folder *fold) {
 	escname(fold->name, fname);			/* append escaped folder name */
     }
 }
+/* fold_rdlock --
+
+    Seize the box shared, to read a folder's summaries (or, if "fold" is
+    NULL, every folder's) alongside other readers.  Reading them in, or
+    building the positional index, changes the box; if either is needed,
+    seize it exclusively to do that first.  Release with
+    sem_release_shared.
+*/
+
+void fold_rdlock(mbox *mb, folder *fold) {
+
+    int		i;
+    boolean_t	ready;			/* nothing to load? */
+
+    sem_seize_shared(&mb->mbsem);
+    if (fold)
+	ready = fold->summs != NULL && fold->pos.size > 0;
+    else {
+	for (i = 0, ready = TRUE; i < mb->foldmax && ready; ++i)
+	    ready = mb->fold[i].num < 0 || mb->fold[i].summs != NULL;
+    }
+    if (ready)
+	return;				/* the usual case */
+    sem_release_shared(&mb->mbsem);
+
+    sem_seize(&mb->mbsem);
+    if (fold) {
+	if (fold->summs == NULL)	/* get summaries, if not yet present */
+	    summ_read(mb, fold);
+	if (fold->pos.size == 0)
+	    posidx_build(fold);
+    } else {
+	for (i = 0; i < mb->foldmax; ++i) {
+	    if (mb->fold[i].num >= 0 && mb->fold[i].summs == NULL)
+		summ_read(mb, &mb->fold[i]);
+	}
+    }
+    sem_downgrade(&mb->mbsem);		/* let other readers in */
+}
+
 /* fold_list --
     
     Return a list of all folder names, numbers, and message counts, and
@@ -389,7 +475,7 @@ void fold_list(mbox *mb, long foldnum) {
     long		i;
     boolean_t		last;		/* last line of output? */
     
-    sem_seize(&mb->mbsem);
+    fold_rdlock(mb, NULL);		/* (reading only) */
 
     buf_init(mb);			/* buffer up output until box unlocked */
 
@@ -403,7 +489,7 @@ void fold_list(mbox *mb, long foldnum) {
 	    fold_list1(mb, i, last);	/* do each folder in turn */
 	}    
     }
-    sem_release(&mb->mbsem);   
+    sem_release_shared(&mb->mbsem);   
     buf_flush(mb);			/* ok to write now */
        
 }
@@ -422,8 +508,7 @@ static void fold_list1(mbox *mb, long foldnum, boolean_t last) {
     else 
     	buf_putsta(mb, BLITZ_MOREDATA);
 
-    if (mb->fold[foldnum].summs == NULL)  /* get summaries into memory (to count them) */
-	summ_read(mb, &mb->fold[foldnum]);
+    /* (fold_rdlock has read in the summaries, to count them) */
     /* generate <fold #>,<size>,<name>,<bytes> for each folder */
     t_sprintf(buf, "%d,%d,", mb->fold[foldnum].num, mb->fold[foldnum].count); 
     bufp = buf + strlen(buf);
@@ -451,6 +536,10 @@ void fold_remove(mbox *mb, folder *fold) {
     if (unlink(fname) < 0) {
 	t_perror1("fold_remove: cannot unlink ",fname);	
     }
+    fold_jname(fname, mb, fold);	/* and its journal */
+    if (unlink(fname) < 0 && pthread_errno() != ENOENT) {
+	t_perror1("fold_remove: cannot unlink ",fname);	
+    }
     summ_free(mb, fold);		/* free all summaries */
     fold->num = -1;			/* folder number may be reused */
   
@@ -477,6 +566,8 @@ boolean_t fold_rename(mbox *mb, int foldnum, char *fname) {
     boolean_t	ok = FALSE;
     char	oldname[FILENAME_MAX];
     char	newname[FILENAME_MAX];
+    char	oldjname[FILENAME_MAX];	/* journal names */
+    char	newjname[FILENAME_MAX];
     
     sem_seize(&mb->mbsem);	/* lock the mailbox */
 
@@ -490,17 +581,159 @@ boolean_t fold_rename(mbox *mb, int foldnum, char *fname) {
     }
     
     fold_fname(oldname, mb, &mb->fold[foldnum]);    
+    fold_jname(oldjname, mb, &mb->fold[foldnum]);    
     strcpy(mb->fold[foldnum].name, fname);	/* change name in memory */
     fold_fname(newname, mb, &mb->fold[foldnum]);
+    fold_jname(newjname, mb, &mb->fold[foldnum]);
     
-    if (rename(oldname, newname) == 0)		/* rename disk file */
+    if (rename(oldname, newname) == 0) {	/* rename disk file */
 	ok = TRUE;
+	if (rename(oldjname, newjname) < 0 && pthread_errno() != ENOENT)
+	    t_perror1("fold_rename: cannot rename ", oldjname);
+    }
 
 cleanup:
     sem_release(&mb->mbsem);	/* done with the mailbox */
     return ok;
 }
 
+/* posidx_free --
+
+    Discard a folder's positional index (it'll be rebuilt when needed).
+*/
+
+static void posidx_free(folder *fold) {
+
+    if (fold->pos.size > 0) {
+	t_free(fold->pos.buck);
+	t_free(fold->pos.tree);
+    }
+    fold->pos.size = fold->pos.used = 0;
+    fold->pos.buck = NULL;
+    fold->pos.tree = NULL;
+}
+
+/* posidx_build --
+
+    Build a folder's positional index:  give each bucket a slot (leaving
+    room for the folder to double), and sum up the counts.
+*/
+
+static void posidx_build(folder *fold) {
+
+    posidx	*pos = &fold->pos;
+    summbuck	*p;			/* current bucket */
+    long	nbuck = 0;		/* number of buckets */
+    long	i, j;
+
+    posidx_free(fold);
+
+    for (p = fold->summs; p != NULL; p = p->next)
+	++nbuck;
+    for (pos->size = 16; pos->size < 2 * nbuck; pos->size *= 2)
+	;				/* (power of 2, for fold_seek) */
+    pos->buck = (summbuck **) mallocf(pos->size * sizeof(summbuck *));
+    pos->tree = (long *) mallocf((pos->size + 1) * sizeof(long));
+    bzero((char *) pos->tree, (pos->size + 1) * sizeof(long));
+
+    for (p = fold->summs; p != NULL; p = p->next) {
+	p->slot = pos->used++;
+	pos->buck[p->slot] = p;
+	pos->tree[p->slot + 1] = p->count;
+    }
+
+    /* turn counts into partial sums, bottom up */
+    for (i = 1; i <= pos->size; ++i) {
+	j = i + (i & -i);		/* parent */
+	if (j <= pos->size)
+	    pos->tree[j] += pos->tree[i];
+    }
+}
+
+/* posidx_adjust --
+
+    A bucket's count has changed by "delta"; update the partial sums.
+*/
+
+static void posidx_adjust(folder *fold, summbuck *p, long delta) {
+
+    long	i;
+
+    if (fold->pos.size == 0)		/* not built */
+	return;
+    for (i = p->slot + 1; i <= fold->pos.size; i += i & -i)
+	fold->pos.tree[i] += delta;
+}
+
+/* posidx_newbuck --
+
+    A bucket has been added to the end of the folder; give it a slot.
+*/
+
+static void posidx_newbuck(folder *fold, summbuck *p) {
+
+    if (fold->pos.size == 0)		/* not built */
+	return;
+    if (fold->pos.used == fold->pos.size) {
+	posidx_free(fold);		/* full; start over next time */
+	return;
+    }
+    p->slot = fold->pos.used++;
+    fold->pos.buck[p->slot] = p;	/* (count is 0 so far) */
+}
+
+/* posidx_freebuck --
+
+    An (empty) bucket is being freed; vacate its slot.
+*/
+
+static void posidx_freebuck(folder *fold, summbuck *p) {
+
+    if (fold->pos.size > 0)
+	fold->pos.buck[p->slot] = NULL;
+}
+
+/* fold_seek --
+
+    Locate the n'th (1-origin) summary in a folder; return it and (via "bp")
+    the bucket it's in, so the caller can continue from there.  Returns
+    NULL if there's no such summary.
+
+    --> box locked <--
+*/
+
+summinfo *fold_seek(folder *fold, long n, summbuck **bp) {
+
+    posidx	*pos = &fold->pos;
+    long	slot = 0;		/* slots before the one we want */
+    long	step;
+    summbuck	*p;
+    char	*nextsum;		/* to locate next summary */
+
+    if (fold->summs == NULL || n < 1 || n > fold->count)
+	return NULL;
+    if (pos->size == 0)
+	posidx_build(fold);
+
+    /* descend the tree:  find last slot with fewer than n summaries before it */
+    for (step = pos->size; step > 0; step >>= 1) {
+	if (slot + step <= pos->size && pos->tree[slot + step] < n) {
+	    slot += step;
+	    n -= pos->tree[slot];
+	}
+    }
+    if (slot >= pos->used || (p = pos->buck[slot]) == NULL || n > p->count)
+	return NULL;			/* (inconsistent) */
+
+    /* and count over within the bucket (skipping dead ones) */
+    for (nextsum = p->data; ; nextsum += ((summinfo *) nextsum)->len) {
+	if (!SUMM_DEAD((summinfo *) nextsum) && --n == 0)
+	    break;
+    }
+    *bp = p;
+    return (summinfo *) nextsum;
+}
+
 /* fold_size --
 
     Return number of messages in given folder.
@@ -541,10 +774,7 @@ void fold_summary(mbox *mb, folder *fold, long first, long last) {
     summinfo	*summ;			/* current summary in bucket */
     char	*nextsum;		/* to locate next summary */
     
-    sem_seize(&mb->mbsem);
-    
-    if (fold->summs == NULL)		/* get summaries, if not yet present */
-    	summ_read(mb, fold);
+    fold_rdlock(mb, fold);		/* (reading only) */
     
     if (first == -1)			/* handle '$' for last element */
 	first = fold->count;
@@ -552,32 +782,40 @@ void fold_summary(mbox *mb, folder *fold, long first, long last) {
 	last = fold->count;
 	
     if (first < 1 || last > fold->count || first > last) {
-	sem_release(&mb->mbsem);
+	sem_release_shared(&mb->mbsem);
 	print(mb->user, BLITZ_BADARG);	/* first or last out of range */
 	return;
     }
     
     buf_init(mb);			/* buffer up output until box unlocked */
     
-    count = 1;				/* tracks present position */
+    count = first;			/* tracks present position */
     
-    for (p = fold->summs; p != NULL && count <= last; p = p->next) {
-	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+    /* go directly to first one requested; continue from there */
+    if ((summ = fold_seek(fold, first, &p)) != NULL) {
+	nextsum = (char *) summ;
+	while (count <= last) {		/* can stop when we've done last one requested */
 	    summ = (summinfo *) nextsum;
-	    if (count >= first) {	/* iff within requested range */
+	    if (!SUMM_DEAD(summ)) {
 		if (count == last)	/* emit status prefix */
 		    buf_putsta(mb, BLITZ_LASTLINE);
 		else buf_putsta(mb, BLITZ_MOREDATA);
 		
 		summ_fmt(summ, buf);	/* format the summary info */	
 		buf_putl(mb, buf); 	/* and copy line to output buffer */
+		++count;
+	    }
+	    
+	    nextsum += summ->len;
+	    if (nextsum - p->data >= p->used) {	/* on to next bucket */
+		if ((p = p->next) == NULL)
+		    break;
+		nextsum = p->data;
 	    }
-	    if (++count > last)		/* can stop when we've done last one requested */
-	    	break;
 	}
     }    
     
-    sem_release(&mb->mbsem);
+    sem_release_shared(&mb->mbsem);
     
     buf_flush(mb);			/* ok to write now */
 
@@ -601,21 +839,19 @@ long fold_total(mbox *mb, folder *fold) {
     char	*nextsum;		/* to locate next summary */
     long	total = 0;		/* returned: total length */
     
-    sem_seize(&mb->mbsem);
-    
-    if (fold->summs == NULL)		/* get summaries, if not yet present */
-    	summ_read(mb, fold);
+    fold_rdlock(mb, fold);		/* (reading only) */
     
     count = 1;				/* tracks present position */
     
     for (p = fold->summs; p != NULL; p = p->next) {
 	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
 	    summ = (summinfo *) nextsum;
-	    total += summ->totallen;	/* add up all messages */
+	    if (!SUMM_DEAD(summ))
+		total += summ->totallen;	/* add up all messages */
 	}
     }    
     
-    sem_release(&mb->mbsem);
+    sem_release_shared(&mb->mbsem);
     
     return total;
     
@@ -631,30 +867,81 @@ boolean_t foldnum_valid(mbox *mb, int foldnum) {
     return foldnum >= 0 && foldnum < mb->foldmax 
 	&& mb->fold[foldnum].num >= 0;
 }
+/* find_summ --
+
+    Search every folder for a messid; return its summary (and folder).
+    Once the box has been checked, its messid->folder index (built by
+    summ_check, or here the first time if summ_fastcheck skipped that)
+    means only the folder that holds the message is read in; before then
+    (or if the index has seen duplicates and a miss can't be trusted)
+    each folder is tried in turn.
+
+    --> box locked <--
+*/
+
+summinfo *find_summ(mbox *mb, long messid, folder **fold) {
+
+    messent	*e;
+    summinfo	*summ;
+    int		foldnum;
+
+    sem_check(&mb->mbsem);
+
+    if (mb->checked && !mb->indexed)
+	box_index(mb);			/* (first lookup since summ_fastcheck) */
+
+    if (mb->indexed) {
+	if ((e = messidx_find(&mb->messfold, messid)) != NULL) {
+	    *fold = &mb->fold[e->foldnum];
+	    if ((summ = get_summ(mb, messid, fold)) != NULL)
+		return summ;
+	}
+	if (mb->messfold.dups == 0)
+	    return NULL;		/* index is authoritative */
+    }
+
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	if (mb->fold[foldnum].num < 0)	/* skip holes */
+	    continue;
+	*fold = &mb->fold[foldnum];
+	if ((summ = get_summ(mb, messid, fold)) != NULL)
+	    return summ;
+    }
+
+    return NULL;			/* not found */
+}
+
 /* get_summ --
 
     Search for summary info for a given messid;
     return pointer to it (and to folder it was found in).
-    
+
     If folder specified, search just there; otherwise search the
-    InBox and Trash (in that order).
-    
+    InBox and Trash (in that order).  Each folder's messid index
+    makes this a hash lookup; the box's index lets us skip folders
+    that don't have the message (without reading them in).
+
     --> box locked <--
 */
 
 summinfo *get_summ(mbox *mb, long messid, folder **fold) {
 
-    summbuck	*p;			/* current bucket */
-    summinfo	*summ;			/* current summary in bucket */
-    char	*nextsum;		/* to locate next summary */
+    messent	*e;			/* index entry */
     folder	*firstfold, *lastfold;	/* first & last folders to check */
-    
+
 
     sem_check(&mb->mbsem);
-    
+
     if (*fold == NULL) {		/* default - search InBox & trash */
 	firstfold = &mb->fold[INBOX_NUM];
 	lastfold = &mb->fold[TRASH_NUM];
+	if (mb->indexed && mb->messfold.dups == 0) {
+	    /* box index says which (if either) it's in */
+	    if ((e = messidx_find(&mb->messfold, messid)) == NULL
+	     || (e->foldnum != INBOX_NUM && e->foldnum != TRASH_NUM))
+		return NULL;
+	    firstfold = lastfold = &mb->fold[e->foldnum];
+	}
     } else
     	firstfold = lastfold = *fold;	/* check just specified folder */
 
@@ -662,16 +949,10 @@ summinfo *get_summ(mbox *mb, long messid, folder **fold) {
     for (*fold = firstfold ;; *fold = lastfold) {
 	if ((*fold)->summs == NULL)	/* get summaries, if not yet present */
 	    summ_read(mb, *fold);
-	    
-	/* linear search for matching messid */   
-	for (p =(*fold)->summs; p != NULL; p = p->next) {
-	    for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
-		summ = (summinfo *) nextsum;
-		if (summ->messid == messid)
-		    return summ;	/* found it */
-	    }
-	}
-	
+
+	if ((e = messidx_find(&(*fold)->idx, messid)) != NULL)
+	    return e->summ;		/* found it */
+
 	if (*fold == lastfold)
 	    break;			/* give up after trying last */
     }
@@ -679,6 +960,170 @@ summinfo *get_summ(mbox *mb, long messid, folder **fold) {
     return NULL;			/* not found */
 }
 
+/* messidx_init --
+
+    Set up an empty messid index (the table is allocated on first add).
+*/
+
+void messidx_init(messidx *idx) {
+
+    idx->size = idx->count = idx->dups = 0;
+    idx->tab = NULL;
+}
+
+/* messidx_free --
+
+    Release a messid index's table; leave it empty.
+*/
+
+void messidx_free(messidx *idx) {
+
+    if (idx->tab) {
+	t_free(idx->tab);
+	STAT_ADD(malloc_stats.messidx, -idx->size * (long) sizeof(messent));
+    }
+    messidx_init(idx);
+}
+
+/* messidx_slot --
+
+    Locate the slot holding messid, or the empty slot where it would go.
+    (Table is never more than half full, so there's always an empty one.)
+*/
+
+static messent *messidx_slot(messidx *idx, long messid) {
+
+    long	mask = idx->size - 1;
+    long	i;
+
+    for (i = messid & mask; idx->tab[i].foldnum >= 0; i = (i + 1) & mask) {
+	if (idx->tab[i].messid == messid)
+	    break;
+    }
+    return &idx->tab[i];
+}
+
+/* messidx_find --
+
+    Look up a messid; return its entry, or NULL if not there.
+*/
+
+static messent *messidx_find(messidx *idx, long messid) {
+
+    messent	*e;
+
+    if (idx->count == 0)
+	return NULL;
+    e = messidx_slot(idx, messid);
+    return e->foldnum >= 0 ? e : NULL;
+}
+
+/* messidx_add --
+
+    Add an entry, doubling the table first if it would become more than
+    half full.  If the messid is already present, the old entry is left
+    alone and idx->dups counts the one we couldn't add.
+*/
+
+static void messidx_add(messidx *idx, long messid, int foldnum, summbuck *buck, summinfo *summ) {
+
+    messent	*oldtab;		/* table being replaced */
+    long	oldsize;		/* and its size */
+    messent	*e;
+    long	i;
+
+    if (2 * (idx->count + 1) > idx->size) {	/* time to grow? */
+	oldtab = idx->tab;
+	oldsize = idx->size;
+	idx->size = oldsize ? 2 * oldsize : MESSIDX_MINSIZE;
+	idx->tab = (messent *) mallocf(idx->size * sizeof(messent));
+	STAT_ADD(malloc_stats.messidx, (idx->size - oldsize) * (long) sizeof(messent));
+	for (i = 0; i < idx->size; ++i)
+	    idx->tab[i].foldnum = -1;	/* all empty */
+	for (i = 0; i < oldsize; ++i) {	/* rehash the old entries */
+	    if (oldtab[i].foldnum >= 0)
+		*messidx_slot(idx, oldtab[i].messid) = oldtab[i];
+	}
+	if (oldtab)
+	    t_free(oldtab);
+    }
+
+    e = messidx_slot(idx, messid);
+    if (e->foldnum >= 0) {		/* duplicate; keep the first */
+	++idx->dups;
+	return;
+    }
+    e->messid = messid;
+    e->foldnum = foldnum;
+    e->buck = buck;
+    e->summ = summ;
+    ++idx->count;
+}
+
+/* messidx_remove --
+
+    Remove an entry (as returned by messidx_find).  Rather than leaving a
+    tombstone, move later entries of the same probe run back into the hole
+    if their home slot allows it.
+*/
+
+static void messidx_remove(messidx *idx, messent *e) {
+
+    long	mask = idx->size - 1;
+    long	hole;			/* slot being vacated */
+    long	i;			/* slot being considered */
+    long	home;			/* where its key hashes */
+
+    hole = e - idx->tab;
+    for (i = (hole + 1) & mask; idx->tab[i].foldnum >= 0; i = (i + 1) & mask) {
+	home = idx->tab[i].messid & mask;
+	/* entry may move back iff the hole lies between its home and here */
+	if (((i - home) & mask) >= ((i - hole) & mask)) {
+	    idx->tab[hole] = idx->tab[i];
+	    hole = i;
+	}
+    }
+    idx->tab[hole].foldnum = -1;
+    --idx->count;
+}
+
+/* fold_index --
+
+    (Re)build a folder's messid index from its summaries.
+*/
+
+static void fold_index(folder *fold) {
+
+    summbuck	*p;			/* current bucket */
+    summinfo	*summ;			/* current summary in bucket */
+    char	*nextsum;		/* to locate next summary */
+
+    messidx_free(&fold->idx);
+    for (p = fold->summs; p != NULL; p = p->next) {
+	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+	    summ = (summinfo *) nextsum;
+	    if (!SUMM_DEAD(summ))
+		messidx_add(&fold->idx, summ->messid, fold->num, p, summ);
+	}
+    }
+}
+
+/* box_unindex --
+
+    Remove messid from the box's messid->folder index, if it's recorded
+    as being in the given folder.
+
+    --> box locked <--
+*/
+
+static void box_unindex(mbox *mb, folder *fold, long messid) {
+
+    messent	*e;
+
+    if ((e = messidx_find(&mb->messfold, messid)) != NULL && e->foldnum == fold->num)
+	messidx_remove(&mb->messfold, e);
+}
+
 /* set_expr --
 
     Search all folders for specified message.  If found, change the expiration date.
@@ -696,7 +1141,8 @@ boolean_t set_expr(mbox *mb, folder *fold, long messid, u_long expdate) {
     
     if (summ = get_summ(mb, messid, &fold)) {	/* (sic) */
 	summ->expire = expdate; 	/* change the date */
-	fold->dirty = TRUE;		/* folder has changed */
+	summ_changed(fold, summ);	/* folder has changed */
+	expidx_add(mb, fold->num, summ);	/* index the new date */
 	touch_folder(mb, fold);		/* invalidate folder cache */
 	found = TRUE;			/* all set */
     }    
@@ -707,46 +1153,238 @@ boolean_t set_expr(mbox *mb, folder *fold, long messid, u_long expdate) {
 }
 
 
-/* summ_check --
+/* mess_stamp --
 
-    Mailbox consistency check (done when box opened).  Read all folders, create 
-    a sorted list of all summaries.  If a summary appears in both more than one
-    folder, remove it from all but the first.  Read mess directory, create sorted
-    list of all messages actually present.  
-    
-    Compare the lists.  Any summary that refers to a missing message is deleted.
-    If there is a message but no summary, redeliver the message to the Inbox.
-    
-    --> box locked <--
+    Get the mess directory's modification time (the manifest's stamp);
+    0 if there's no mess directory yet.  Returns FALSE if it can't be
+    determined.
 */
 
-void summ_check(mbox *mb) {
+static boolean_t mess_stamp(mbox *mb, long *stamp) {
 
-    summinfo		summbuf;		/* summary info of message */    
-    summent 		*summlist;		/* list of summaries */
-    int			summlcount, summlmax;	/* current & max length */
-    summent 		*summdel;		/* summaries to delete */
-    int			summdcount, summdmax;	/* current & max length */
-    summent		*messlist;		/* list of messages */
-    int			messlcount, messlmax;	/* current & max length */
-    summent		*messnew;		/* list of messages to redeliver */
-    int			messncount, messnmax;	/* current & max length */
-    int			i,j,out;
-    folder		*fold;			/* current folder */
-    summbuck		*bp;			/* current bucket */
-    summinfo		*summ;			/* current summary in bucket */
-    char		*nextsum;		/* to locate next summary */
-    char		fname[FILENAME_MAX];	/* mess directory name */
-    DIR			*messdir;		/* open directory file */
-    struct direct 	*dirp;			/* directory entry */
-    long		messid;			/* current message file id */	
-    char 		logbuf[MAX_STR];	/* log message */
-    boolean_t		changed = FALSE;	/* box changed? */
-    char		*delim;			/* filename terminator */
-    int			foldnum;		/* current folder */
+    char	fname[FILENAME_MAX];	/* mess directory name */
+    struct stat	st;
 
-    sem_check(&mb->mbsem);
-    
+    strcpy(fname, mb->boxname); strcat(fname, MESS_DIR);
+    if (stat(fname, &st) < 0) {
+	if (pthread_errno() != ENOENT) {
+	    t_perror1("mess_stamp: cannot stat ", fname);
+	    return FALSE;
+	}
+	*stamp = 0;			/* no messages yet */
+    } else
+	*stamp = st.st_mtime;
+
+    return TRUE;
+}
+
+/* summ_fastcheck --
+
+    Box is being attached; see if its manifest lets us skip summ_check.
+    It must be there, and the mess directory must not have been modified
+    since it was written.  If so, take the message count and box length
+    from it and mark the box checked (the messid->folder index will be
+    built if & when someone needs it).  Returns FALSE if a full check
+    is needed.
+
+    --> box locked <--
+*/
+
+boolean_t summ_fastcheck(mbox *mb) {
+
+    char	name[FILENAME_MAX];	/* manifest filename */
+    char	buf[MANIFEST_LEN + 1];	/* its contents */
+    int		fd;
+    int		len;
+    long	stamp;			/* current mess directory stamp */
+
+    sem_check(&mb->mbsem);
+
+    t_sprintf(name, "%s%s", mb->boxname, MANIFEST_FNAME);
+    if ((fd = open(name, O_RDONLY)) < 0) {
+	if (pthread_errno() != ENOENT)	/* (none after unclean shutdown) */
+	    t_perror1("summ_fastcheck: cannot open ", name);
+	return FALSE;
+    }
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    if (len != MANIFEST_LEN || bcmp(buf, MANIFEST_MAGIC, SUMM_MAGICLEN) != 0)
+	return FALSE;			/* not a manifest (or a partial one) */
+
+    mb->mfgen = (u_bit32) getnetlong(buf + MF_GEN);	/* keep counting from here */
+
+    if (!mess_stamp(mb, &stamp) || stamp != getnetlong(buf + MF_STAMP))
+	return FALSE;			/* messages have changed since */
+
+    mb->messcount = getnetlong(buf + MF_COUNT);
+    mb->boxlen = getnetlong(buf + MF_BOXLEN);
+    mb->manifest = TRUE;
+    mb->indexed = FALSE;
+    mb->checked = TRUE;			/* summaries are consistent */
+
+    return TRUE;
+}
+
+/* summ_manifest --
+
+    Write the box's manifest, if everything's consistent and on disk:
+    box must have been checked, and have no dirty folders.  If the mess
+    directory was modified too recently for its stamp to be trusted,
+    wait for the next time.
+
+    --> box locked <--
+*/
+
+void summ_manifest(mbox *mb) {
+
+    char	name[FILENAME_MAX];	/* manifest filename */
+    char	buf[MANIFEST_LEN];	/* its contents */
+    int		fd;
+    long	stamp;			/* mess directory stamp */
+    int		foldnum;
+
+    sem_check(&mb->mbsem);
+
+    if (mb->manifest || !mb->checked || mb->gone)
+	return;				/* already there, or can't vouch for box */
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	if (mb->fold[foldnum].num >= 0 && mb->fold[foldnum].dirty)
+	    return;			/* not all written out */
+    }
+    if (!mess_stamp(mb, &stamp) || stamp >= time(NULL) - MANIFEST_SETTLE)
+	return;				/* not settled yet */
+
+    bzero(buf, sizeof(buf));
+    bcopy(MANIFEST_MAGIC, buf, SUMM_MAGICLEN);
+    (void) putnetlong(buf + MF_GEN, mb->mfgen + 1);
+    (void) putnetlong(buf + MF_STAMP, stamp);
+    (void) putnetlong(buf + MF_COUNT, mb->messcount);
+    (void) putnetlong(buf + MF_BOXLEN, mb->boxlen);
+
+    t_sprintf(name, "%s%s", mb->boxname, MANIFEST_FNAME);
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, FILE_ACC)) < 0) {
+	t_perror1("summ_manifest: cannot open ", name);
+	return;
+    }
+    if (write(fd, buf, MANIFEST_LEN) != MANIFEST_LEN) {
+	t_perror1("summ_manifest: error writing ", name);
+	close(fd);
+	(void) unlink(name);		/* don't leave a partial one */
+	return;
+    }
+    close(fd);
+
+    ++mb->mfgen;
+    mb->manifest = TRUE;
+}
+
+/* summ_unmanifest --
+
+    Remove the box's manifest; the summary files are about to change (or
+    the box is to be fully checked again).  Returns FALSE if it's still
+    there.
+
+    --> box locked <--
+*/
+
+boolean_t summ_unmanifest(mbox *mb) {
+
+    char	name[FILENAME_MAX];	/* manifest filename */
+
+    t_sprintf(name, "%s%s", mb->boxname, MANIFEST_FNAME);
+    if (unlink(name) < 0 && pthread_errno() != ENOENT) {
+	t_perror1("summ_unmanifest: cannot unlink ", name);
+	return FALSE;
+    }
+    mb->manifest = FALSE;
+
+    return TRUE;
+}
+
+/* box_index --
+
+    Build the box's messid->folder index.  Every folder must be read in
+    to do it, so it's done by summ_check (which reads them all anyway), or
+    the first time it's needed after summ_fastcheck.
+
+    The message count is left alone:  after summ_fastcheck it's already
+    right (from the manifest, and kept up since), whereas the index may
+    be a message short -- mess_deliver counts a message before its
+    summary is added.  summ_check recounts.
+
+    --> box locked <--
+*/
+
+static void box_index(mbox *mb) {
+
+    folder	*fold;			/* current folder */
+    summbuck	*bp;			/* current bucket */
+    summinfo	*summ;			/* current summary in bucket */
+    char	*nextsum;		/* to locate next summary */
+    int		foldnum;		/* current folder */
+
+    messidx_free(&mb->messfold);
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	fold = &mb->fold[foldnum];
+	if (fold->num < 0)
+	    continue;
+	if (fold->summs == NULL)
+	    summ_read(mb, fold);	/* get summaries, if not yet present */
+	for (bp = fold->summs; bp != NULL; bp = bp->next) {
+	    for (nextsum = bp->data; nextsum - bp->data < bp->used; nextsum += summ->len) {
+		summ = (summinfo *) nextsum;
+		if (!SUMM_DEAD(summ))
+		    messidx_add(&mb->messfold, summ->messid, fold->num, NULL, NULL);
+	    }
+	}
+    }
+    mb->indexed = TRUE;
+}
+
+/* summ_check --
+
+    Mailbox consistency check (done when box opened, unless summ_fastcheck
+    finds a current manifest; or by cty CHECK).  Read all folders, create 
+    a sorted list of all summaries.  If a summary appears in both more than one
+    folder, remove it from all but the first.  Read mess directory, create sorted
+    list of all messages actually present.  
+    
+    Compare the lists.  Any summary that refers to a missing message is deleted.
+    If there is a message but no summary, redeliver the message to the Inbox.
+    
+    --> box locked <--
+*/
+
+void summ_check(mbox *mb) {
+
+    summinfo		summbuf;		/* summary info of message */    
+    summent 		*summlist;		/* list of summaries */
+    int			summlcount, summlmax;	/* current & max length */
+    summent 		*summdel;		/* summaries to delete */
+    int			summdcount, summdmax;	/* current & max length */
+    summent		*messlist;		/* list of messages */
+    int			messlcount, messlmax;	/* current & max length */
+    summent		*messnew;		/* list of messages to redeliver */
+    int			messncount, messnmax;	/* current & max length */
+    int			i,j,out;
+    folder		*fold;			/* current folder */
+    summbuck		*bp;			/* current bucket */
+    summinfo		*summ;			/* current summary in bucket */
+    char		*nextsum;		/* to locate next summary */
+    char		fname[FILENAME_MAX];	/* mess directory name */
+    DIR			*messdir;		/* open directory file */
+    struct direct 	*dirp;			/* directory entry */
+    long		messid;			/* current message file id */	
+    char 		logbuf[MAX_STR];	/* log message */
+    boolean_t		changed = FALSE;	/* box changed? */
+    char		*delim;			/* filename terminator */
+    int			foldnum;		/* current folder */
+
+    sem_check(&mb->mbsem);
+
+    (void) summ_unmanifest(mb);		/* can't vouch for box until we're done */
+    
     /* allocate all 4 lists (grown as needed) */
     summlcount = 0; summlmax = 1000;
     summlist = mallocf(summlmax * sizeof(summent));
@@ -767,11 +1405,13 @@ void summ_check(mbox *mb) {
 	    continue;
 	
 	fold->foldlen = 0;		/* recompute length */
-	if (fold->summs == NULL);
+	if (fold->summs == NULL)
 	    summ_read(mb, fold);	/* get summaries, if not yet present */
 	for (bp = fold->summs; bp != NULL; bp = bp->next) {
 	    for (nextsum = bp->data; nextsum - bp->data < bp->used; nextsum += summ->len) {
 		summ = (summinfo *) nextsum;
+		if (SUMM_DEAD(summ))
+		    continue;
 		if (summlcount == summlmax) { 
 		    summlmax += 1000;	/* need to grow list */
 		    summlist = reallocf(summlist, summlmax * sizeof(summent));
@@ -916,6 +1556,11 @@ void summ_check(mbox *mb) {
     t_free(summdel);
     t_free(messlist);
     t_free(messnew); 
+    
+    /* everything's in memory now; index the whole box by messid */
+    box_index(mb);
+    mb->messcount = mb->messfold.count + mb->messfold.dups;
+    mbox_dirty(mb);			/* (so mbox_dowrite writes the manifest) */
         
     mb->checked = TRUE;			/* summaries are now consistent */
 	
@@ -1156,246 +1801,1073 @@ boolean_t summ_parse(char *buf, summinfo *summ, char *fname, boolean_t pack) {
     return TRUE;
 }
 
-/* summ_read --
+/* summ_append --
+
+    Copy a summary onto the end of folder being read in.  "p" is the
+    last bucket; returns the (possibly new) last bucket.
 
-    Read summaries from file.
-    
-    Allocate first bucket.  If file is present, verify magic header line.
-    Begin reading summaries in (allocating more buckets as needed).
-    
-    Note that if fold->summs is NULL, it means summaries have not yet been
-    read; if the folder is empty, fold->summs will point to an empty bucket.
-    
     --> box locked <--
 */
-void summ_read(mbox *mb, folder *fold) {
-	
-    summbuck	*p;			/* current bucket */
-    summbuck	*q;			/* next one */
-    summinfo	*summ;			/* current summary in bucket */
-    summinfo	insumm;			/* summary read from file */
-    char	fname[FILENAME_MAX];	/* summary filename */
-    char 	buf[SUMMBUCK_LEN];	/* long enough for max summary */
-    t_file	*f;			/* the file */
-
-    sem_check(&mb->mbsem);
-       
-    pthread_mutex_lock(&global_lock);
-    ++mb_stats.summ_r;
-    pthread_mutex_unlock(&global_lock);
-    
-    /* set up initial bucket, even if no summaries */
-    p = (summbuck *) mallocf(sizeof(summbuck));
-    pthread_mutex_lock(&global_lock);
-    ++malloc_stats.summbuck;
-    pthread_mutex_unlock(&global_lock);
 
-    p->next = NULL;
-    p->count = p->used = 0;
-    fold->summs = p;
-    fold->count = 0;
-    fold->foldlen = 0;
-    fold->dirty = FALSE;
-    
-    fold_fname(fname, mb, fold);	/* generate filename */
+static summbuck *summ_append(folder *fold, summbuck *p, summinfo *insumm, char *fname) {
 
-    /* create file if not there */
-    if ((f = t_fopen(fname, O_RDONLY | O_CREAT, FILE_ACC)) == NULL) {
-	t_perror1("summ_read: cannot open", fname);
-    	return;				
-    }
+    summbuck	*q;			/* next bucket */
+    summinfo	*summ;			/* summary in bucket */
 
-    /* consistency check on first line of file */
-    if (t_gets(buf, sizeof(buf), f) == NULL)
-	goto cleanup;			/* no summaries -- easy */
-    if (strcmp(buf, SUMM_MAGIC) != 0) {
-	t_errprint_s("summ_read: bad header line in %s\n", fname);
-	goto cleanup;
-    }
-    
-    /* read summaries in line-by-line */
-    while (t_gets(buf, sizeof(buf), f) != NULL) {
-    
-	if (!summ_parse(buf, &insumm, fname, TRUE)) /* parse summ. info to determine length */
-	    continue;			/* bad summary; skip */
-	
-    	/* see if there's room in current bucket */
-	if (p->used + summ_packed_len(&insumm) > SUMMBUCK_LEN) {
-	    if (p->used == 0) {		/* oops!  too long for a bucket! */
-		t_errprint_s("Summary too long in %s\n", fname);
-		continue;
-	    }
-	    /* get another bucket */
-	    q = (summbuck *) mallocf(sizeof(summbuck));
-    	    pthread_mutex_lock(&global_lock);
-    	    ++malloc_stats.summbuck;
-    	    pthread_mutex_unlock(&global_lock);
-
-	    q->next = NULL;
-	    q->count = q->used = 0;    
-	    p->next = q;
-	    p = q;	    
+    /* see if there's room in current bucket */
+    if (p->used + summ_packed_len(insumm) > SUMMBUCK_LEN) {
+	if (p->used == 0) {		/* oops!  too long for a bucket! */
+	    t_errprint_s("Summary too long in %s\n", fname);
+	    return p;
 	}
-	summ = (summinfo *) &p->data[p->used]; 	/* calculate where next one begins */
-	(void) summ_copy(summ, &insumm, TRUE); 	/* copy summary info (packing) */
-	p->used += summ->len;			/* update valid length */
-	p->count++;				/* one more in this bucket */
-	fold->count++;				/* and in folder as a whole */
-	fold->foldlen += summ->totallen;	/* compute folder length */
+	/* get another bucket */
+	q = (summbuck *) slab_alloc(SLAB_SUMMBUCK);
+	STAT_INC(malloc_stats.summbuck);
+
+	q->next = NULL;
+	q->count = q->used = q->dead = 0;
+	p->next = q;
+	p = q;
+	fold->last = p;
+	posidx_newbuck(fold, p);
     }
+    summ = (summinfo *) &p->data[p->used]; 	/* calculate where next one begins */
+    (void) summ_copy(summ, insumm, TRUE); 	/* copy summary info (packing) */
+    p->used += summ->len;			/* update valid length */
+    p->count++;					/* one more in this bucket */
+    posidx_adjust(fold, p, 1);
+    fold->count++;				/* and in folder as a whole */
+    fold->foldlen += summ->totallen;		/* compute folder length */
+    messidx_add(&fold->idx, summ->messid, fold->num, p, summ);
+
+    return p;
+}
+
+/* summ_heapstr --
+
+    Locate a string in the heap of a binary summary file, making sure
+    it's terminated (and not too long) before we go strcpy'ing it.
+*/
+
+static char *summ_heapstr(char *heap, long heaplen, long off, int max) {
+
+    long	n;			/* bytes available */
+
+    if (off < 0 || off >= heaplen)
+	return NULL;
+    n = heaplen - off;
+    if (n > max)
+	n = max;
+    if (memchr(heap + off, 0, n) == NULL)
+	return NULL;			/* unterminated */
 
-cleanup:  
-    t_fclose(f);				/* close summary file */
+    return heap + off;
 }
 
+/* summ_unpack --
 
-/* summ_write --
+    Set up a summinfo from a binary record.  The string pointers point
+    into the heap, so the result is only good for summ_copy'ing from.
+*/
 
-    Write summaries to file.  Create temp file; rename it.
-    
-    --> mailbox locked <--
+static boolean_t summ_unpack(summinfo *summ, char *rec, char *heap, long heaplen) {
+
+    long	flags;
+
+    summ->messid = getnetlong(rec + SR_MESSID);
+    summ->type = getnetlong(rec + SR_TYPE);
+    summ->totallen = getnetlong(rec + SR_TOTALLEN);
+    summ->enclosures = getnetlong(rec + SR_ENCLOSURES);
+    summ->expire = (u_bit32) getnetlong(rec + SR_EXPIRE);
+    flags = getnetlong(rec + SR_FLAGS);
+    summ->read = (flags & SRF_READ) != 0;
+    summ->receipt = (flags & SRF_RECEIPT) != 0;
+    bcopy(rec + SR_DATE, summ->date, sizeof(summ->date));
+    summ->date[sizeof(summ->date)-1] = 0;
+    bcopy(rec + SR_TIME, summ->time, sizeof(summ->time));
+    summ->time[sizeof(summ->time)-1] = 0;
+
+    summ->sender = summ_heapstr(heap, heaplen, getnetlong(rec + SR_SENDER), MAX_ADDR_LEN);
+    summ->recipname = summ_heapstr(heap, heaplen, getnetlong(rec + SR_RECIPNAME), MAX_ADDR_LEN);
+    summ->topic = summ_heapstr(heap, heaplen, getnetlong(rec + SR_TOPIC), MAX_TOPC_LEN);
+
+    return summ->sender && summ->recipname && summ->topic;
+}
+
+/* summ_pack --
+
+    Generate binary record for a summary.  "off" is the heap offset of
+    the summary's strings; it's advanced past them.
 */
 
-void summ_write(mbox *mb, folder *fold) {
+static void summ_pack(char *rec, summinfo *summ, long *off) {
+
+    bzero(rec, SUMM_RECLEN);
+    (void) putnetlong(rec + SR_MESSID, summ->messid);
+    (void) putnetlong(rec + SR_TYPE, summ->type);
+    (void) putnetlong(rec + SR_TOTALLEN, summ->totallen);
+    (void) putnetlong(rec + SR_ENCLOSURES, summ->enclosures);
+    (void) putnetlong(rec + SR_EXPIRE, summ->expire);
+    (void) putnetlong(rec + SR_FLAGS, (summ->read ? SRF_READ : 0)
+    				    | (summ->receipt ? SRF_RECEIPT : 0));
+    strncpy(rec + SR_DATE, summ->date, sizeof(summ->date) - 1);
+    strncpy(rec + SR_TIME, summ->time, sizeof(summ->time) - 1);
+
+    (void) putnetlong(rec + SR_SENDER, *off);
+    *off += strlen(summ->sender) + 1;
+    (void) putnetlong(rec + SR_RECIPNAME, *off);
+    *off += strlen(summ->recipname) + 1;
+    (void) putnetlong(rec + SR_TOPIC, *off);
+    *off += strlen(summ->topic) + 1;
+}
 
-    char 	buf[SUMMBUCK_LEN];	/* long enough for max summary */
-    summbuck	*p;			/* current bucket */
-    summinfo	*summ;			/* current summary in bucket */
-    char	*nextsum;		/* to locate next summary */
-    t_file	*f;			/* the file */
-    char	fname[FILENAME_MAX];	/* temp filename */
-    char	summname[FILENAME_MAX];	/* summary filename */
-   
-    if (fold->summs == NULL)		/* if never read in, don't write */
-	return;
+/* summ_map --
 
-    pthread_mutex_lock(&global_lock);
-    ++mb_stats.summ_w;
-    pthread_mutex_unlock(&global_lock);
-	
-    /* first, get temp file */  
-    t_sprintf(fname, "%s/.summtemp", mb->boxname);	
+    Get the contents of a summary file into memory:  map it where we
+    can, otherwise just read it.
+*/
 
-    if ((f = t_fopen(fname, O_WRONLY | O_CREAT | O_TRUNC, FILE_ACC)) == NULL) {
-	t_perror("summ_write: open ");
-	return;
-    } 
-    
-    /* begin file with 1 line of version id magic */
-    t_puts(f, SUMM_MAGIC); t_putc(f, '\n');
-    
-    /* for each summary in each bucket */
-    for (p = fold->summs; p != NULL; p = p->next) {
-	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
-	    summ = (summinfo *) nextsum;
-	    summ_fmt(summ, buf);	/* generate ascii version */
-	    t_puts(f, buf);		/* write to temp file */
-	    t_putc(f, '\n');		/* one per line */
-	}
-    }
-    
-    t_fflush(f);			/* flush, so we detect any errors */
-    if (f->t_errno != 0) {
-	t_perror1("summ_write: error writing ", fname);
-	(void) t_fclose(f);
-	unlink(fname);			/* discard the bad file */
-	return;				
+static char *summ_map(int fd, long size) {
+
+    char	*base;
+
+#ifdef __NeXT__
+    base = mallocf(size);
+    if (read(fd, base, size) != size) {
+	t_free(base);
+	base = NULL;
     }
-    (void) t_fclose(f);
+#else
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == (char *) MAP_FAILED)
+	base = NULL;
+#endif
 
-    /* now generate result filename */
-    fold_fname(summname, mb, fold);	/* generate filename */
-    
-    if (rename(fname, summname) < 0)	/* move temp to result file */
-	t_perror1("summ_write: rename failed: ", summname);
-    else
-        fold->dirty = FALSE;
+    return base;
 }
 
-/* summ_free --
+static void summ_unmap(char *base, long size) {
 
-    Free storage used by summaries.
-    
-    --> mailbox locked <--
+#ifdef __NeXT__
+    t_free(base);
+#else
+    (void) munmap(base, size);
+#endif
+}
+
+/* summ_loadbin --
+
+    Load summaries from a (mapped) binary summary file.  No parsing; just
+    range checks and a copy of each record into the buckets.
 */
 
-void summ_free(mbox *mb, folder *fold) {
+static void summ_loadbin(folder *fold, char *base, long size, char *fname) {
 
     summbuck	*p;			/* current bucket */
-       
-    /* free each bucket in the folder */
-    while (p = fold->summs) {		/* (sic) */
-    	fold->summs = p->next;
-	t_free(p);
-        pthread_mutex_lock(&global_lock);
-        --malloc_stats.summbuck;
-        pthread_mutex_unlock(&global_lock);
+    summinfo	insumm;			/* current record, unpacked */
+    long	count;			/* number of records */
+    long	reclen;			/* record size */
+    long	heaplen;		/* string heap size */
+    char	*rec;			/* current record */
+    char	*heap;			/* the strings */
+    long	i;
+
+    if (size < SUMM_HDRLEN || getnetlong(base + SH_VERS) != SUMM_BVERS) {
+	t_errprint_s("summ_read: bad binary header in %s\n", fname);
+	return;
+    }
+    count = getnetlong(base + SH_COUNT);
+    reclen = getnetlong(base + SH_RECLEN);
+    heaplen = getnetlong(base + SH_HEAPLEN);
+    fold->jgen = (u_bit32) getnetlong(base + SH_GEN);
+
+    /* make sure it's all there (check count first, to avoid overflow) */
+    if (count < 0 || reclen < SUMM_RECLEN || heaplen < 0
+     || count > (size - SUMM_HDRLEN) / reclen
+     || heaplen > size - SUMM_HDRLEN - count * reclen) {
+	t_errprint_s("summ_read: truncated summary file %s\n", fname);
+	return;
+    }
+    heap = base + SUMM_HDRLEN + count * reclen;
 
-    }	
+    p = fold->summs;
+    for (i = 0, rec = base + SUMM_HDRLEN; i < count; ++i, rec += reclen) {
+	if (!summ_unpack(&insumm, rec, heap, heaplen)) {
+	    t_errprint_s("summ_read: bad record in %s\n", fname);
+	    continue;			/* skip it */
+	}
+	p = summ_append(fold, p, &insumm, fname);
+    }
 }
 
-/* summ_squeeze --
+/* summ_loadtext --
 
-    Squeeze a summary out of a bucket.  Slide any subsequent
-    summaries in the bucket down to fill the hole.  Relocate
-    pointers within the summary struct to account for the move.
-    Adjust bucket length, and bucket/folder counts.
-    
-    Note: empty buckets should _not_ be left allocated to the folder
-    list (except for the special case of an empty folder with 1 empty bucket);
-    our caller must unlink & free the bucket if it's become empty.
-        
-    --> mailbox locked <--
+    Load summaries from an old-style text (SUMM_MAGIC) file, line by line.
 */
 
-void summ_squeeze(folder *fold, summbuck *p, summinfo *summ) {
+static void summ_loadtext(folder *fold, char *base, long size, char *fname) {
 
-    int		after;			/* remaining length */
-    int		slidelen;		/* length removed */
-    char	*nextsum;		/* following summary */
-    summinfo	*s;			/* temp */
-    
-    nextsum = (char *) summ + summ->len;
-    
-    after = p->used - (nextsum - p->data); /* any after us? */
-    slidelen = summ->len;		/* safe-store the length */
-    p->used -= slidelen; 		/* adjust length */
-    
-    if (after > 0) {
-	bcopy(nextsum, (char *) summ, after); /* slide them all down */
-	/* adjust pointers that point within block just moved */
-	for (nextsum = (char *) summ; nextsum - p->data < p->used; ) {
-	    s = (summinfo *) nextsum;
-	    nextsum += s->len;
-	    s->sender -= slidelen;
-	    s->topic -= slidelen;
-	    s->recipname -= slidelen;
+    summbuck	*p;			/* current bucket */
+    summinfo	insumm;			/* summary read from file */
+    char 	buf[SUMMBUCK_LEN];	/* long enough for max summary */
+    char	*next, *end;		/* current position; end of data */
+    int		len;
+
+    p = fold->summs;
+    end = base + size;
+    next = base + SUMM_MAGICLEN + 1;	/* skip header line */
+
+    while (next < end) {
+	for (len = 0; next < end && *next != '\n'; ++next) {
+	    if (len < sizeof(buf) - 1)
+		buf[len++] = *next;
 	}
+	buf[len] = 0;
+	++next;				/* skip newline */
+
+	if (!summ_parse(buf, &insumm, fname, TRUE)) /* parse summ. info */
+	    continue;			/* bad summary; skip */
+	p = summ_append(fold, p, &insumm, fname);
     }
+}
 
-    --p->count;		/* update bucket/folder counts */
-    --fold->count;
-    fold->dirty = TRUE; /* folder has been modified */
+/* summ_load --
 
-}
+    Read a summary file into a folder that's been set up with an empty
+    initial bucket.  Binary files are mapped and copied directly; old text
+    files are parsed and the folder marked dirty, so the next write
+    upgrades it.  An empty file is an empty folder.
 
-/* expire1 --
-  
-    Check all folders for messages due to expire.  Delete the message,
-    log the summary info to explog, update the folder.
-    
-    We maintain a blank-separated list of exprired messageids in PREF_EXP
-    for the client's benefit (to help it maintain its local cache of summary
-    info).  If this list gets too long, generate a new sessionid to tell the
-    client to invalidate its cache.
+    Returns FALSE if the file couldn't be read.
+*/
+
+static boolean_t summ_load(folder *fold, char *fname) {
+
+    int		fd;			/* the file */
+    struct stat	st;			/* its size */
+    char	*base;			/* contents */
+
+    /* create file if not there */
+    if ((fd = open(fname, O_RDONLY | O_CREAT, FILE_ACC)) < 0) {
+	t_perror1("summ_read: cannot open ", fname);
+	return FALSE;
+    }
+    if (fstat(fd, &st) < 0) {
+	t_perror1("summ_read: cannot stat ", fname);
+	close(fd);
+	return FALSE;
+    }
+    fold->ssize = st.st_size;
+    if (st.st_size == 0) {		/* no summaries -- easy */
+	close(fd);
+	return TRUE;
+    }
+    base = summ_map(fd, st.st_size);
+    close(fd);				/* (mapping stays valid) */
+    if (base == NULL) {
+	t_perror1("summ_read: cannot map ", fname);
+	return FALSE;
+    }
+
+    if (st.st_size >= SUMM_MAGICLEN && bcmp(base, SUMM_BMAGIC, SUMM_MAGICLEN) == 0)
+	summ_loadbin(fold, base, st.st_size, fname);
+    else if (st.st_size > SUMM_MAGICLEN && bcmp(base, SUMM_MAGIC, SUMM_MAGICLEN) == 0
+    	     && base[SUMM_MAGICLEN] == '\n') {
+	summ_loadtext(fold, base, st.st_size, fname);
+	fold_dirty(fold);		/* rewrite it in binary */
+	fold->compact = TRUE;
+    } else
+	t_errprint_s("summ_read: bad header line in %s\n", fname);
+
+    summ_unmap(base, st.st_size);
+
+    return TRUE;
+}
+
+/* summ_newfold --
+
+    Set up a folder with an initial (empty) bucket.
+*/
+
+static void summ_newfold(folder *fold) {
+
+    summbuck	*p;
+
+    p = (summbuck *) slab_alloc(SLAB_SUMMBUCK);
+    STAT_INC(malloc_stats.summbuck);
+
+    p->next = NULL;
+    p->count = p->used = p->dead = 0;
+    fold->summs = fold->last = p;
+    messidx_init(&fold->idx);
+    fold->pos.size = fold->pos.used = 0;
+    fold->pos.buck = NULL;
+    fold->pos.tree = NULL;
+    fold->count = 0;
+    fold->foldlen = 0;
+    fold->dirty = FALSE;
+    fold->compact = FALSE;
+    fold->jbuf = NULL;
+    fold->jlen = fold->jmax = 0;
+    fold->jsize = fold->ssize = 0;
+    fold->jgen = 0;
+    fold->mb = NULL;			/* (summ_read fills it in) */
+}
+
+/* fold_dirty --
+
+    A folder has been modified; mark it so, and make sure its box is on
+    the dirty queue (if it's a real one).
+
+    --> box locked <--
+*/
+
+static void fold_dirty(folder *fold) {
+
+    fold->dirty = TRUE;
+    if (fold->mb)
+	mbox_dirty(fold->mb);
+}
+
+/* fold_jname --
+
+    Generate a folder's journal filename:  the summary file name with
+    SUMM_JPREFIX in front (a dot-file, so it's never taken for a folder).
+*/
+
+static void fold_jname(char *jname, mbox *mb, folder *fold) {
+
+    char	fname[FILENAME_MAX];	/* summary filename */
+
+    fold_fname(fname, mb, fold);
+    t_sprintf(jname, "%s/%s%s", mb->boxname, SUMM_JPREFIX, fname + strlen(mb->boxname) + 1);
+}
+
+/* summ_jlimit --
+
+    How long a folder's journal may get before we'd rather rewrite the
+    summary file.
+*/
+
+static long summ_jlimit(folder *fold) {
+
+    return fold->ssize / SUMM_JRATIO > SUMM_JMIN ? fold->ssize / SUMM_JRATIO : SUMM_JMIN;
+}
+
+/* summ_jlog --
+
+    Queue a journal record for the next summ_write.  If the journal would
+    get too long, give up on it; summ_write will rewrite the folder instead.
+
+    --> box locked <--
+*/
+
+static void summ_jlog(folder *fold, long type, char *body, long len) {
+
+    char	*rec;			/* new record */
+
+    if (fold->compact)			/* rewriting anyway; don't bother */
+	return;
+
+    if (fold->jsize + fold->jlen + JR_HDRLEN + len > summ_jlimit(fold)) {
+	fold->compact = TRUE;		/* journal's served its purpose */
+	if (fold->jbuf)
+	    t_free(fold->jbuf);
+	fold->jbuf = NULL;
+	fold->jlen = fold->jmax = 0;
+	return;
+    }
+
+    if (fold->jlen + JR_HDRLEN + len > fold->jmax) {	/* need more room? */
+	fold->jmax = fold->jlen + JR_HDRLEN + len + 512;
+	if (fold->jbuf)
+	    fold->jbuf = reallocf(fold->jbuf, fold->jmax);
+	else
+	    fold->jbuf = mallocf(fold->jmax);
+    }
+
+    rec = fold->jbuf + fold->jlen;
+    (void) putnetlong(rec + JR_TYPE, type);
+    (void) putnetlong(rec + JR_LEN, JR_HDRLEN + len);
+    bcopy(body, rec + JR_HDRLEN, len);
+    fold->jlen += JR_HDRLEN + len;
+}
+
+/* summ_jadd --
+
+    Journal a summary added to a folder.
+*/
+
+static void summ_jadd(folder *fold, summinfo *summ) {
+
+    char	body[SUMM_RECLEN + 2*MAX_ADDR_LEN + MAX_TOPC_LEN];
+    char	*heap = body + SUMM_RECLEN;	/* strings follow record */
+    long	off = 0;			/* heap length */
+
+    summ_pack(body, summ, &off);
+    strcpy(heap, summ->sender);
+    heap += strlen(heap) + 1;
+    strcpy(heap, summ->recipname);
+    heap += strlen(heap) + 1;
+    strcpy(heap, summ->topic);
+
+    summ_jlog(fold, JR_ADD, body, SUMM_RECLEN + off);
+}
+
+/* summ_jdel --
+
+    Journal a summary deleted from a folder.
+*/
+
+static void summ_jdel(folder *fold, long messid) {
+
+    char	body[4];
+
+    (void) putnetlong(body, messid);
+    summ_jlog(fold, JR_DEL, body, sizeof(body));
+}
+
+/* summ_changed --
+
+    A summary's flags, expiration, or length have been changed in place.
+    Mark the folder dirty, and journal the new values.
+
+    --> box locked <--
+*/
+
+void summ_changed(folder *fold, summinfo *summ) {
+
+    char	body[JU_LEN];
+
+    (void) putnetlong(body + JU_MESSID, summ->messid);
+    (void) putnetlong(body + JU_TOTALLEN, summ->totallen);
+    (void) putnetlong(body + JU_ENCLOSURES, summ->enclosures);
+    (void) putnetlong(body + JU_FLAGS, (summ->read ? SRF_READ : 0)
+    				     | (summ->receipt ? SRF_RECEIPT : 0));
+    (void) putnetlong(body + JU_EXPIRE, summ->expire);
+    summ_jlog(fold, JR_UPD, body, JU_LEN);
+
+    fold_dirty(fold);			/* folder has changed */
+}
+
+/* summ_jreplay --
+
+    Apply a folder's journal to the summaries just loaded from its summary
+    file.  A journal for some other generation of the summary file is left
+    over from before the last rewrite; it's discarded.  A partial record
+    at the end (we died while appending) is ignored, and the folder marked
+    to be rewritten rather than appended to.
+
+    --> box locked <--
+*/
+
+static void summ_jreplay(folder *fold, char *jname) {
+
+    int		fd;			/* the journal */
+    struct stat	st;			/* its size */
+    char	*base;			/* its contents */
+    char	*rec;			/* current record */
+    char	*body;			/* and its contents */
+    long	off;			/* offset of current record */
+    long	len;			/* length of current record */
+    summinfo	insumm;			/* summary being added */
+    summinfo	*summ;			/* summary being changed */
+    summbuck	*p;			/* its bucket */
+    messent	*e;			/* its index entry */
+    boolean_t	compact;		/* saved fold->compact */
+
+    fold->jsize = 0;
+    if ((fd = open(jname, O_RDONLY)) < 0) {
+	if (pthread_errno() != ENOENT)	/* (usually, there's no journal) */
+	    t_perror1("summ_read: cannot open ", jname);
+	return;
+    }
+    if (fstat(fd, &st) < 0) {
+	t_perror1("summ_read: cannot stat ", jname);
+	close(fd);
+	return;
+    }
+    if (st.st_size < SUMM_JHDRLEN) {	/* nothing there */
+	close(fd);
+	return;
+    }
+    base = summ_map(fd, st.st_size);
+    close(fd);
+    if (base == NULL) {
+	t_perror1("summ_read: cannot map ", jname);
+	return;
+    }
+
+    if (bcmp(base, SUMM_JMAGIC, SUMM_MAGICLEN) != 0
+     || (u_bit32) getnetlong(base + JH_GEN) != fold->jgen) {
+	summ_unmap(base, st.st_size);
+	(void) unlink(jname);		/* stale; get rid of it */
+	return;
+    }
+
+    compact = fold->compact;
+    fold->compact = TRUE;		/* don't re-journal what we replay */
+
+    for (off = SUMM_JHDRLEN; off + JR_HDRLEN <= st.st_size; off += len) {
+	rec = base + off;
+	len = getnetlong(rec + JR_LEN);
+	if (len < JR_HDRLEN || len > st.st_size - off)
+	    break;			/* partial record */
+	body = rec + JR_HDRLEN;
+
+	switch (getnetlong(rec + JR_TYPE)) {
+	    case JR_ADD:
+		if (len >= JR_HDRLEN + SUMM_RECLEN
+		 && summ_unpack(&insumm, body, body + SUMM_RECLEN, len - JR_HDRLEN - SUMM_RECLEN)
+		 && messidx_find(&fold->idx, insumm.messid) == NULL)
+		    (void) summ_append(fold, fold->last, &insumm, jname);
+		break;
+	    case JR_DEL:
+		if (len >= JR_HDRLEN + 4
+		 && (e = messidx_find(&fold->idx, getnetlong(body))) != NULL)
+		    summ_remove(fold, e->buck, e->summ);
+		break;
+	    case JR_UPD:
+		if (len >= JR_HDRLEN + JU_LEN
+		 && (e = messidx_find(&fold->idx, getnetlong(body + JU_MESSID))) != NULL) {
+		    summ = e->summ;
+		    fold->foldlen -= summ->totallen;
+		    summ->totallen = getnetlong(body + JU_TOTALLEN);
+		    fold->foldlen += summ->totallen;
+		    summ->enclosures = getnetlong(body + JU_ENCLOSURES);
+		    summ->read = (getnetlong(body + JU_FLAGS) & SRF_READ) != 0;
+		    summ->receipt = (getnetlong(body + JU_FLAGS) & SRF_RECEIPT) != 0;
+		    summ->expire = (u_bit32) getnetlong(body + JU_EXPIRE);
+		}
+		break;
+	    case JR_RENUM:
+		if (len >= JR_HDRLEN + 8
+		 && (e = messidx_find(&fold->idx, getnetlong(body))) != NULL) {
+		    summ = e->summ;
+		    p = e->buck;
+		    messidx_remove(&fold->idx, e);
+		    summ->messid = getnetlong(body + 4);
+		    messidx_add(&fold->idx, summ->messid, fold->num, p, summ);
+		}
+		break;
+	    default:			/* unknown; skip it */
+		break;
+	}
+    }
+
+    if (off != st.st_size) {
+	t_errprint_s("summ_read: truncated journal %s\n", jname);
+	compact = TRUE;			/* don't append after the junk */
+    }
+    fold->jsize = st.st_size;
+    summ_unmap(base, st.st_size);
+
+    fold->compact = compact;
+    fold->dirty = FALSE;		/* (what we replayed is on disk already) */
+    if (compact)
+	fold_dirty(fold);
+}
+
+/* summ_jflush --
+
+    Append queued journal records to the journal file (starting a new one,
+    if there isn't one for this generation yet).  Returns FALSE if they
+    couldn't be written.
+
+    --> box locked <--
+*/
+
+static boolean_t summ_jflush(folder *fold, char *jname) {
+
+    int		fd;			/* the journal */
+    char	hdr[SUMM_JHDRLEN];	/* its header */
+    boolean_t	ok = TRUE;
+
+    if (fold->jlen == 0)
+	return TRUE;			/* nothing to do */
+
+    if ((fd = open(jname, O_WRONLY | O_APPEND | O_CREAT | (fold->jsize == 0 ? O_TRUNC : 0),
+    		   FILE_ACC)) < 0) {
+	t_perror1("summ_write: cannot open ", jname);
+	return FALSE;
+    }
+
+    if (fold->jsize == 0) {		/* new journal; header first */
+	bzero(hdr, sizeof(hdr));
+	bcopy(SUMM_JMAGIC, hdr, SUMM_MAGICLEN);
+	(void) putnetlong(hdr + JH_GEN, fold->jgen);
+	if (write(fd, hdr, SUMM_JHDRLEN) != SUMM_JHDRLEN)
+	    ok = FALSE;
+	else
+	    fold->jsize = SUMM_JHDRLEN;
+    }
+    if (ok && write(fd, fold->jbuf, fold->jlen) != fold->jlen)
+	ok = FALSE;
+
+    if (ok) {
+	fold->jsize += fold->jlen;
+	fold->jlen = 0;
+    } else {
+	t_perror1("summ_write: error writing ", jname);
+	(void) ftruncate(fd, fold->jsize);	/* don't leave a partial record */
+    }
+    close(fd);
+
+    return ok;
+}
+
+/* summ_read --
+
+    Read summaries from file.
+
+    Allocate first bucket.  If file is present, load the summaries from it
+    (allocating more buckets as needed), then replay the journal.
+
+    Note that if fold->summs is NULL, it means summaries have not yet been
+    read; if the folder is empty, fold->summs will point to an empty bucket.
+
+    --> box locked <--
+*/
+void summ_read(mbox *mb, folder *fold) {
+
+    char	fname[FILENAME_MAX];	/* summary filename */
+
+    sem_check(&mb->mbsem);
+
+    STAT_INC(mb_stats.summ_r);
+
+    /* set up initial bucket, even if no summaries */
+    summ_newfold(fold);
+    fold->mb = mb;
+
+    fold_fname(fname, mb, fold);	/* generate filename */
+    if (summ_load(fold, fname)) {
+	fold_jname(fname, mb, fold);	/* apply changes since it was written */
+	summ_jreplay(fold, fname);
+    }
+}
+
+/* fold_names --
+
+    Get the names of a folder's summary file and journal (for fold_prefetch).
+
+    --> box locked (shared is ok) <--
+*/
+
+void fold_names(mbox *mb, folder *fold, char *fname, char *jname) {
+
+    fold_fname(fname, mb, fold);
+    fold_jname(jname, mb, fold);
+}
+
+/* fold_prefetch --
+
+    Read a folder's summary file and journal, throwing the data away, just
+    to get them into the buffer cache so summ_read won't wait for the disk.
+    Nothing is locked, so several folders can be done at once (see
+    mbox_warm).
+*/
+
+void fold_prefetch(char *fname, char *jname) {
+
+    char	buf[8192];
+    int		fd;
+    char	*name;
+    int		i;
+
+    for (i = 0; i < 2; ++i) {
+	name = i == 0 ? fname : jname;
+	if ((fd = open(name, O_RDONLY)) < 0)
+	    continue;			/* (no journal, e.g.) */
+	while (read(fd, buf, sizeof(buf)) > 0)
+	    ;
+	close(fd);
+    }
+}
+
+/* summ_store --
+
+    Write a folder's summaries to a temp file in binary form; rename it
+    to the summary file.  Returns FALSE if anything goes wrong (in which
+    case the old summary file is left alone).
+*/
+
+static boolean_t summ_store(folder *fold, char *tempname, char *summname) {
+
+    char	hdr[SUMM_HDRLEN];	/* file header */
+    char	rec[SUMM_RECLEN];	/* one record */
+    summbuck	*p;			/* current bucket */
+    summinfo	*summ;			/* current summary in bucket */
+    char	*nextsum;		/* to locate next summary */
+    t_file	*f;			/* the file */
+    long	count = 0;		/* number of summaries */
+    long	heaplen = 0;		/* and total string length */
+    long	off;			/* heap offset */
+
+    fold_compact(fold);			/* (tombstones aren't written) */
+    for (p = fold->summs; p != NULL; p = p->next) {
+	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+	    summ = (summinfo *) nextsum;
+	    ++count;
+	    heaplen += strlen(summ->sender) + strlen(summ->recipname)
+	    	     + strlen(summ->topic) + 3;
+	}
+    }
+
+    if ((f = t_fopen(tempname, O_WRONLY | O_CREAT | O_TRUNC, FILE_ACC)) == NULL) {
+	t_perror("summ_write: open ");
+	return FALSE;
+    }
+
+    bzero(hdr, sizeof(hdr));
+    bcopy(SUMM_BMAGIC, hdr, SUMM_MAGICLEN);
+    (void) putnetlong(hdr + SH_VERS, SUMM_BVERS);
+    (void) putnetlong(hdr + SH_COUNT, count);
+    (void) putnetlong(hdr + SH_RECLEN, SUMM_RECLEN);
+    (void) putnetlong(hdr + SH_HEAPLEN, heaplen);
+    (void) putnetlong(hdr + SH_GEN, fold->jgen);
+    t_fwrite(f, hdr, SUMM_HDRLEN);
+
+    /* fixed-size records... */
+    off = 0;
+    for (p = fold->summs; p != NULL; p = p->next) {
+	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+	    summ = (summinfo *) nextsum;
+	    summ_pack(rec, summ, &off);
+	    t_fwrite(f, rec, SUMM_RECLEN);
+	}
+    }
+
+    /* ...followed by the strings they point to (in the same order) */
+    for (p = fold->summs; p != NULL; p = p->next) {
+	for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+	    summ = (summinfo *) nextsum;
+	    t_fwrite(f, summ->sender, strlen(summ->sender) + 1);
+	    t_fwrite(f, summ->recipname, strlen(summ->recipname) + 1);
+	    t_fwrite(f, summ->topic, strlen(summ->topic) + 1);
+	}
+    }
+
+    t_fflush(f);			/* flush, so we detect any errors */
+    if (f->t_errno != 0) {
+	t_perror1("summ_write: error writing ", tempname);
+	(void) t_fclose(f);
+	unlink(tempname);		/* discard the bad file */
+	return FALSE;
+    }
+    (void) t_fclose(f);
+
+    if (rename(tempname, summname) < 0) {	/* move temp to result file */
+	t_perror1("summ_write: rename failed: ", summname);
+	return FALSE;
+    }
+    fold->ssize = SUMM_HDRLEN + count * SUMM_RECLEN + heaplen;
+
+    return TRUE;
+}
+
+/* summ_write --
+
+    Write out changes to summaries.  Normally that's just appending the
+    queued records to the journal; if the journal has gotten too long (or
+    can't be written), rewrite the whole summary file instead:  create
+    temp file; rename it; discard the journal.
+
+    --> mailbox locked <--
+*/
+
+void summ_write(mbox *mb, folder *fold) {
+
+    char	fname[FILENAME_MAX];	/* temp filename */
+    char	summname[FILENAME_MAX];	/* summary filename */
+    char	jname[FILENAME_MAX];	/* journal filename */
+
+    if (fold->summs == NULL)		/* if never read in, don't write */
+	return;
+
+    STAT_INC(mb_stats.summ_w);
+
+    if (mb->manifest && !summ_unmanifest(mb))
+	return;				/* box would look consistent when it's not */
+
+    fold_compact(fold);			/* good time to reclaim dead space */
+    fold_jname(jname, mb, fold);
+    if (!fold->compact && summ_jflush(fold, jname)) {
+	fold->dirty = FALSE;		/* all changes are in the journal */
+	return;
+    }
+
+    t_sprintf(fname, "%s/.summtemp", mb->boxname);
+    fold_fname(summname, mb, fold);	/* generate filename */
+
+    ++fold->jgen;			/* new file supersedes old journal */
+    if (summ_store(fold, fname, summname)) {
+	if (unlink(jname) < 0 && pthread_errno() != ENOENT)
+	    t_perror1("summ_write: cannot unlink ", jname);
+	fold->jsize = fold->jlen = 0;
+	fold->compact = FALSE;
+        fold->dirty = FALSE;
+    } else
+	--fold->jgen;			/* old journal still applies */
+}
+
+/* summ_convert --
+
+    Convert one old-style text summary file to binary, in place (for
+    the offline converter; the server upgrades files as it reads them).
+    "tempname" is a scratch file on the same filesystem.
+
+    Returns 1 if converted, 0 if not a text summary file, -1 on error.
+*/
+
+int summ_convert(char *fname, char *tempname) {
+
+    folder	fold;			/* scratch folder */
+    int		fd;
+    char	buf[SUMM_MAGICLEN+1];	/* first line */
+    int		result = 0;
+
+    if ((fd = open(fname, O_RDONLY)) < 0)
+	return -1;
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf)
+     || bcmp(buf, SUMM_MAGIC, SUMM_MAGICLEN) != 0 || buf[SUMM_MAGICLEN] != '\n') {
+	close(fd);
+	return 0;			/* not ours (or already binary) */
+    }
+    close(fd);
+
+    bzero((char *) &fold, sizeof(fold));
+    summ_newfold(&fold);
+    if (!summ_load(&fold, fname))
+	result = -1;
+    else if (fold.dirty)		/* text; write it back in binary */
+	result = summ_store(&fold, tempname, fname) ? 1 : -1;
+    summ_free(NULL, &fold);
+
+    return result;
+}
+
+/* summ_free --
+
+    Free storage used by summaries (and their index).
+    
+    --> mailbox locked <--
+*/
+
+void summ_free(mbox *mb, folder *fold) {
+
+    summbuck	*p;			/* current bucket */
+       
+    if (fold->summs == NULL)		/* never read in */
+	return;
+    messidx_free(&fold->idx);
+    posidx_free(fold);
+    if (fold->jbuf)
+	t_free(fold->jbuf);
+    fold->jbuf = NULL;
+	
+    /* free each bucket in the folder */
+    while (p = fold->summs) {		/* (sic) */
+    	fold->summs = p->next;
+	slab_free(SLAB_SUMMBUCK, p);
+        STAT_DEC(malloc_stats.summbuck);
+
+    }	
+}
+
+/* summ_renumber --
+
+    Give a summary already in a folder a new messid (its message has been
+    rewritten under a new id), keeping the messid indexes current.
+
+    --> box locked <--
+*/
+
+void summ_renumber(mbox *mb, folder *fold, summinfo *summ, long messid) {
+
+    messent	*e;			/* index entry */
+    summbuck	*p = NULL;		/* bucket summary lives in */
+    long	oldid = summ->messid;	/* previous messid */
+    char	body[8];		/* journal record */
+
+    sem_check(&mb->mbsem);
+
+    if ((e = messidx_find(&fold->idx, summ->messid)) != NULL && e->summ == summ) {
+	p = e->buck;
+	messidx_remove(&fold->idx, e);
+    }
+    box_unindex(mb, fold, summ->messid);
+
+    summ->messid = messid;
+
+    if (p)
+	messidx_add(&fold->idx, messid, fold->num, p, summ);
+    else				/* wasn't indexed (duplicate); start over */
+	fold_index(fold);
+    if (mb->indexed)
+	messidx_add(&mb->messfold, messid, fold->num, NULL, NULL);
+
+    (void) putnetlong(body, oldid);	/* journal the change */
+    (void) putnetlong(body + 4, messid);
+    summ_jlog(fold, JR_RENUM, body, sizeof(body));
+    fold_dirty(fold);
+}
+
+/* summ_kill --
+
+    Delete a summary from a bucket by marking it dead:  the summary stays
+    where it is (as a tombstone) until summ_compact reclaims the space, a
+    whole bucket at a time.  Adjust bucket/folder counts and indexes.
+
+    Note: empty buckets should _not_ be left allocated to the folder
+    list (except for the special case of an empty folder with 1 empty bucket);
+    our caller must unlink & free the bucket if its count has gone to zero.
+
+    --> mailbox locked <--
+*/
+
+void summ_kill(folder *fold, summbuck *p, summinfo *summ) {
+
+    messent	*e;			/* index entry */
+
+    if ((e = messidx_find(&fold->idx, summ->messid)) != NULL && e->summ == summ)
+	messidx_remove(&fold->idx, e);
+    summ_jdel(fold, summ->messid);
+
+    summ->messid = SUMM_DEADID;		/* it's a tombstone now */
+    p->dead += summ->len;
+
+    --p->count;		/* update bucket/folder counts */
+    posidx_adjust(fold, p, -1);
+    --fold->count;
+    fold_dirty(fold); /* folder has been modified */
+
+    if (fold->idx.dups > 0)		/* a duplicate may need to take our place */
+	fold_index(fold);
+
+}
+
+/* summ_compact --
+
+    Squeeze the dead summaries out of a bucket.  Slide the live ones down
+    to fill the holes, relocating the string pointers within each summary
+    (and its index entry) to account for the move.
+
+    --> mailbox locked <--
+*/
+
+void summ_compact(folder *fold, summbuck *p) {
+
+    char	*nextsum;		/* summary being examined */
+    char	*to;			/* where next live one goes */
+    summinfo	*s;			/* temp */
+    int		len;			/* its length */
+    long	delta;			/* distance it moves */
+    messent	*e;			/* index entry */
+
+    if (p->dead == 0)
+	return;				/* nothing to do */
+
+    for (nextsum = to = p->data; nextsum - p->data < p->used; nextsum += len) {
+	s = (summinfo *) nextsum;
+	len = s->len;
+	if (SUMM_DEAD(s))
+	    continue;
+	if (to != nextsum) {		/* slide it down */
+	    delta = nextsum - to;
+	    bcopy(nextsum, to, len);
+	    s = (summinfo *) to;
+	    s->sender -= delta;
+	    s->recipname -= delta;
+	    s->topic -= delta;
+	    if ((e = messidx_find(&fold->idx, s->messid)) != NULL
+	     && e->summ == (summinfo *) nextsum)
+		e->summ = s;
+	}
+	to += len;
+    }
+
+    p->used = to - p->data;
+    p->dead = 0;
+}
+
+/* fold_compact --
+
+    Compact every bucket in a folder that has any dead summaries.
+
+    --> mailbox locked <--
+*/
+
+void fold_compact(folder *fold) {
+
+    summbuck	*p;
+
+    for (p = fold->summs; p != NULL; p = p->next)
+	summ_compact(fold, p);
+}
+
+/* summ_expindex --
+
+    Put every message in the box into the expiration index (it's just been
+    copied here from another filesystem, bypassing fold_addsum).
+
+    --> box locked <--
+*/
+
+void summ_expindex(mbox *mb) {
+
+    folder	*fold;			/* current folder */
+    int		foldnum;		/* its number */
+    summbuck	*p;			/* current summary chunk */
+    summinfo	*summ;			/* current summary in bucket */
+    char	*nextsum;		/* to locate next summary */
+
+    sem_check(&mb->mbsem);
+
+    for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {
+	fold = &mb->fold[foldnum];
+	if (fold->num < 0)		/* skip holes */
+	    continue;
+	if (fold->summs == NULL)	/* read summaries, if not yet here */
+	    summ_read(mb, fold);
+	for (p = fold->summs; p != NULL; p = p->next) {
+	    for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
+		summ = (summinfo *) nextsum;
+		if (!SUMM_DEAD(summ))
+		    expidx_add(mb, fold->num, summ);
+	    }
+	}
+    }
+}
+
+/* expire1 --
+  
+    Check all folders for messages due to expire.  Delete the message,
+    log the summary info to explog, update the folder.
+    
+    We maintain a blank-separated list of exprired messageids in PREF_EXP
+    for the client's benefit (to help it maintain its local cache of summary
+    info).  If this list gets too long, generate a new sessionid to tell the
+    client to invalidate its cache.
     
-    If "stolog" is non-null, record uid and total box length there (expiration
+    If "folds" is non-null, only the folders it flags are checked (the
+    expiration index says nothing's due in the others).  Surviving messages
+    due on or before day "reidx" are put back in the index (the entries
+    that brought us here have been used up; see expidx_due).
+
+    Normally a signed-on user is disconnected first.  If "w->spare" is set
+    (trickle expiration, which runs while people are working), a box whose
+    owner is signed on is left alone instead, and we return FALSE so it
+    can be tried again later.
+
+    If there's a storage log, record uid and total box length there (expiration
     is a convenient time to do this, since we're examining every box.)
-    (Note that other threads may be expiring on other disks in parallel; must
-    seize exp_sem whenever accessing the log files).
+    Other workers are expiring other boxes in parallel; log lines go into
+    this worker's own buffers (see explog_put), and the count of messages
+    expired and I/O done into "w".
 */
 
-void expire1(long uid, int fs, u_long today) {
+boolean_t expire1(long uid, expwork *w, char *folds, u_long reidx) {
 
     mbox	*mb;			/* box to check */
     folder	*fold;			/* current folder */
@@ -1408,6 +2880,7 @@ void expire1(long uid, int fs, u_long today) {
     char 	datestr[9]; 
     char 	timestr[9];
     char	buf[SUMMBUCK_LEN];	/* formatted summary */
+    char	line[SUMMBUCK_LEN + MAX_STR];	/* log line */
     long	count = 0;		/* count of messages expired */
     char	expired[PREF_MAXLEN];	/* list of expired messages */
     char	val[PREF_MAXLEN];	/* quoted copy */
@@ -1421,46 +2894,55 @@ void expire1(long uid, int fs, u_long today) {
     
     /* before working on this box, check against DND to verify that it
        really belongs on this disk (avoid setting up bogus mbox structure) */
-    if (uid_to_fs(uid, &dnd_fs) != DND_OK || dnd_fs != fs) {
+    if (uid_to_fs(uid, &dnd_fs) != DND_OK || dnd_fs != w->fs) {
     	if (uid != pubml_uid) {		/* don't log for this guy */
 	    date_time(datestr, timestr);
-	    pthread_mutex_lock(&exp.lock);
-	    t_fprintf(exp.explog, 
-		"%s %s skipping uid %ld; can't confirm they belong on %s\n", 
-		datestr, timestr, uid, m_filesys[fs]);
-	    pthread_mutex_unlock(&exp.lock);
+	    t_sprintf(line, "%s %s skipping uid %ld; can't confirm they belong on %s\n", 
+		datestr, timestr, uid, m_filesys[w->fs]);
+	    explog_put(&w->explog, line);
 	}
-     	return;
+     	return TRUE;
     } 
 	
-    /* if user is signed on; force a disconnect */		    
-    mb = force_disconnect(uid, fs, NULL); /* disconnect user & lock box */
+    if (w->spare) {			/* leave signed-on users be */
+	mb = mbox_find(uid, w->fs, FALSE);
+	sem_seize(&mb->mbsem);
+	if (mb->user) {
+	    sem_release(&mb->mbsem);
+	    mbox_done(&mb);
+	    return FALSE;		/* try again later */
+	}
+    } else				/* if user is signed on; force a disconnect */
+	mb = force_disconnect(uid, w->fs, NULL); /* disconnect user & lock box */
+    ++w->ops;
     	
     /* do all folders */
     for (foldnum = 0; foldnum < mb->foldmax; ++foldnum) {   
 	fold = &mb->fold[foldnum];
 	if (fold->num < 0)		/* skip holes */
 	    continue;
+	if (folds && !folds[foldnum])	/* nothing due here */
+	    continue;
 	    
-	if (fold->summs == NULL)	/* read summaries, if not yet here */
+	if (fold->summs == NULL) {	/* read summaries, if not yet here */
 	    summ_read(mb, fold);
+	    ++w->ops;
+	}
 	foldcount = 0;			/* nothing expired in this folder yet */
 
 	/* for every bucket & every summary */
 	for (pp = NULL, p = fold->summs; p != NULL; p = nextp) {
 	    nextp = p->next; 
-	    for (nextsum = p->data; p != NULL && nextsum - p->data < p->used; ) {
+	    for (nextsum = p->data; nextsum - p->data < p->used; nextsum += summ->len) {
 		summ = (summinfo *) nextsum; 	/* cast pointer to current summ */
-		nextsum += summ->len;		/* compute where next one will be */
 				
-		if (summ->expire <= today) { 	/* due to expire? */
+		if (!SUMM_DEAD(summ) && summ->expire <= w->today) { /* due to expire? */
 		
 		    /* log date, uid, and summary to explog */
 		    date_time(datestr, timestr);
 		    summ_fmt(summ, buf);
-		    pthread_mutex_lock(&exp.lock);
-		    t_fprintf(exp.explog, "%s %s uid %ld; %s\n", datestr, timestr, uid, buf);
-		    pthread_mutex_unlock(&exp.lock);
+		    t_sprintf(line, "%s %s uid %ld; %s\n", datestr, timestr, uid, buf);
+		    explog_put(&w->explog, line);
 			
 		    /* first time, get current list of expired stuff */
 		    if (count == 0) {
@@ -1509,32 +2991,33 @@ void expire1(long uid, int fs, u_long today) {
 		    /* delete the message itself */
 		    mess_rem(mb, summ->messid, summ->totallen);
 		    fold->foldlen -= summ->totallen;
+		    box_unindex(mb, fold, summ->messid);
 		    
-		    /* squeeze this summary out of the bucket */
-		    summ_squeeze(fold, p, summ);
-		    
-		    nextsum = (char *) summ;	/* stay in the same place */
-
-		    /* delete empty bucket iff it's not the only one */
-		    if (p->used == 0 && (pp || p->next)) {
-			if (pp)	
-			    pp->next = p->next;
-			else fold->summs = p->next;
-			t_free((char *) p);
-    			pthread_mutex_lock(&global_lock);
-    			--malloc_stats.summbuck;
-    			pthread_mutex_unlock(&global_lock);
-
-			p = NULL;
-		    }
+		    /* mark the summary dead (space is reclaimed below) */
+		    summ_kill(fold, p, summ);
 		    		    
 		    /* count # of messages expired */
 		    ++count; ++foldcount;
 		    
-		} 
+		} else if (!SUMM_DEAD(summ) && summ->expire / EXP_DAYSECS <= reidx)
+		    expidx_add(mb, fold->num, summ);	/* still in the index */
+	    }
+	    
+	    /* delete empty bucket iff it's not the only one */
+	    if (p->count == 0 && (pp || p->next)) {
+		if (pp)	
+		    pp->next = p->next;
+		else fold->summs = p->next;
+		if (fold->last == p)
+		    fold->last = pp;
+		posidx_freebuck(fold, p);
+		slab_free(SLAB_SUMMBUCK, p);
+    		STAT_DEC(malloc_stats.summbuck);
+	    } else {
+		if (2 * p->dead > p->used) /* mostly tombstones; reclaim space */
+		    summ_compact(fold, p);
+		pp = p;			/* advance backpointer */
 	    }
-	    if (p != NULL)			/* unless deleted current bucket */
-		pp = p;				/* advance backpointer */
 	}
 	
 	/* if folder isn't dirty, free summaries now (don't hog memory) */
@@ -1561,21 +3044,17 @@ void expire1(long uid, int fs, u_long today) {
 	    set_sessionid(mb);		/* bump sessionid to invalidate cache */
     }
     
-    pthread_mutex_lock(&exp.lock);
-    if (exp.stolog) {			/* generate storage report? */
-	int 	i;
-	long 	messcount = 0;
-    	for (i = 0; i < mb->foldmax; ++i) {
-	    if (mb->fold[i].num < 0)
-		continue;		/* unused folder # */
-	    messcount += mb->fold[i].count;
-	}
-	t_fprintf(exp.stolog, "%ld %ld %ld %s\n", uid, messcount, mb->boxlen, m_filesys[mb->fs]);
+    if (w->stolog.file) {		/* generate storage report? */
+	t_sprintf(line, "%ld %ld %ld %s\n", uid, mb->messcount, mb->boxlen, m_filesys[mb->fs]);
+	explog_put(&w->stolog, line);
     }
-    exp.total += count;
-    pthread_mutex_unlock(&exp.lock);
+    w->total += count;
+    w->ops += count;			/* (a message file apiece) */
     
     sem_release(&mb->mbsem);		/* box can change now */
+    if (m_sizeaudit)			/* double-check accounting? */
+	mbox_audit(mb);
     mbox_done(&mb);
-	
+    
+    return TRUE;
 }
@@ -220,7 +220,7 @@ static t_file *t_dndopen() {
         t_perror("t_dndopen: ioctl (FIONBIO)");
 
     f->select = TRUE;                   /* t_select should check this file */
-    f->timeout = DND_TIMEOUT * 60;     /* set timeout interval (seconds) */
+    t_settimeout(f, DND_TIMEOUT * 60, FALSE); /* set timeout interval (seconds) */
 
     /* connection established; try for greeting message */
         
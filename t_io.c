@@ -19,17 +19,35 @@
 #include <sys/ioctl.h>
 #include <sys/dir.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/errno.h>
 #include <netinet/in.h>
 #include <arpa/telnet.h>
 #include "t_io.h"
 #include "t_err.h"
 #include "misc.h"
+#ifdef T_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #ifdef T_SELECT
 pthread_addr_t t_select(pthread_addr_t zot);
 #endif
+#ifdef T_EPOLL
+static pthread_addr_t t_epoll(pthread_addr_t zot);
+static void t_epoll_arm(t_file *f);
+
+#define T_EPOLL_BATCH	64		/* events collected per epoll_wait */
+#define T_EPOLL_WAKEKEY	(~(u_bit32) 0)	/* event key for sel_wakefd */
+#endif
 
+static void t_setbuf(t_file *f, int class);
+static void t_relbuf(t_file *f);
+static int t_bufadapt(t_file *f, int len);
+static void t_iostat(t_file *f, int len);
+static void tw_link(t_file *f);
+static void tw_unlink(t_file *f);
+static void tw_update(t_file *f);
 void got_sigio();
 void got_sigurg();
 void doshutdown();
@@ -47,9 +65,48 @@ void t_ioinit() {
     
     pthread_mutex_init(&sel_lock, pthread_mutexattr_default);
     pthread_cond_init(&timeout_wait, pthread_condattr_default);
+    t_idlewheel.now = t_loadwheel.now = time(NULL) / T_WHEEL_TICK;
+    pthread_mutex_init(&t_buflock, pthread_mutexattr_default);
+    t_iobufmax = T_DFT_IOBUFMAX;	/* (read_config may change these) */
+    t_iobufpool = T_DFT_IOBUFPOOL;
+    t_timeout_cut = 0;
     
     t_fdmap = (t_file **) mallocf(getdtablesize() * sizeof(t_file *));
     
+#ifdef T_EPOLL
+    /* set up epoll set, plus a pipe that can be used to wake the watcher
+       (e.g., from a signal handler) */
+    if ((sel_epfd = epoll_create(getdtablesize())) < 0) {
+	t_perror("t_ioinit: epoll_create");
+	exit(1);
+    }
+    if (pipe(sel_wakefd) < 0) {
+	t_perror("t_ioinit: pipe");
+	exit(1);
+    }
+    fcntl(sel_wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(sel_wakefd[1], F_SETFL, O_NONBLOCK);
+    {
+	struct epoll_event ev;
+	
+	ev.events = EPOLLIN;		/* level-triggered; not oneshot */
+	ev.data.u64 = T_EPOLL_WAKEKEY;
+	if (epoll_ctl(sel_epfd, EPOLL_CTL_ADD, sel_wakefd[0], &ev) < 0) {
+	    t_perror("t_ioinit: epoll_ctl");
+	    exit(1);
+	}
+    }
+    sel_gen = 0;
+    
+    /* start up thread to watch for input */
+    if (pthread_create(&thread, generic_attr,
+    	           (pthread_startroutine_t) t_epoll, (pthread_addr_t) 0) < 0) {
+	t_perror("t_ioinit: t_epoll pthread_create");
+	exit(1);
+    }
+    pthread_detach(&thread);
+#endif
+
 #ifdef T_SELECT
     /* start up thread to watch for input */
     if (pthread_create(&thread, generic_attr,
@@ -84,8 +141,12 @@ void t_fdopen(t_file *f, int fd) {
     
     f->fd = fd;			/* copy underlying file number */
     f->t_errno = 0;		/* no errors so far */
-    f->ptr = f->buf;		/* buffer is empty */
-    f->count = 0;
+    f->buf = f->ptr = NULL;	/* no buffer until needed */
+    f->bufsize = f->count = 0;
+    f->bufclass = -1;
+    f->minclass = 0;		/* start small; grow if traffic is heavy */
+    f->lastlen = 0;
+    f->kind = T_KIND_OTHER;
     f->writing = FALSE;
     f->select = FALSE;
     f->urgent = FALSE;
@@ -94,9 +155,14 @@ void t_fdopen(t_file *f, int fd) {
     f->tel.interrupt = FALSE;
     f->want = f->can = 0;
     f->timeout = 0;
+    f->loadtimeout = FALSE;
+    f->tw = NULL;			/* not on timer wheel */
     f->iotime = time(NULL);
-#ifdef T_SELECT
+#ifdef T_SELCOND
     pthread_cond_init(&f->wait, pthread_condattr_default);
+#endif
+#ifdef T_EPOLL
+    f->polled = FALSE;
 #endif
     t_sprintf(f->name, "#%d", fd);
 
@@ -139,8 +205,12 @@ t_file *t_fopen(char *name, int acc, int mode) {
 
     f->fd = fd;			/* copy underlying file number */
     f->t_errno = 0;		/* no errors so far */
-    f->ptr = f->buf;		/* buffer is empty */
-    f->count = 0;
+    f->buf = f->ptr = NULL;	/* no buffer until needed */
+    f->bufsize = f->count = 0;
+    f->bufclass = -1;
+    f->minclass = T_BUFCLASSES - 1; /* files get the biggest buffer allowed */
+    f->lastlen = 0;
+    f->kind = T_KIND_FILE;
     f->writing = FALSE;
     f->select = FALSE;
     f->urgent = FALSE;
@@ -148,11 +218,16 @@ t_file *t_fopen(char *name, int acc, int mode) {
     f->tel.state = TS_DATA;
     f->tel.interrupt = FALSE;
     f->timeout = 0;
+    f->loadtimeout = FALSE;
+    f->tw = NULL;			/* not on timer wheel */
     f->iotime = time(NULL);
     f->want = f->can = 0;
-#ifdef T_SELECT
+#ifdef T_SELCOND
     pthread_cond_init(&f->wait, pthread_condattr_default);
 #endif
+#ifdef T_EPOLL
+    f->polled = FALSE;
+#endif
     
     strcpy(f->name, name);	/* save name, for debugging */
     
@@ -182,7 +257,7 @@ int t_fclose(t_file *f) {
 	t_closefd(f->fd);
     }
 
-#ifdef T_SELECT    
+#ifdef T_SELCOND    
     pthread_cond_destroy(&f->wait);	/* clean up condition var */
 #endif
 
@@ -194,7 +269,9 @@ int t_fclose(t_file *f) {
 /* t_closefd --
 	
     Close file and remove it from t_fdmap.  If t_select uses the
-    file, we must wait for it to say ok.
+    file, we must wait for it to say ok.  With epoll, the fd must
+    be taken out of the epoll set before it's closed (and possibly
+    reused).
 */
 
 int t_closefd(int fd) {
@@ -212,8 +289,20 @@ int t_closefd(int fd) {
 	}
     }
 #endif
+#ifdef T_EPOLL
+    if (f && f->polled) {		/* in the epoll set? */
+	if (epoll_ctl(sel_epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+	    t_perror("t_closefd: epoll_ctl");
+	f->polled = FALSE;
+    }
+#endif
+    if (f)
+	tw_unlink(f);			/* and from the timer wheel */
     t_fdmap[fd] = NULL;			/* remove ourselves from t_select's view */
     pthread_mutex_unlock(&sel_lock);
+    
+    if (f)
+	t_relbuf(f);			/* return buffer to pool */
             
     return close(fd);
 }
@@ -229,7 +318,7 @@ int t_closefd(int fd) {
 
 int t_fflush(t_file *f) {
 
-    int 	len;		/* length to write */
+    int 	len = 0;	/* length to write */
     int		err = 0;	/* returned */
     int		written;
     int l;
@@ -248,14 +337,77 @@ int t_fflush(t_file *f) {
 		f->t_errno = pthread_errno();
 		err = EOF;
 		break;
-	    } else
+	    } else {
 		written += l;
+		t_iostat(f, l);
+	    }
+	}
+    }
+    
+    t_setbuf(f, t_bufadapt(f, len)); /* buffer is empty; resize if appropriate */
+    f->writing = TRUE; 		/* entering writing state */
+    f->ptr = f->buf;		/* set up full buffer */
+    f->count = f->bufsize;
+    
+    return err;
+}
+
+/* t_fwritev --
+
+    Write whatever is in the buffer, followed by a vector of (up to T_IOVMAX)
+    caller-supplied buffers, using as few writev calls as possible.  As with
+    t_fflush, the buffer is left empty & in writing state.
+*/
+
+int t_fwritev(t_file *f, struct iovec *iov, int iovcnt) {
+
+    struct iovec	vec[T_IOVMAX+1];	/* buffer + caller's vector */
+    int			n = 0;		/* entries in vec */
+    int			first = 0;	/* first entry not yet written */
+    int			i;
+    int			l;
+    int			total = 0;	/* total to write */
+    int			err = 0;	/* returned */
+    
+    if (f->writing && f->ptr > f->buf) {	/* valid output in buffer? */
+	vec[n].iov_base = (char *) f->buf;
+	vec[n++].iov_len = f->ptr - f->buf;
+    }
+    for (i = 0; i < iovcnt && i < T_IOVMAX; ++i)
+	vec[n++] = iov[i];
+    for (i = 0; i < n; ++i)
+	total += vec[i].iov_len;
+	
+    /* keep writing until everything sent */
+    while (first < n) {
+	if (!t_selwait(f, SEL_WRITE)) {
+	    err = EOF;			/* urgent data or pending disconnect */
+	    break;
+	}
+	l = writev(f->fd, &vec[first], n - first);
+	if (l < 0) {
+	    if (pthread_errno() == EINTR || pthread_errno() == EAGAIN)
+		continue;
+	    f->t_errno = pthread_errno();
+	    err = EOF;
+	    break;
+	}
+	t_iostat(f, l);
+	/* skip over whatever got written */
+	while (first < n && l >= vec[first].iov_len) {
+	    l -= vec[first].iov_len;
+	    ++first;
+	}
+	if (first < n) {
+	    vec[first].iov_base = (char *) vec[first].iov_base + l;
+	    vec[first].iov_len -= l;
 	}
     }
     
+    t_setbuf(f, t_bufadapt(f, total)); /* buffer is empty; resize if appropriate */
     f->writing = TRUE; 		/* entering writing state */
     f->ptr = f->buf;		/* set up full buffer */
-    f->count = sizeof(f->buf);
+    f->count = f->bufsize;
     
     return err;
 }
@@ -277,12 +429,16 @@ int t_fillbuf(t_file * f) {
     if (!t_selwait(f, SEL_READ))	
 	return EOF;		/* urgent data or disconnect */
 	 
-    f->count = read(f->fd, f->buf, sizeof(f->buf));	/* read a buffer */
+    t_setbuf(f, t_bufadapt(f, f->lastlen)); /* buffer is empty; resize if appropriate */
+    f->count = read(f->fd, f->buf, f->bufsize);	/* read a buffer */
     
     if (f->count < 0) {
 	f->t_errno = pthread_errno();
+	f->count = 0;
 	return EOF;
     }
+    f->lastlen = f->count;
+    t_iostat(f, f->count);
     
     f->ptr = f->buf;	/* start at beginning */
     
@@ -793,7 +949,9 @@ void t_skipurg(t_file *f) {
 	}
 	    
 	/* read & discard */
-	if ((len = read(f->fd, f->buf, sizeof(f->buf))) < 0) {
+	if (!f->buf)
+	    t_setbuf(f, f->minclass);
+	if ((len = read(f->fd, f->buf, f->bufsize)) < 0) {
 	    f->t_errno = pthread_errno();
 	    return;
 	}
@@ -946,6 +1104,7 @@ boolean_t t_selwait(t_file *f, int bits) {
     } else {
 	ok = TRUE;			/* ok to read/write */
 	f->iotime = time(NULL);		/* so reset timer */
+	tw_update(f);
     }  
 
     f->want &= ~bits;			/* no need to keep polling this file */
@@ -954,9 +1113,177 @@ boolean_t t_selwait(t_file *f, int bits) {
     
     return ok;
  
+}
+#elif defined(T_EPOLL)
+/* t_epoll -- [Linux version]
+
+    Thread to watch all connections with a single epoll set. As with the NeXT
+    t_select thread, the owner of a file sets bits in "want", and this thread
+    sets bits in "can" and signals f->wait.  The difference is that there's no
+    polling: t_selwait arms the fd (EPOLLONESHOT) with the conditions it's waiting
+    for, and we're woken only when one of those files is actually ready.  Since
+    nobody ever has to wake up just to check the SEL_CLOSE bit, other threads that
+    want a connection closed (t_reaper, force_disconnect) use t_selclose to signal
+    the owner directly, and a server shutdown is delivered via t_selwake.
+    
+    The event key carries both the fd and a registration generation, so a stale
+    event for a file that has since been closed (and the fd reused) is ignored.
+*/
+
+static pthread_addr_t t_epoll(pthread_addr_t zot) {
+
+    struct epoll_event	events[T_EPOLL_BATCH];
+    int			nev;		/* number of events returned */
+    int			i;
+    int			fd;		/* current fd */
+    u_bit32		gen;		/* and its registration generation */
+    t_file		*f;		/* corresponding file struct */
+    char		junk[32];	/* to drain wakeup pipe */
+
+    setup_signals();			/* set up signal handlers for new thread */
+    setup_syslog();
+    
+    for (;;) {				/* and never cease */
+    
+	nev = epoll_wait(sel_epfd, events, T_EPOLL_BATCH, -1);
+	if (nev < 0) {
+	    if (pthread_errno() != EINTR)
+		t_perror("t_epoll: epoll_wait");
+	    continue;
+	}
+
+	pthread_mutex_lock(&sel_lock);		/* get access to globals */
+	
+	for (i = 0; i < nev; ++i) {
+	    if ((u_bit32) events[i].data.u64 == T_EPOLL_WAKEKEY) {
+		while (read(sel_wakefd[0], junk, sizeof(junk)) > 0)
+		    ;			/* drain the pipe */
+		if (server_shutdown) {	/* shutdown in progress; force disconnects */
+		    for (fd = 0; fd <= max_used_fd; ++fd) {
+			if ((f = t_fdmap[fd]) && f->select) {
+			    f->want |= SEL_CLOSE;
+			    pthread_cond_signal(&f->wait);
+			}
+		    }
+		}
+		continue;
+	    }
+	    fd = (int) (events[i].data.u64 & 0xffffffff);
+	    gen = (u_bit32) (events[i].data.u64 >> 32);
+	    
+	    /* ignore file that has gone away (or been re-registered since) */
+	    if ((f = t_fdmap[fd]) == NULL || !f->select || !f->polled || f->selgen != gen)
+		continue;
+	    
+	    /* set "can" bits; clear the "want" bits that were satisfied.  Note
+	       that an error or hangup counts as readable/writable, just as with
+	       select() -- the read or write will report the problem. */
+	    if ((f->want & SEL_READ) && (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))) {
+		f->can |= SEL_READ;
+		f->want &= ~SEL_READ;
+	    }
+	    if ((f->want & SEL_WRITE) && (events[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+		f->can |= SEL_WRITE;
+		f->want &= ~SEL_WRITE;
+	    }
+	    if ((f->want & SEL_URG) && (events[i].events & EPOLLPRI)) {
+		f->can |= SEL_URG;
+		f->want &= ~SEL_URG;
+	    }
+	    pthread_cond_signal(&f->wait);
+	}
+	
+	pthread_mutex_unlock(&sel_lock);
+    }
+}
+
+/* t_epoll_arm --
+
+    (Re)register file in the epoll set, asking for a single event for
+    whatever conditions are currently in f->want.
+    
+    --> sel_lock locked <--
+*/
+
+static void t_epoll_arm(t_file *f) {
+
+    struct epoll_event	ev;
+    int			op;
+    
+    ev.events = EPOLLONESHOT;
+    if (f->want & SEL_READ)
+	ev.events |= EPOLLIN;
+    if (f->want & SEL_WRITE)
+	ev.events |= EPOLLOUT;
+    if (f->want & SEL_URG)
+	ev.events |= EPOLLPRI;
+    
+    op = f->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (!f->polled)			/* new registration; new generation */
+	f->selgen = ++sel_gen;
+    ev.data.u64 = ((unsigned long long) f->selgen << 32) | (u_bit32) f->fd;
+    
+    if (epoll_ctl(sel_epfd, op, f->fd, &ev) < 0) {
+	t_perror("t_epoll_arm: epoll_ctl");
+	/* can't wait for it; just let caller try the io */
+	f->can |= f->want & (SEL_READ | SEL_WRITE);
+    } else
+	f->polled = TRUE;
+}
+
+/* t_selwait -- [Linux version]
+
+    Arm the file in the epoll set, and wait until t_epoll indicates that
+    it is ready to [read,write] (or urgent data arrives or a disconnect is
+    pending.)
+    
+    Returns TRUE if it's now ok to read/write.  Sets f->urgent (and
+    returns FALSE) if urgent data is present.
+*/
+
+boolean_t t_selwait(t_file *f, int bits) {
+        
+    boolean_t 		ok;		/* returned: ok to read/write */
+    
+    if (!f->select)			
+	return TRUE;			/* no waiting needed */
+	
+    pthread_mutex_lock(&sel_lock);	/* get t_epoll globals */
+    
+    bits |= SEL_URG;			/* SEL_READ or SEL_WRITE plus SEL_URG */
+    f->want |= bits;		
+    
+    if (server_shutdown)		/* closing down? */
+	f->want |= SEL_CLOSE;
+	
+    if (!(f->can & bits) && !(f->want & SEL_CLOSE))
+	t_epoll_arm(f);			/* ask for an event */
+    
+    /* now wait until something happens */
+    while (!(f->can & bits) && !(f->want & SEL_CLOSE)) {
+	pthread_cond_wait(&f->wait, &sel_lock); /* wait for t_epoll to respond */
+    }
+      
+    if (f->can & SEL_URG) {		/* urgent data present? */
+	f->urgent = TRUE;
+	ok = FALSE;			/* break seen */
+    } else if (f->want & SEL_CLOSE) {
+	ok = FALSE;			/* disconnect pending */
+    } else {
+	ok = TRUE;			/* ok to read/write */
+	f->iotime = time(NULL);		/* so reset timer */
+	tw_update(f);
+    }  
+
+    f->want &= ~bits;			/* no need to keep polling this file */
+    f->can &= ~bits;			/* must do another epoll_wait next time */
+    pthread_mutex_unlock(&sel_lock);
+    
+    return ok;
+ 
 }
 #else
-/* t_selwait -- [non-NeXT version]
+/* t_selwait -- [select version]
 
     Do a select() on a single file; wait until the file is ready 
     to [read,write] (or urgent data arrives or a disconnect is pending.)
@@ -1029,7 +1356,10 @@ boolean_t t_selwait(t_file *f, int bits) {
 	ok = FALSE;			/* disconnect pending */
     } else {
 	ok = TRUE;			/* ok to read/write */
+	pthread_mutex_lock(&sel_lock);	/* sync w/ t_reaper */
 	f->iotime = time(NULL);		/* so reset timer */
+	tw_update(f);
+	pthread_mutex_unlock(&sel_lock);
     }  
 
     f->want &= ~bits;			/* no need to keep polling this file */
@@ -1039,22 +1369,366 @@ boolean_t t_selwait(t_file *f, int bits) {
 
 }
 #endif
+
+/* t_selclose --
+
+    Ask the thread that owns a connection to close it.  With a watcher
+    thread (T_SELCOND) the owner is woken immediately; otherwise it will
+    notice the next time its select times out.
+*/
+
+void t_selclose(t_file *f) {
+
+    pthread_mutex_lock(&sel_lock);
+    f->want |= SEL_CLOSE;		/* ask connection thread to close */
+#ifdef T_SELCOND
+    pthread_cond_signal(&f->wait);	/* nudge it */
+#endif
+    pthread_mutex_unlock(&sel_lock);
+}
+
+/* t_selwake --
+
+    Wake the watcher thread so it notices server_shutdown and disconnects
+    everyone right away.  Takes no locks, so it's safe from a signal handler.
+*/
+
+void t_selwake() {
+
+#ifdef T_EPOLL
+    char	c = 0;
+    
+    (void) write(sel_wakefd[1], &c, 1);
+#endif
+}
+/* Buffer pool --
+
+    t_file buffers aren't part of the t_file; they're allocated when first
+    needed and returned by t_closefd.  Sizes come in T_BUFCLASSES classes,
+    from T_BUFSIZ up to t_iobufmax; a free list of up to t_iobufpool buffers
+    is kept for each class.
+    
+    Network connections start with the smallest buffer.  Whenever the buffer
+    is empty (before a read; after a flush) we look at how much the last
+    read or write moved: if it filled the buffer, the traffic is bulk, so 
+    move up a size; if it was short, drop back to the minimum.  Disk files
+    get the biggest size right away.
+*/
+
+static u_char	*t_bufpool[T_BUFCLASSES];	/* free buffers in each class */
+static int	t_bufpoolcnt[T_BUFCLASSES];	/* how many */
+
+/* t_setbuf --
+
+    Give the file a buffer of the given class (or the closest one allowed),
+    returning the old buffer to the pool.  The buffer must be empty!
+*/
+
+static void t_setbuf(t_file *f, int class) {
+
+    u_char	*b = NULL;		/* new buffer */
+    
+    if (class >= T_BUFCLASSES)
+	class = T_BUFCLASSES - 1;
+    while (class > 0 && T_BUFCLASS_SIZE(class) > t_iobufmax)
+	--class;			/* no bigger than allowed */
+	
+    if (f->buf && f->bufclass == class)
+	return;				/* already have it */
+	
+    t_relbuf(f);			/* return the old one */
+    
+    pthread_mutex_lock(&t_buflock);
+    if ((b = t_bufpool[class]) != NULL) { /* take one from pool */
+	t_bufpool[class] = *(u_char **) b;
+	--t_bufpoolcnt[class];
+	++t_bufstats[f->kind].hits;
+    } else
+	++t_bufstats[f->kind].misses;
+    pthread_mutex_unlock(&t_buflock);
+    
+    if (!b)
+	b = (u_char *) mallocf(T_BUFCLASS_SIZE(class));
+	
+    f->buf = f->ptr = b;
+    f->bufsize = T_BUFCLASS_SIZE(class);
+    f->bufclass = class;
+}
+
+/* t_relbuf --
+
+    Return file's buffer (if any) to the pool.
+*/
+
+static void t_relbuf(t_file *f) {
+
+    u_char	*b;
+    
+    if ((b = f->buf) == NULL)
+	return;
+    f->buf = f->ptr = NULL;
+    f->bufsize = f->count = 0;
+    
+    pthread_mutex_lock(&t_buflock);
+    if (t_bufpoolcnt[f->bufclass] < t_iobufpool) { /* room in pool? */
+	*(u_char **) b = t_bufpool[f->bufclass];
+	t_bufpool[f->bufclass] = b;
+	++t_bufpoolcnt[f->bufclass];
+	b = NULL;
+    }
+    pthread_mutex_unlock(&t_buflock);
+    
+    if (b)				/* pool full; really free it */
+	t_free(b);
+    f->bufclass = -1;
+}
+
+/* t_bufadapt --
+
+    Choose size class for the next buffer, given the length moved by
+    the last read/flush.
+*/
+
+static int t_bufadapt(t_file *f, int len) {
+
+    if (!f->buf)			/* first time: start at minimum */
+	return f->minclass;
+    if (len >= f->bufsize)		/* filled it: bulk transfer */
+	return f->bufclass + 1;
+    if (len < T_BUFSIZ)		/* short: interactive traffic */
+	return f->minclass;
+    return f->bufclass;
+}
+
+/* t_iostat --
+
+    Count a read/write, and the number of T_BUFSIZ-sized ones it replaced.
+*/
+
+static void t_iostat(t_file *f, int len) {
+
+    pthread_mutex_lock(&t_buflock);
+    ++t_bufstats[f->kind].syscalls;
+    if (len > T_BUFSIZ)
+	t_bufstats[f->kind].saved += (len - 1) / T_BUFSIZ;
+    pthread_mutex_unlock(&t_buflock);
+}
+
+/* Timer wheel --
+
+    Idle timeouts are kept on a two-level timer wheel, so t_reaper only has
+    to look at files that are actually due, rather than scanning every fd
+    while holding sel_lock.  A file's slot is given by its deadline (iotime +
+    timeout), rounded up to a whole T_WHEEL_TICK.  Level 0 has a slot for
+    each of the next T_WHEEL_SLOTS ticks; each level 1 slot covers
+    T_WHEEL_SLOTS ticks, and is cascaded down into level 0 as the wheel
+    turns.  Anything further out than that waits on the "later" list.
+    
+    Files whose timeout is shortened when the server is busy (loadtimeout)
+    go on a second wheel, keyed on their full timeout but run t_timeout_cut
+    seconds ahead of the clock.  So the whole policy is that one number;
+    t_setcut changes it and the wheel catches up on the next pass.
+    
+    When a slot comes due, each file in it is checked against the current
+    policy; if it has been idle too long it's asked to close, otherwise
+    it's put back in the right place.
+    
+    --> All of these require sel_lock <--
+*/
+
+#define TW_TICKS(t) (((t) + T_WHEEL_TICK - 1) / T_WHEEL_TICK) /* seconds -> ticks (round up) */
+
+/* tw_timeout --
+
+    Current effective timeout for a file (seconds).
+*/
+
+static long tw_timeout(t_file *f) {
+
+    long	t;
+    
+    t = f->timeout;
+    if (f->loadtimeout && t_timeout_cut > 0) {
+	t -= t_timeout_cut;		/* shorter when busy... */
+	if (t < T_MINTIMEOUT)
+	    t = T_MINTIMEOUT;		/* ...but not too short */
+    }
+    return t;
+}
+
+/* tw_where --
+
+    Decide which wheel (and deadline tick) a file belongs on.
+*/
+
+static struct t_wheel *tw_where(t_file *f, long *deadline) {
+
+    /* loadtimeout files go on the load wheel, unless they're already at the 
+       floor, or their deadline has passed by the load wheel's reckoning
+       (because t_timeout_cut went down) */
+    if (f->loadtimeout && tw_timeout(f) > T_MINTIMEOUT
+	&& (*deadline = TW_TICKS(f->iotime + f->timeout)) > t_loadwheel.now)
+	return &t_loadwheel;
+
+    *deadline = TW_TICKS(f->iotime + tw_timeout(f));
+    return &t_idlewheel;
+}
+
+/* tw_link --
+
+    Put file into the proper timer wheel slot.
+*/
+
+static void tw_link(t_file *f) {
+
+    struct t_wheel	*w;		/* wheel to use */
+    long		deadline;	/* tick when we're due */
+    t_file		**slot;		/* slot in it */
+    
+    w = tw_where(f, &deadline);
+    
+    if (deadline <= w->now)		/* already due: next tick */
+	slot = &w->slot[0][(w->now + 1) % T_WHEEL_SLOTS];
+    else if (deadline - w->now < T_WHEEL_SLOTS)
+	slot = &w->slot[0][deadline % T_WHEEL_SLOTS];
+    else if (deadline / T_WHEEL_SLOTS - w->now / T_WHEEL_SLOTS < T_WHEEL_SLOTS)
+	slot = &w->slot[1][(deadline / T_WHEEL_SLOTS) % T_WHEEL_SLOTS];
+    else
+	slot = &w->later;
+	
+    if ((f->tw_next = *slot) != NULL)	/* add to front of chain */
+	f->tw_next->tw_prev = &f->tw_next;
+    *slot = f;
+    f->tw_prev = slot;
+    f->tw = w;
+    f->tw_deadline = deadline;
+}
+
+/* tw_unlink --
+
+    Remove file from timer wheel (if it's on it).
+*/
+
+static void tw_unlink(t_file *f) {
+
+    if (f->tw) {
+	if ((*f->tw_prev = f->tw_next) != NULL)
+	    f->tw_next->tw_prev = f->tw_prev;
+	f->tw = NULL;
+    }
+}
+
+/* tw_update --
+
+    File's iotime or timeout has changed; move it if necessary.
+*/
+
+static void tw_update(t_file *f) {
+
+    struct t_wheel	*w;
+    long		deadline;
+    
+    if (!f->select || f->timeout == 0) { /* no timeout wanted */
+	tw_unlink(f);
+	return;
+    }
+    w = tw_where(f, &deadline);
+    if (f->tw == w && f->tw_deadline == deadline)
+	return;				/* same slot as before */
+    tw_unlink(f);
+    tw_link(f);
+}
+
+/* tw_run --
+
+    Process one slot's chain: close the files that really are idle, and
+    re-link the rest.
+*/
+
+static void tw_run(t_file **slot, long now) {
+
+    t_file	*f, *next;
+    
+    f = *slot;				/* take the whole chain */
+    *slot = NULL;
+    
+    for (; f; f = next) {
+	next = f->tw_next;
+	f->tw = NULL;
+	if (now - f->iotime >= tw_timeout(f)) {
+	    f->want |= SEL_CLOSE;	/* ask connection thread to close */
+#ifdef T_SELCOND
+	    pthread_cond_signal(&f->wait); /* nudge it */
+#endif
+	} else
+	    tw_link(f);			/* not yet; put it back */
+    }
+}
+
+/* tw_turn --
+
+    Advance a wheel to the given tick, cascading the upper levels down
+    as we go.
+*/
+
+static void tw_turn(struct t_wheel *w, long target, long now) {
+
+    while (w->now < target) {
+	++w->now;
+	if (w->now % T_WHEEL_SLOTS == 0) { /* level 0 wrapped */
+	    if ((w->now / T_WHEEL_SLOTS) % T_WHEEL_SLOTS == 0) /* level 1 too */
+		tw_run(&w->later, now);
+	    tw_run(&w->slot[1][(w->now / T_WHEEL_SLOTS) % T_WHEEL_SLOTS], now);
+	}
+	tw_run(&w->slot[0][w->now % T_WHEEL_SLOTS], now);
+    }
+}
+
+/* t_settimeout --
+
+    Set a file's idle timeout (seconds; 0 = none).  If loadtimeout is set,
+    the timeout is shortened by t_timeout_cut when the server is busy.
+*/
+
+void t_settimeout(t_file *f, int secs, boolean_t loadtimeout) {
+
+    pthread_mutex_lock(&sel_lock);
+    f->timeout = secs;
+    f->loadtimeout = loadtimeout;
+    tw_update(f);
+    pthread_mutex_unlock(&sel_lock);
+}
+
+/* t_setcut --
+
+    Set the global timeout policy:  the number of seconds by which
+    loadtimeout files' timeouts are shortened.  If it went up, wake
+    t_reaper to see who's now overdue.
+*/
+
+void t_setcut(long cut) {
+
+    pthread_mutex_lock(&sel_lock);
+    if (cut > t_timeout_cut)
+	pthread_cond_signal(&timeout_wait);
+    t_timeout_cut = cut;
+    pthread_mutex_unlock(&sel_lock);
+}
+
 /* reaper --
 
     Thread to time out idle connections (to keep us from running out of file
-    descriptors.)  mbox_writer wakes us up periodically.  If the number of
-    active users exceeds u_worry, we are awakened immediately.
+    descriptors.)  mbox_writer wakes us up periodically.  If the timeout policy
+    gets more aggressive (t_setcut), we are awakened immediately.
     
     All files governed by t_select are eligible for timeouts if their
-    "timeout" field is non-zero.  Higher-level code is responsible for
-    adjusting the timeout as desired (e.g., to implement the policy of
-    shorter timeouts when there are more users) 
+    "timeout" field is non-zero (see t_settimeout).  Each time we're awakened,
+    turn the timer wheels up to the present; only files that are due get
+    looked at.
 */
 
 any_t t_reaper(any_t zot) {
 
-    int		fd;			/* current file descriptor */
-    t_file	*f;			/* corresponding struct */
     long	now;			/* current time */
 
     setup_signals();			/* set up signal handlers for new thread */
@@ -1064,19 +1738,10 @@ any_t t_reaper(any_t zot) {
 	pthread_mutex_lock(&sel_lock);	/* sync w/ t_select */
 	pthread_cond_wait(&timeout_wait, &sel_lock); /* wait until awakened */
 
-
-	/* check each file with a timeout value set */
 	now = time(NULL);
-	for (fd = 0; fd <= max_used_fd; ++fd)  {
-	    if ((f = t_fdmap[fd]) && f->select && f->timeout) {
-		if (now - f->iotime > f->timeout) {
-		    f->want |= SEL_CLOSE; /* ask connection thread to close */
-#ifdef T_SELECT
-		    pthread_cond_signal(&f->wait); /* nudge it */
-#endif
-		}
-	    }	
-	}
+	tw_turn(&t_idlewheel, now / T_WHEEL_TICK, now);
+	tw_turn(&t_loadwheel, (now + t_timeout_cut) / T_WHEEL_TICK, now);
+	
 	pthread_mutex_unlock(&sel_lock); 
     }
 }
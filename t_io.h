@@ -12,11 +12,45 @@
 #define T_SELECT
 #endif
 
+/* conditionally compile code to use a single epoll thread (t_epoll) to
+   watch all connections, instead of a select() per connection thread */
+#ifdef __linux__
+#define T_EPOLL
+#endif
+
+/* with either of the above, t_selwait blocks on the file's condition
+   variable until the watcher thread says something has happened */
+#if defined(T_SELECT) || defined(T_EPOLL)
+#define T_SELCOND
+#endif
+
 #ifndef EOF
 #define EOF (-1)
 #endif
 
-#define T_BUFSIZ	1024
+#define T_BUFSIZ	1024		/* smallest buffer size */
+#define T_BUFCLASSES	4		/* buffer size classes: T_BUFSIZ * 4^n */
+#define T_BUFCLASS_SIZE(c) (T_BUFSIZ << (2 * (c)))
+#define T_DFT_IOBUFMAX	16384		/* default largest buffer used */
+#define T_DFT_IOBUFPOOL	64		/* default free buffers kept per class */
+
+#define T_KIND_OTHER	0		/* kinds of t_file (for buffer stats) */
+#define T_KIND_FILE	1		/* disk file (t_fopen) */
+#define T_KIND_CLIENT	2		/* Blitz or POP client */
+#define T_KIND_SMTP	3		/* incoming or outgoing SMTP */
+#define T_KINDS		4
+#define T_IOVMAX	16		/* max iovecs to pass to t_fwritev */
+struct iovec;				/* (see <sys/uio.h>) */
+
+#define T_WHEEL_TICK	8		/* seconds per timer wheel slot */
+#define T_WHEEL_SLOTS	64		/* slots per wheel level */
+#define T_MINTIMEOUT	60		/* load can't cut timeouts below this */
+
+struct t_wheel {			/* timer wheel for idle timeouts */
+	long		now;		/* time (ticks) wheel has been run to */
+	struct t_file	*slot[2][T_WHEEL_SLOTS]; /* level 0: 1 tick/slot; level 1: T_WHEEL_SLOTS */
+	struct t_file	*later;		/* beyond level 1 */
+};
 
 struct t_file {
 	int		fd;		/* the file */
@@ -32,13 +66,27 @@ struct t_file {
 	} tel;
 	int		want;		/* select: conditions to check for */
 	int		can;		/* select: conditions that exist now */
-#ifdef T_SELECT
+#ifdef T_SELCOND
 	pthread_cond_t 	wait;		/* wait here for select */
+#endif
+#ifdef T_EPOLL
+	boolean_t	polled;		/* fd is in the epoll set */
+	u_int		selgen;		/* epoll registration generation */
 #endif
 	long		iotime;		/* time of last io */
 	int		timeout;	/* idle timeout (seconds) */
+	boolean_t	loadtimeout;	/* timeout shortened by t_timeout_cut? */
+	struct t_wheel	*tw;		/* timer wheel we're on (if any) */
+	long		tw_deadline;	/* deadline of our slot (ticks) */
+	struct t_file	*tw_next;	/* timer wheel slot chain */
+	struct t_file	**tw_prev;	/* (whatever points to us) */
 	u_char		*ptr;		/* current position in buffer */
-	u_char		buf[T_BUFSIZ];
+	u_char		*buf;		/* buffer (from pool; NULL until needed) */
+	int		bufsize;	/* its size */
+	int		bufclass;	/* its size class (-1 = none) */
+	int		minclass;	/* smallest class to use */
+	int		lastlen;	/* length of last read */
+	int		kind;		/* T_KIND_*, for stats */
 	char		name[FILENAME_MAX]; /* debbuging: name */
 };
 
@@ -70,6 +118,25 @@ pthread_mutex_t		sel_lock;	/* protects sel_* and t_fdmap */
 int maxfds;				/* result of getdtablesize() */
 int max_used_fd;			/* biggest fd seen by t_fopen */
 pthread_cond_t timeout_wait;		/* t_reaper waits here */
+struct t_wheel t_idlewheel;		/* idle timeouts (real time) */
+struct t_wheel t_loadwheel;		/* load-shortened timeouts (now + t_timeout_cut) */
+long t_timeout_cut;			/* load-based timeout reduction (seconds) */
+
+long t_iobufmax;			/* largest buffer to use (IOBUFMAX) */
+long t_iobufpool;			/* free buffers kept per class (IOBUFPOOL) */
+pthread_mutex_t t_buflock;		/* protects buffer pool & t_bufstats */
+struct t_bufstat {
+	long	hits;			/* buffers supplied from pool */
+	long	misses;			/* ...had to be malloced */
+	long	syscalls;		/* reads & writes */
+	long	saved;			/* syscalls saved vs. T_BUFSIZ buffers */
+} t_bufstats[T_KINDS];
+
+#ifdef T_EPOLL
+int	sel_epfd;			/* epoll set watched by t_epoll */
+int	sel_wakefd[2];			/* pipe to wake t_epoll */
+u_int	sel_gen;			/* last registration generation used */
+#endif
 
 #define t_getc(f) ((f)->telnet ? t_telgetc(f) : (--(f)->count >= 0 ?\
 	 (int)(*(unsigned char *)(f)->ptr++) : t_fillbuf(f)))
@@ -90,10 +157,15 @@ int t_flshbuf(t_file *f, int c);
 int t_fread(t_file *f, char *buf, int len);
 long t_fseek(t_file *f, long offset, long whence);
 int t_fwrite(t_file *f, char *p, int len);
+int t_fwritev(t_file *f, struct iovec *iov, int iovcnt);
 void t_ungetc(t_file *f, int c);
 void t_sprintf();
 void t_fprintf();
 void t_ioinit();
 boolean_t t_selwait(t_file *f, int bits);
+void t_selclose(t_file *f);
+void t_selwake();
 void t_skipurg(t_file *f);
+void t_settimeout(t_file *f, int secs, boolean_t loadtimeout);
+void t_setcut(long cut);
 any_t t_reaper(any_t zot);